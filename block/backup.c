@@ -23,6 +23,7 @@
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
@@ -46,6 +47,12 @@ typedef struct BackupBlockJob {
     BackupPerf perf;
 
     BlockCopyState *bcs;
+    /* block_copy_dedup_bytes() once @bcs is gone */
+    int64_t dedup_bytes;
+
+    /* When the job started and stopped copying, for the throughput */
+    int64_t start_ns;
+    int64_t end_ns;
 
     bool wait;
     BlockCopyCallState *bg_bcs_call;
@@ -102,6 +109,9 @@ static void backup_clean(Job *job)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
     block_job_remove_all_bdrv(&s->common);
+    s->dedup_bytes = block_copy_dedup_bytes(s->bcs);
+    s->bcs = NULL;
+    s->end_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bdrv_cbw_drop(s->cbw);
 }
 
@@ -254,6 +264,7 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
     int ret;
 
+    s->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     backup_init_bcs_bitmap(s);
 
     if (s->sync_mode == MIRROR_SYNC_MODE_TOP) {
@@ -327,6 +338,30 @@ static void coroutine_fn backup_set_speed(BlockJob *job, int64_t speed)
     }
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+    int64_t end_ns = s->end_ns ?: qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t current, total, low, high;
+
+    info->has_backup = true;
+    info->backup = g_new0(BlockJobInfoBackup, 1);
+
+    progress_get_snapshot(&job->job.progress, &current, &total);
+    if (s->start_ns && end_ns > s->start_ns) {
+        /* muldiv64() would truncate the elapsed time to 32 bits */
+        mulu64(&low, &high, current, NANOSECONDS_PER_SECOND);
+        divu128(&low, &high, end_ns - s->start_ns);
+        info->backup->throughput = high ? INT64_MAX : MIN(low, INT64_MAX);
+    }
+
+    if (s->perf.dedup) {
+        info->backup->has_dedup_bytes = true;
+        info->backup->dedup_bytes = s->bcs ? block_copy_dedup_bytes(s->bcs) :
+                                             s->dedup_bytes;
+    }
+}
+
 static bool backup_cancel(Job *job, bool force)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
@@ -349,6 +384,7 @@ static const BlockJobDriver backup_job_driver = {
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
+    .query = backup_query,
 };
 
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
@@ -486,7 +522,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->len = len;
     job->perf = *perf;
 
-    block_copy_set_copy_opts(bcs, perf->use_copy_range, compress);
+    block_copy_set_copy_opts(bcs, perf->use_copy_range, compress, perf->dedup);
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
     block_copy_set_speed(bcs, speed);
 
@@ -24,6 +24,7 @@
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
@@ -125,6 +126,11 @@ typedef struct BlockCopyState {
     int64_t max_transfer;
     uint64_t len;
     BdrvRequestFlags write_flags;
+    /*
+     * Compare with the target's data and only write clusters that differ.
+     * Set in block_copy_set_copy_opts().
+     */
+    bool dedup;
 
     /*
      * Fields whose state changes throughout the execution
@@ -155,6 +161,8 @@ typedef struct BlockCopyState {
     ProgressMeter *progress;
     SharedResource *mem;
     RateLimit rate_limit;
+    /* Bytes not written because the target already held the same data */
+    Stat64 dedup_bytes;
 } BlockCopyState;
 
 /* Called with lock held */
@@ -242,6 +250,12 @@ static void coroutine_fn block_copy_task_shrink(BlockCopyTask *task,
     reqlist_shrink_req(&task->req, new_bytes);
 }
 
+/* Memory needed for the buffers of @task, see block_copy_do_copy() */
+static int64_t block_copy_task_mem(BlockCopyTask *task)
+{
+    return task->s->dedup ? task->req.bytes * 2 : task->req.bytes;
+}
+
 static void coroutine_fn block_copy_task_end(BlockCopyTask *task, int ret)
 {
     QEMU_LOCK_GUARD(&task->s->lock);
@@ -278,12 +292,19 @@ static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
 }
 
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
-                              bool compress)
+                              bool compress, bool dedup)
 {
     /* Keep BDRV_REQ_SERIALISING set (or not set) in block_copy_state_new() */
     s->write_flags = (s->write_flags & BDRV_REQ_SERIALISING) |
         (compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
 
+    /*
+     * When fleecing, reads from the target fall through to the source for
+     * clusters that have not been copied yet, so there is nothing to compare
+     * with.
+     */
+    s->dedup = dedup && !(s->write_flags & BDRV_REQ_SERIALISING);
+
     if (s->max_transfer < s->cluster_size) {
         /*
          * copy_range does not respect max_transfer. We don't want to bother
@@ -295,6 +316,9 @@ void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
     } else if (compress) {
         /* Compression supports only cluster-size writes and no copy-range. */
         s->method = COPY_READ_WRITE_CLUSTER;
+    } else if (s->dedup) {
+        /* The data has to pass through our buffers to be compared */
+        s->method = COPY_READ_WRITE;
     } else {
         /*
          * If copy range enabled, start with COPY_RANGE_SMALL, until first
@@ -404,7 +428,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                     cluster_size),
     };
 
-    block_copy_set_copy_opts(s, false, false);
+    block_copy_set_copy_opts(s, false, false, false);
 
     ratelimit_init(&s->rate_limit);
     qemu_co_mutex_init(&s->lock);
@@ -441,7 +465,7 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
 
     aio_task_pool_wait_slot(pool);
     if (aio_task_pool_status(pool) < 0) {
-        co_put_to_shres(task->s->mem, task->req.bytes);
+        co_put_to_shres(task->s->mem, block_copy_task_mem(task));
         block_copy_task_end(task, -ECANCELED);
         g_free(task);
         return -ECANCELED;
@@ -452,6 +476,57 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+/*
+ * Write @buf to the target at @offset, skipping clusters whose content the
+ * target already holds.  If the target cannot be read, just write it all.
+ */
+static int coroutine_fn block_copy_write_changed(BlockCopyState *s,
+                                                 int64_t offset, int64_t bytes,
+                                                 uint8_t *buf)
+{
+    uint8_t *target_buf = qemu_blockalign(s->target->bs, bytes);
+    int64_t pos, run = 0, skipped = 0;
+    int ret;
+
+    ret = bdrv_co_pread(s->target, offset, bytes, target_buf, 0);
+    if (ret < 0) {
+        qemu_vfree(target_buf);
+        return bdrv_co_pwrite(s->target, offset, bytes, buf, s->write_flags);
+    }
+
+    /* @run is where the current run of changed clusters starts */
+    for (pos = 0; pos < bytes; pos += s->cluster_size) {
+        int64_t len = MIN(s->cluster_size, bytes - pos);
+
+        if (memcmp(buf + pos, target_buf + pos, len)) {
+            continue;
+        }
+
+        skipped += len;
+        if (run < pos) {
+            ret = bdrv_co_pwrite(s->target, offset + run, pos - run,
+                                 buf + run, s->write_flags);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+        run = pos + len;
+    }
+
+    if (run < bytes) {
+        ret = bdrv_co_pwrite(s->target, offset + run, bytes - run, buf + run,
+                             s->write_flags);
+    }
+
+out:
+    qemu_vfree(target_buf);
+    if (ret >= 0 && skipped) {
+        trace_block_copy_dedup(s, offset, skipped);
+        stat64_add(&s->dedup_bytes, skipped);
+    }
+    return ret;
+}
+
 /*
  * block_copy_do_copy
  *
@@ -527,8 +602,12 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
             goto out;
         }
 
-        ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
-                             s->write_flags);
+        if (s->dedup) {
+            ret = block_copy_write_changed(s, offset, nbytes, bounce_buffer);
+        } else {
+            ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
+                                 s->write_flags);
+        }
         if (ret < 0) {
             trace_block_copy_write_fail(s, offset, ret);
             *error_is_read = false;
@@ -571,7 +650,7 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
             progress_work_done(s->progress, t->req.bytes);
         }
     }
-    co_put_to_shres(s->mem, t->req.bytes);
+    co_put_to_shres(s->mem, block_copy_task_mem(t));
     block_copy_task_end(t, ret);
 
     return ret;
@@ -770,7 +849,7 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         trace_block_copy_process(s, task->req.offset);
 
-        co_get_from_shres(s->mem, task->req.bytes);
+        co_get_from_shres(s->mem, block_copy_task_mem(task));
 
         offset = task_end(task);
         bytes = end - offset;
@@ -990,6 +1069,11 @@ int64_t block_copy_cluster_size(BlockCopyState *s)
     return s->cluster_size;
 }
 
+int64_t block_copy_dedup_bytes(BlockCopyState *s)
+{
+    return stat64_get(&s->dedup_bytes);
+}
+
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
 {
     qatomic_set(&s->skip_unallocated, skip);
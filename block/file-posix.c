@@ -148,6 +148,7 @@ typedef struct BDRVRawState {
     uint64_t locked_shared_perm;
 
     uint64_t aio_max_batch;
+    unsigned int luring_flags;  /* AIO_LURING_* flags of the io_uring ring */
 
     int perm_change_fd;
     int perm_change_flags;
@@ -155,6 +156,7 @@ typedef struct BDRVRawState {
 
     bool has_discard:1;
     bool has_write_zeroes:1;
+    bool has_clone_range:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
@@ -164,6 +166,9 @@ typedef struct BDRVRawState {
     bool force_alignment;
     bool drop_cache;
     bool check_cache_dropped;
+
+    /* Known RawExtents of the file, see raw_extent_cache_usable() */
+    GTree *extent_cache;
     struct {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
@@ -173,6 +178,16 @@ typedef struct BDRVRawState {
     PRManager *pr_mgr;
 } BDRVRawState;
 
+/* A range of the file that SEEK_DATA/SEEK_HOLE found to be data or a hole */
+typedef struct RawExtent {
+    int64_t offset;
+    int64_t bytes;
+    bool zero;
+} RawExtent;
+
+/* Maximum number of cached extents before the cache is emptied */
+#define RAW_EXTENT_CACHE_MAX 16384
+
 typedef struct BDRVRawReopenState {
     int open_flags;
     bool drop_cache;
@@ -551,6 +566,11 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "io-uring-poll",
+            .type = QEMU_OPT_STRING,
+            .help = "io_uring kernel polling (off, sq, io, sq-io, default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -579,6 +599,80 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+static gint raw_extent_cmp(gconstpointer a, gconstpointer b)
+{
+    const RawExtent *ea = a, *eb = b;
+
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/* Search function for the extent that overlaps with the RawExtent @data */
+static gint raw_extent_search(gconstpointer key, gconstpointer data)
+{
+    const RawExtent *e = key, *range = data;
+
+    if (range->offset + range->bytes <= e->offset) {
+        return -1;
+    } else if (range->offset >= e->offset + e->bytes) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Holes are only cached if nobody else can write to the file: a stale
+ * hole would make block-status report zeroes over data.  Writes through
+ * this node invalidate the cache.
+ */
+static bool raw_extent_cache_usable(BDRVRawState *s)
+{
+    return s->use_lock && !(s->shared_perm & BLK_PERM_WRITE);
+}
+
+static void raw_extent_cache_clear(BDRVRawState *s)
+{
+    if (g_tree_nnodes(s->extent_cache)) {
+        g_tree_destroy(s->extent_cache);
+        s->extent_cache = g_tree_new_full((GCompareDataFunc) raw_extent_cmp,
+                                          NULL, g_free, NULL);
+    }
+}
+
+/* Forget what is known about [offset, offset + bytes) */
+static void raw_extent_cache_invalidate(BDRVRawState *s, int64_t offset,
+                                        int64_t bytes)
+{
+    RawExtent range = { .offset = offset, .bytes = bytes };
+    RawExtent *e;
+
+    while ((e = g_tree_search(s->extent_cache, raw_extent_search, &range))) {
+        g_tree_remove(s->extent_cache, e);
+    }
+}
+
+static void raw_extent_cache_add(BDRVRawState *s, int64_t offset,
+                                 int64_t bytes, bool zero)
+{
+    RawExtent *e;
+
+    if (!raw_extent_cache_usable(s) || bytes <= 0) {
+        return;
+    }
+
+    if (g_tree_nnodes(s->extent_cache) >= RAW_EXTENT_CACHE_MAX) {
+        raw_extent_cache_clear(s);
+    }
+    raw_extent_cache_invalidate(s, offset, bytes);
+
+    e = g_new(RawExtent, 1);
+    *e = (RawExtent) {
+        .offset = offset,
+        .bytes  = bytes,
+        .zero   = zero,
+    };
+    g_tree_insert(s->extent_cache, e, e);
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -589,6 +683,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     const char *filename = NULL;
     const char *str;
     BlockdevAioOptions aio, aio_default;
+    BlockdevIoUringPoll io_uring_poll;
     int fd, ret;
     struct stat st;
     OnOffAuto locking;
@@ -632,6 +727,37 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
 
+    io_uring_poll = qapi_enum_parse(&BlockdevIoUringPoll_lookup,
+                                    qemu_opt_get(opts, "io-uring-poll"),
+                                    BLOCKDEV_IO_URING_POLL_OFF, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (io_uring_poll != BLOCKDEV_IO_URING_POLL_OFF &&
+        aio != BLOCKDEV_AIO_OPTIONS_IO_URING) {
+        error_setg(errp, "io-uring-poll requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+    switch (io_uring_poll) {
+    case BLOCKDEV_IO_URING_POLL_OFF:
+        s->luring_flags = 0;
+        break;
+    case BLOCKDEV_IO_URING_POLL_SQ:
+        s->luring_flags = AIO_LURING_SQPOLL;
+        break;
+    case BLOCKDEV_IO_URING_POLL_IO:
+        s->luring_flags = AIO_LURING_IOPOLL;
+        break;
+    case BLOCKDEV_IO_URING_POLL_SQ_IO:
+        s->luring_flags = AIO_LURING_SQPOLL | AIO_LURING_IOPOLL;
+        break;
+    default:
+        abort();
+    }
+
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
                               ON_OFF_AUTO_AUTO, &local_err);
@@ -726,7 +852,17 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+        /* Polled completions only exist for direct I/O */
+        if ((s->luring_flags & AIO_LURING_IOPOLL) &&
+            !(s->open_flags & O_DIRECT)) {
+            error_setg(errp, "io-uring-poll=%s requires cache.direct=on, "
+                       "which was not specified.",
+                       BlockdevIoUringPoll_str(io_uring_poll));
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs),
+                                      s->luring_flags, errp)) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
         }
@@ -742,6 +878,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_clone_range = true;
 
     if (fstat(s->fd, &st) < 0) {
         ret = -errno;
@@ -805,6 +942,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+    s->extent_cache = g_tree_new_full((GCompareDataFunc) raw_extent_cmp,
+                                      NULL, g_free, NULL);
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1787,6 +1927,46 @@ static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
 }
 #endif
 
+#ifdef FICLONERANGE
+/*
+ * Make the destination range share the blocks of the source range instead of
+ * copying them.  The file system requires both ranges to be aligned to its
+ * block size, so this fails with -EINVAL for some requests; only errors that
+ * mean it will never work for this file disable it.
+ */
+static int handle_aiocb_clone_range(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct file_clone_range range = {
+        .src_fd         = aiocb->aio_fildes,
+        .src_offset     = aiocb->aio_offset,
+        .src_length     = aiocb->aio_nbytes,
+        .dest_offset    = aiocb->copy_range.aio_offset2,
+    };
+    int ret;
+
+    do {
+        ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+    } while (ret < 0 && errno == EINTR);
+    ret = ret < 0 ? -errno : 0;
+
+    trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                           aiocb->copy_range.aio_fd2,
+                           aiocb->copy_range.aio_offset2, aiocb->aio_nbytes,
+                           ret);
+
+    switch (ret) {
+    case -ENOTSUP:
+    case -ENOTTY:
+    case -EXDEV:
+    case -EPERM:
+        s->has_clone_range = false;
+        break;
+    }
+    return ret;
+}
+#endif
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -1794,6 +1974,15 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+#ifdef FICLONERANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+
+    /* copy_file_range() may copy the data even where it could be shared */
+    if (s->has_clone_range && handle_aiocb_clone_range(aiocb) == 0) {
+        return 0;
+    }
+#endif
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -2066,7 +2255,8 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         assert(qiov->size == bytes);
         return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
@@ -2106,8 +2296,13 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, int64_t offset,
                                        int64_t bytes, QEMUIOVector *qiov,
                                        BdrvRequestFlags flags)
 {
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
     assert(flags == 0);
-    return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
+    ret = raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
+    raw_extent_cache_invalidate(s, offset, bytes);
+    return ret;
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
@@ -2121,7 +2316,8 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         luring_io_plug(bs, aio);
     }
 #endif
@@ -2138,7 +2334,8 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         luring_io_unplug(bs, aio);
     }
 #endif
@@ -2162,8 +2359,10 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
     };
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    /* Polled rings cannot flush, fall back to the thread pool */
+    if (s->use_linux_io_uring && !(s->luring_flags & AIO_LURING_IOPOLL)) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
@@ -2187,7 +2386,8 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
         Error *local_err = NULL;
-        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+        if (!aio_setup_linux_io_uring(new_context, s->luring_flags,
+                                      &local_err)) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
@@ -2200,6 +2400,9 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    g_tree_destroy(s->extent_cache);
+    s->extent_cache = NULL;
+
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -2240,6 +2443,8 @@ static int coroutine_fn raw_co_truncate(BlockDriverState *bs, int64_t offset,
     struct stat st;
     int ret;
 
+    raw_extent_cache_clear(s);
+
     if (fstat(s->fd, &st)) {
         ret = -errno;
         error_setg_errno(errp, -ret, "Failed to fstat() the file");
@@ -2248,7 +2453,9 @@ static int coroutine_fn raw_co_truncate(BlockDriverState *bs, int64_t offset,
 
     if (S_ISREG(st.st_mode)) {
         /* Always resizes to the exact @offset */
-        return raw_regular_truncate(bs, s->fd, offset, prealloc, errp);
+        ret = raw_regular_truncate(bs, s->fd, offset, prealloc, errp);
+        raw_extent_cache_clear(s);
+        return ret;
     }
 
     if (prealloc != PREALLOC_MODE_OFF) {
@@ -2772,6 +2979,7 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
                                             int64_t *map,
                                             BlockDriverState **file)
 {
+    BDRVRawState *s = bs->opaque;
     off_t data = 0, hole = 0;
     int ret;
 
@@ -2789,6 +2997,20 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
         return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
     }
 
+    if (raw_extent_cache_usable(s)) {
+        RawExtent range = { .offset = offset, .bytes = 1 };
+        RawExtent *e = g_tree_search(s->extent_cache, raw_extent_search,
+                                     &range);
+        if (e) {
+            *pnum = e->offset + e->bytes - offset;
+            *map = offset;
+            *file = bs;
+            trace_file_extent_cache_hit(bs, offset, *pnum, e->zero);
+            return (e->zero ? BDRV_BLOCK_ZERO : BDRV_BLOCK_DATA) |
+                   BDRV_BLOCK_OFFSET_VALID;
+        }
+    }
+
     ret = find_allocation(bs, offset, &data, &hole);
     if (ret == -ENXIO) {
         /* Trailing hole */
@@ -2816,11 +3038,13 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
             *pnum = ROUND_UP(*pnum, bs->bl.request_alignment);
         }
 
+        raw_extent_cache_add(s, offset, *pnum, false);
         ret = BDRV_BLOCK_DATA;
     } else {
         /* On a hole, compute bytes to the beginning of the next extent.  */
         assert(hole == offset);
         *pnum = data - offset;
+        raw_extent_cache_add(s, offset, *pnum, true);
         ret = BDRV_BLOCK_ZERO;
     }
     *map = offset;
@@ -2910,6 +3134,9 @@ static void coroutine_fn raw_co_invalidate_cache(BlockDriverState *bs,
         return;
     }
 
+    /* The migration source may have changed the file */
+    raw_extent_cache_clear(s);
+
     if (!s->drop_cache) {
         return;
     }
@@ -2949,6 +3176,25 @@ static void coroutine_fn raw_co_invalidate_cache(BlockDriverState *bs,
 #endif /* !__linux__ */
 }
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE)
+/*
+ * Return the io_uring ring of @bs if fallocate() can be submitted to it
+ * instead of the thread pool, or NULL.
+ */
+static LuringState *raw_luring_fallocate(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    if (!s->use_linux_io_uring) {
+        return NULL;
+    }
+
+    aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs), s->luring_flags);
+    return luring_has_fallocate(aio) ? aio : NULL;
+}
+#endif
+
 static void raw_account_discard(BDRVRawState *s, uint64_t nbytes, int ret)
 {
     if (ret) {
@@ -2979,8 +3225,29 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+    if (!blkdev && s->has_discard) {
+        LuringState *aio = raw_luring_fallocate(bs);
+
+        if (aio) {
+            ret = luring_co_fallocate(bs, aio, s->fd,
+                                      FALLOC_FL_PUNCH_HOLE |
+                                      FALLOC_FL_KEEP_SIZE,
+                                      offset, bytes);
+            ret = translate_err(ret);
+            if (ret == -ENOTSUP) {
+                s->has_discard = false;
+            }
+            raw_account_discard(s, bytes, ret);
+            raw_extent_cache_invalidate(s, offset, bytes);
+            return ret;
+        }
+    }
+#endif
+
     ret = raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
     raw_account_discard(s, bytes, ret);
+    raw_extent_cache_invalidate(s, offset, bytes);
     return ret;
 }
 
@@ -2990,6 +3257,59 @@ raw_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
     return raw_do_pdiscard(bs, offset, bytes, false);
 }
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE)
+/*
+ * Try the common ways of writing zeroes to a regular file through io_uring,
+ * like handle_aiocb_write_zeroes_unmap() and handle_aiocb_write_zeroes()
+ * do.  Returns -ENOTSUP if the caller should use the thread pool, which
+ * also knows the rarer fallbacks.
+ */
+static int coroutine_fn
+raw_luring_write_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                        BdrvRequestFlags flags)
+{
+    BDRVRawState *s G_GNUC_UNUSED = bs->opaque;
+    LuringState *aio = raw_luring_fallocate(bs);
+
+    if (!aio) {
+        return -ENOTSUP;
+    }
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    if (flags & BDRV_REQ_MAY_UNMAP) {
+        int ret = luring_co_fallocate(bs, aio, s->fd,
+                                      FALLOC_FL_PUNCH_HOLE |
+                                      FALLOC_FL_KEEP_SIZE,
+                                      offset, bytes);
+        ret = translate_err(ret);
+        switch (ret) {
+        case -ENOTSUP:
+        case -EINVAL:
+        case -EBUSY:
+            break;
+        default:
+            return ret;
+        }
+    }
+#endif
+
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    if (s->has_write_zeroes) {
+        int ret = luring_co_fallocate(bs, aio, s->fd, FALLOC_FL_ZERO_RANGE,
+                                      offset, bytes);
+        ret = translate_err(ret);
+        if (ret == -ENOTSUP) {
+            s->has_write_zeroes = false;
+        } else if (ret != -EINVAL) {
+            return ret;
+        }
+    }
+#endif
+
+    return -ENOTSUP;
+}
+#endif
+
 static int coroutine_fn
 raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
                      BdrvRequestFlags flags, bool blkdev)
@@ -3047,6 +3367,15 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
         acb.aio_type |= QEMU_AIO_NO_FALLBACK;
     }
 
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE)
+    if (!blkdev) {
+        int ret = raw_luring_write_zeroes(bs, offset, bytes, flags);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+#endif
+
     if (flags & BDRV_REQ_MAY_UNMAP) {
         acb.aio_type |= QEMU_AIO_DISCARD;
         handler = handle_aiocb_write_zeroes_unmap;
@@ -3061,7 +3390,10 @@ static int coroutine_fn raw_co_pwrite_zeroes(
     BlockDriverState *bs, int64_t offset,
     int64_t bytes, BdrvRequestFlags flags)
 {
-    return raw_do_pwrite_zeroes(bs, offset, bytes, flags, false);
+    int ret = raw_do_pwrite_zeroes(bs, offset, bytes, flags, false);
+
+    raw_extent_cache_invalidate(bs->opaque, offset, bytes);
+    return ret;
 }
 
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -3205,6 +3537,9 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     raw_handle_perm_lock(bs, RAW_PL_COMMIT, perm, shared, NULL);
     s->perm = perm;
     s->shared_perm = shared;
+
+    /* Others may have written to the file while they were allowed to */
+    raw_extent_cache_clear(s);
 }
 
 static void raw_abort_perm_update(BlockDriverState *bs)
@@ -3242,6 +3577,7 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     RawPosixAIOData acb;
     BDRVRawState *s = bs->opaque;
     BDRVRawState *src_s;
+    int ret;
 
     assert(dst->bs == bs);
     if (src->bs->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
@@ -3265,7 +3601,9 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
         },
     };
 
-    return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
+    ret = raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
+    raw_extent_cache_invalidate(s, dst_offset, bytes);
+    return ret;
 }
 
 BlockDriver bdrv_file = {
@@ -3639,7 +3977,9 @@ static coroutine_fn int hdev_co_pwrite_zeroes(BlockDriverState *bs,
         return rc;
     }
 
-    return raw_do_pwrite_zeroes(bs, offset, bytes, flags, true);
+    rc = raw_do_pwrite_zeroes(bs, offset, bytes, flags, true);
+    raw_extent_cache_invalidate(bs->opaque, offset, bytes);
+    return rc;
 }
 
 static BlockDriver bdrv_host_device = {
@@ -746,6 +746,27 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+/* Called with bs->reqs_lock held */
+static BdrvTrackedRequestList *
+tracked_request_bucket(BlockDriverState *bs, int64_t granule)
+{
+    return &bs->tracked_requests_index[granule % BDRV_TRACKED_REQ_BUCKETS];
+}
+
+/* Called with req->bs->reqs_lock held */
+static void tracked_request_index(BdrvTrackedRequest *req)
+{
+    BdrvTrackedRequestList *list;
+
+    if (req->overlap_bytes > (1LL << BDRV_TRACKED_REQ_GRANULE_BITS)) {
+        list = &req->bs->tracked_requests_large;
+    } else {
+        list = tracked_request_bucket(req->bs, req->overlap_offset >>
+                                      BDRV_TRACKED_REQ_GRANULE_BITS);
+    }
+    QLIST_INSERT_HEAD(list, req, index_list);
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -759,6 +780,7 @@ static void tracked_request_end(BdrvTrackedRequest *req)
 
     qemu_co_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
+    QLIST_REMOVE(req, index_list);
     qemu_co_queue_restart_all(&req->wait_queue);
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
 }
@@ -789,6 +811,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_index(req);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
@@ -810,11 +833,12 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
 
 /* Called with self->bs->reqs_lock held */
 static BdrvTrackedRequest *
-bdrv_find_conflicting_request(BdrvTrackedRequest *self)
+bdrv_find_conflicting_request_in(BdrvTrackedRequest *self,
+                                 BdrvTrackedRequestList *list)
 {
     BdrvTrackedRequest *req;
 
-    QLIST_FOREACH(req, &self->bs->tracked_requests, list) {
+    QLIST_FOREACH(req, list, index_list) {
         if (req == self || (!req->serialising && !self->serialising)) {
             continue;
         }
@@ -842,6 +866,44 @@ bdrv_find_conflicting_request(BdrvTrackedRequest *self)
     return NULL;
 }
 
+/* Called with self->bs->reqs_lock held */
+static BdrvTrackedRequest *
+bdrv_find_conflicting_request(BdrvTrackedRequest *self)
+{
+    BlockDriverState *bs = self->bs;
+    BdrvTrackedRequest *req;
+    int64_t first, last, granule;
+
+    req = bdrv_find_conflicting_request_in(self, &bs->tracked_requests_large);
+    if (req) {
+        return req;
+    }
+
+    /*
+     * Requests in the index are at most one granule long, so only those
+     * starting in the granule before self or in the ones it covers can
+     * overlap with it.
+     */
+    first = MAX((self->overlap_offset >> BDRV_TRACKED_REQ_GRANULE_BITS) - 1, 0);
+    last = (self->overlap_offset + self->overlap_bytes - 1) >>
+           BDRV_TRACKED_REQ_GRANULE_BITS;
+    if (last - first >= BDRV_TRACKED_REQ_BUCKETS) {
+        first = 0;
+        last = BDRV_TRACKED_REQ_BUCKETS - 1;
+    }
+
+    for (granule = first; granule <= last; granule++) {
+        BdrvTrackedRequestList *list = tracked_request_bucket(bs, granule);
+
+        req = bdrv_find_conflicting_request_in(self, list);
+        if (req) {
+            return req;
+        }
+    }
+
+    return NULL;
+}
+
 /* Called with self->bs->reqs_lock held */
 static bool coroutine_fn
 bdrv_wait_serialising_requests_locked(BdrvTrackedRequest *self)
@@ -876,6 +938,10 @@ static void tracked_request_set_serialising(BdrvTrackedRequest *req,
 
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+    /* The overlap range may have moved to another granule */
+    QLIST_REMOVE(req, index_list);
+    tracked_request_index(req);
 }
 
 /**
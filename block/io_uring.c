@@ -17,6 +17,7 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "trace.h"
 
 /* io_uring ring size */
@@ -51,6 +52,12 @@ typedef struct LuringState {
 
     struct io_uring ring;
 
+    /* AIO_LURING_* flags the ring was created with */
+    unsigned int flags;
+
+    /* Whether the kernel supports IORING_OP_FALLOCATE */
+    bool has_fallocate;
+
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
 
@@ -110,6 +117,36 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+/**
+ * luring_iopoll:
+ *
+ * With IORING_SETUP_IOPOLL, completions are not posted by interrupts but
+ * only when the device is polled, which io_uring_enter() does on behalf of
+ * the caller.  Do one non-blocking pass over the in-flight requests; for
+ * IOPOLL rings, liburing enters the kernel even when no completion is
+ * waited for.
+ */
+static void luring_iopoll(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    if (!(s->flags & AIO_LURING_IOPOLL) || !s->io_q.in_flight) {
+        return;
+    }
+
+    do {
+        ret = io_uring_wait_cqe_nr(&s->ring, &cqe, 0);
+    } while (ret == -EINTR);
+
+    /* -EAGAIN only means that nothing has completed yet */
+    if (ret < 0 && ret != -EAGAIN) {
+        trace_luring_iopoll_failed(s, ret);
+        error_report_once("Failed to poll io_uring completions: %s",
+                          strerror(-ret));
+    }
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -144,6 +181,8 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    luring_iopoll(s);
+
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -218,7 +257,14 @@ end:
             aio_co_wake(luringcb->co);
         }
     }
-    qemu_bh_cancel(s->completion_bh);
+
+    /*
+     * Polled completions never make the ring file descriptor readable, so
+     * keep polling from the BH as long as requests are in flight.
+     */
+    if (!(s->flags & AIO_LURING_IOPOLL) || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 }
 
 static int ioq_submit(LuringState *s)
@@ -292,6 +338,7 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    luring_iopoll(s);
     return io_uring_cq_ready(&s->ring);
 }
 
@@ -328,6 +375,31 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/**
+ * luring_enqueue:
+ * @s: AIO state
+ * @luringcb: AIO control block with a prepared sqe
+ *
+ * Adds the request to the pending queue and submits it unless plugged
+ */
+static int luring_enqueue(LuringState *s, LuringAIOCB *luringcb)
+{
+    int ret;
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ret = ioq_submit(s);
+        trace_luring_do_submit_done(s, ret);
+        return ret;
+    }
+    return 0;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -342,7 +414,6 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
-    int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
 
     switch (type) {
@@ -355,6 +426,8 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_FLUSH:
+        /* The kernel rejects fsync on polled rings */
+        assert(!(s->flags & AIO_LURING_IOPOLL));
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
         break;
     default:
@@ -364,18 +437,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     }
     io_uring_sqe_set_data(sqes, luringcb);
 
-    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
-    s->io_q.in_queue++;
-    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
-                           s->io_q.in_queue, s->io_q.in_flight);
-    if (!s->io_q.blocked &&
-        (!s->io_q.plugged ||
-         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
-        ret = ioq_submit(s);
-        trace_luring_do_submit_done(s, ret);
-        return ret;
-    }
-    return 0;
+    return luring_enqueue(s, luringcb);
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
@@ -402,6 +464,46 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+bool luring_has_fallocate(LuringState *s)
+{
+    return s->has_fallocate;
+}
+
+/**
+ * luring_co_fallocate:
+ *
+ * Submits fallocate(@fd, @mode, @offset, @len) to the ring.  Must only be
+ * called if luring_has_fallocate() returns true.
+ */
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int mode, uint64_t offset,
+                                     uint64_t len)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+    };
+
+    assert(s->has_fallocate);
+    trace_luring_co_fallocate(bs, s, &luringcb, fd, mode, offset, len);
+
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+    io_uring_prep_fallocate(&luringcb.sqeq, fd, mode, offset, len);
+#endif
+    io_uring_sqe_set_data(&luringcb.sqeq, &luringcb);
+
+    ret = luring_enqueue(s, &luringcb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd, false,
@@ -419,21 +521,55 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+/**
+ * luring_init:
+ * @flags: AIO_LURING_* flags
+ *
+ * With AIO_LURING_SQPOLL a kernel thread picks up submissions, so that
+ * io_uring_submit() only needs a system call when the thread went idle.
+ * With AIO_LURING_IOPOLL completions are busy-polled from the device
+ * instead of being signalled by interrupts; this only works for files
+ * opened with O_DIRECT on devices that support polling, and not for
+ * flushes.
+ */
+LuringState *luring_init(unsigned int flags, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    unsigned int setup_flags = 0;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (flags & AIO_LURING_SQPOLL) {
+        setup_flags |= IORING_SETUP_SQPOLL;
+    }
+    if (flags & AIO_LURING_IOPOLL) {
+        setup_flags |= IORING_SETUP_IOPOLL;
+    }
+
+    rc = io_uring_queue_init(MAX_ENTRIES, ring, setup_flags);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
 
+    s->flags = flags;
+
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+    /* Polled rings only support read and write operations */
+    if (!(flags & AIO_LURING_IOPOLL)) {
+        struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+
+        if (probe) {
+            s->has_fallocate = io_uring_opcode_supported(probe,
+                                                         IORING_OP_FALLOCATE);
+            io_uring_free_probe(probe);
+        }
+    }
+#endif
+
     ioq_init(&s->io_q);
     return s;
 
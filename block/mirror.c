@@ -29,6 +29,9 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* How often the in-flight window is adapted, see mirror_update_window() */
+#define MIRROR_WINDOW_PERIOD_NS (100 * SCALE_MS)
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -76,12 +79,38 @@ typedef struct MirrorBlockJob {
     int in_flight;
     int64_t bytes_in_flight;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+    int max_in_flight;
+
+    /*
+     * Adaptive limits for background copying: at most @window bytes are in
+     * flight, in operations of at most @max_io_bytes.  See
+     * mirror_update_window().
+     */
+    int64_t window;
+    int64_t max_io_bytes;
+    int64_t period_start_ns;
+    int64_t period_bytes;
+    int64_t period_lat_ns;
+    int period_ops;
+    int64_t min_lat_ns;
+    int64_t throughput;
+
     int ret;
     bool unmap;
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
     int in_active_write_counter;
+
+    /*
+     * Active writes in write-async mode whose copy to the target has not
+     * completed yet, and the bounds that make further writes wait for it.
+     */
+    int in_async_write_counter;
+    int64_t async_bytes;
+    int64_t max_lag;
+    int64_t max_lag_ns;
+
     bool prepared;
     bool in_drain;
 } MirrorBlockJob;
@@ -104,7 +133,12 @@ struct MirrorOp {
 
     bool is_pseudo_op;
     bool is_active_write;
+    bool is_async;
     bool is_in_flight;
+    /* When a background copy or an active write was started, or 0 */
+    int64_t start_ns;
+    /* Copy of the data of an active write, see bdrv_mirror_top_do_write() */
+    void *bounce_buf;
     CoQueue waiting_requests;
     Coroutine *co;
     MirrorOp *waiting_for_op;
@@ -184,6 +218,61 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/*
+ * Adapt the in-flight window to the latency of background copies, like a
+ * delay-based TCP congestion control: as long as the average latency stays
+ * close to the lowest one seen, the target keeps up and the window grows by
+ * one operation per period; when latency builds up, requests are only
+ * queueing somewhere, so the window shrinks.  Operations are kept to a
+ * quarter of the window so that enough of them run in parallel.
+ */
+static void mirror_update_window(MirrorBlockJob *s, uint64_t bytes,
+                                 int64_t lat_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->period_start_ns;
+    int64_t max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t avg_lat_ns;
+
+    s->period_bytes += bytes;
+    s->period_lat_ns += lat_ns;
+    s->period_ops++;
+    if (elapsed < MIRROR_WINDOW_PERIOD_NS) {
+        return;
+    }
+
+    avg_lat_ns = s->period_lat_ns / s->period_ops;
+    s->throughput = s->period_bytes * NANOSECONDS_PER_SECOND / elapsed;
+
+    /* Let the baseline follow the target if it becomes slower for good */
+    s->min_lat_ns += s->min_lat_ns / 64;
+    s->min_lat_ns = MIN(s->min_lat_ns, avg_lat_ns);
+
+    if (avg_lat_ns <= s->min_lat_ns + s->min_lat_ns / 4) {
+        s->window = MIN(s->window + s->max_io_bytes, s->buf_size);
+    } else if (avg_lat_ns >= s->min_lat_ns * 2) {
+        s->window = MAX(s->window - s->window / 4, s->granularity);
+    }
+    s->max_io_bytes = QEMU_ALIGN_DOWN(MIN(s->window / 4, max_io_bytes),
+                                      s->granularity);
+    s->max_io_bytes = MAX(s->max_io_bytes, s->granularity);
+
+    trace_mirror_update_window(s, avg_lat_ns, s->min_lat_ns, s->throughput,
+                               s->window, s->max_io_bytes);
+
+    s->period_start_ns = now;
+    s->period_bytes = 0;
+    s->period_lat_ns = 0;
+    s->period_ops = 0;
+}
+
+/* Whether background operations have to wait for in-flight ones */
+static bool mirror_in_flight_full(MirrorBlockJob *s)
+{
+    return s->in_flight >= s->max_in_flight ||
+           (s->in_flight > 0 && s->bytes_in_flight >= s->window);
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -195,6 +284,11 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 
     s->in_flight--;
     s->bytes_in_flight -= op->bytes;
+    if (ret >= 0 && op->start_ns) {
+        mirror_update_window(s, op->bytes,
+                             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                             op->start_ns);
+    }
     iov = op->qiov.iov;
     for (i = 0; i < op->qiov.niov; i++) {
         MirrorBuffer *buf = (MirrorBuffer *) iov[i].iov_base;
@@ -391,6 +485,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
@@ -482,7 +577,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->max_io_bytes;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -579,7 +674,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (mirror_in_flight_full(s)) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -832,7 +927,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -972,6 +1067,13 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     mirror_free_init(s);
 
+    /* Start with everything that buf_size allows and adapt from there */
+    s->max_in_flight = MAX(MAX_IN_FLIGHT, s->buf_size / MAX_IO_BYTES);
+    s->window = s->buf_size;
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    s->min_lat_ns = INT64_MAX / 2;
+    s->period_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
@@ -987,9 +1089,12 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         int64_t cnt, delta;
         bool should_complete;
 
-        /* Do not start passive operations while there are active
-         * writes in progress */
-        while (s->in_active_write_counter) {
+        /*
+         * Do not start passive operations while there are active
+         * writes in progress (except for the ones completing in the
+         * background in write-async mode)
+         */
+        while (s->in_active_write_counter > s->in_async_write_counter) {
             mirror_wait_for_any_operation(s, true);
         }
 
@@ -1018,7 +1123,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (mirror_in_flight_full(s) || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1103,6 +1208,11 @@ immediate_exit:
         mirror_wait_for_all_io(s);
     }
 
+    /* Copies of active writes still use the in-flight bitmap */
+    while (s->in_async_write_counter) {
+        mirror_wait_for_any_operation(s, true);
+    }
+
     assert(s->in_flight == 0);
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
@@ -1180,6 +1290,21 @@ static bool mirror_drained_poll(BlockJob *job)
     return !!s->in_flight;
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_mirror = true;
+    info->mirror = g_new0(BlockJobInfoMirror, 1);
+    *info->mirror = (BlockJobInfoMirror) {
+        .in_flight_window = s->window,
+        .chunk_size = s->max_io_bytes,
+        .throughput = s->throughput,
+        .has_lag = s->copy_mode == MIRROR_COPY_MODE_WRITE_ASYNC,
+        .lag = s->async_bytes,
+    };
+}
+
 static bool mirror_cancel(Job *job, bool force)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
@@ -1217,6 +1342,7 @@ static const BlockJobDriver mirror_job_driver = {
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1233,6 +1359,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .cancel                 = commit_active_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
@@ -1359,6 +1486,7 @@ static MirrorOp *coroutine_fn active_write_prepare(MirrorBlockJob *s,
         .bytes              = bytes,
         .is_active_write    = true,
         .is_in_flight       = true,
+        .start_ns           = qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
         .co                 = qemu_coroutine_self(),
     };
     qemu_co_queue_init(&op->waiting_requests);
@@ -1395,9 +1523,93 @@ static void coroutine_fn active_write_settle(MirrorOp *op)
     bitmap_clear(op->s->in_flight_bitmap, start_chunk, end_chunk - start_chunk);
     QTAILQ_REMOVE(&op->s->ops_in_flight, op, next);
     qemu_co_queue_restart_all(&op->waiting_requests);
+    if (op->bounce_buf) {
+        qemu_iovec_destroy(&op->qiov);
+        qemu_vfree(op->bounce_buf);
+    }
     g_free(op);
 }
 
+/*
+ * Whether the copy of an active write to the target may complete after the
+ * write itself has completed, i.e. whether the target is within the
+ * configured lag of the source.
+ */
+static bool active_write_can_be_async(MirrorBlockJob *s, uint64_t bytes)
+{
+    MirrorOp *op;
+
+    if (s->copy_mode != MIRROR_COPY_MODE_WRITE_ASYNC ||
+        s->async_bytes + bytes > s->max_lag)
+    {
+        return false;
+    }
+
+    /* Active writes are queued in the order they started */
+    QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+        if (op->is_async) {
+            return qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns <=
+                   s->max_lag_ns;
+        }
+    }
+    return true;
+}
+
+typedef struct MirrorAsyncWrite {
+    MirrorOp *op;
+    MirrorMethod method;
+    int flags;
+} MirrorAsyncWrite;
+
+static void coroutine_fn active_write_async_entry(void *opaque)
+{
+    MirrorAsyncWrite *w = opaque;
+    MirrorOp *op = w->op;
+    MirrorBlockJob *s = op->s;
+    BlockDriverState *mirror_top_bs = s->mirror_top_bs;
+
+    do_sync_target_write(s, w->method, op->offset, op->bytes,
+                         op->bounce_buf ? &op->qiov : NULL, w->flags);
+
+    s->in_async_write_counter--;
+    s->async_bytes -= op->bytes;
+    active_write_settle(op);
+    g_free(w);
+
+    bdrv_dec_in_flight(mirror_top_bs);
+}
+
+/*
+ * Copy an active write to the target in a new coroutine, which settles @op
+ * when done.  The filter node stays in flight until then, so that draining
+ * the source waits for the copy.
+ */
+static void coroutine_fn active_write_start_async(MirrorOp *op,
+                                                  MirrorMethod method,
+                                                  int flags)
+{
+    MirrorBlockJob *s = op->s;
+    MirrorAsyncWrite *w;
+    Coroutine *co;
+
+    w = g_new(MirrorAsyncWrite, 1);
+    *w = (MirrorAsyncWrite) {
+        .op     = op,
+        .method = method,
+        .flags  = flags,
+    };
+
+    op->is_async = true;
+    s->in_async_write_counter++;
+    s->async_bytes += op->bytes;
+    trace_mirror_active_write_async(s, op->offset, op->bytes, s->async_bytes);
+
+    bdrv_inc_in_flight(s->mirror_top_bs);
+    co = qemu_coroutine_create(active_write_async_entry, w);
+    op->co = co;
+    aio_co_enter(bdrv_get_aio_context(s->mirror_top_bs), co);
+}
+
 static int coroutine_fn bdrv_mirror_top_preadv(BlockDriverState *bs,
     int64_t offset, int64_t bytes, QEMUIOVector *qiov, BdrvRequestFlags flags)
 {
@@ -1415,10 +1627,24 @@ static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
 
     copy_to_target = s->job->ret >= 0 &&
                      !job_is_cancelled(&s->job->common.job) &&
-                     s->job->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING;
+                     s->job->copy_mode != MIRROR_COPY_MODE_BACKGROUND;
 
     if (copy_to_target) {
         op = active_write_prepare(s->job, offset, bytes);
+
+        if (qiov) {
+            /*
+             * The guest might concurrently modify the data to write; but
+             * the data on source and destination must match, so we have
+             * to use a bounce buffer if we are going to write to the
+             * target, too.
+             */
+            op->bounce_buf = qemu_blockalign(bs, bytes);
+            qemu_iovec_to_buf(qiov, 0, op->bounce_buf, bytes);
+            qemu_iovec_init(&op->qiov, 1);
+            qemu_iovec_add(&op->qiov, op->bounce_buf, bytes);
+            qiov = &op->qiov;
+        }
     }
 
     switch (method) {
@@ -1443,6 +1669,10 @@ static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
     }
 
     if (copy_to_target) {
+        if (active_write_can_be_async(s->job, bytes)) {
+            active_write_start_async(op, method, flags);
+            return ret;
+        }
         do_sync_target_write(s->job, method, offset, bytes, qiov, flags);
     }
 
@@ -1456,38 +1686,8 @@ out:
 static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
     int64_t offset, int64_t bytes, QEMUIOVector *qiov, BdrvRequestFlags flags)
 {
-    MirrorBDSOpaque *s = bs->opaque;
-    QEMUIOVector bounce_qiov;
-    void *bounce_buf;
-    int ret = 0;
-    bool copy_to_target;
-
-    copy_to_target = s->job->ret >= 0 &&
-                     !job_is_cancelled(&s->job->common.job) &&
-                     s->job->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING;
-
-    if (copy_to_target) {
-        /* The guest might concurrently modify the data to write; but
-         * the data on source and destination must match, so we have
-         * to use a bounce buffer if we are going to write to the
-         * target now. */
-        bounce_buf = qemu_blockalign(bs, bytes);
-        iov_to_buf_full(qiov->iov, qiov->niov, 0, bounce_buf, bytes);
-
-        qemu_iovec_init(&bounce_qiov, 1);
-        qemu_iovec_add(&bounce_qiov, bounce_buf, bytes);
-        qiov = &bounce_qiov;
-    }
-
-    ret = bdrv_mirror_top_do_write(bs, MIRROR_METHOD_COPY, offset, bytes, qiov,
-                                   flags);
-
-    if (copy_to_target) {
-        qemu_iovec_destroy(&bounce_qiov);
-        qemu_vfree(bounce_buf);
-    }
-
-    return ret;
+    return bdrv_mirror_top_do_write(bs, MIRROR_METHOD_COPY, offset, bytes, qiov,
+                                    flags);
 }
 
 static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
@@ -1596,6 +1796,7 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
+                             int64_t max_lag, int64_t max_lag_ns,
                              Error **errp)
 {
     MirrorBlockJob *s;
@@ -1620,6 +1821,19 @@ static BlockJob *mirror_start_job(
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
 
+    if (max_lag < 0) {
+        error_setg(errp, "Invalid parameter 'max-lag'");
+        return NULL;
+    }
+
+    if (max_lag == 0) {
+        max_lag = buf_size;
+    }
+
+    if (max_lag_ns <= 0) {
+        max_lag_ns = MIRROR_DEFAULT_MAX_LAG_MS * SCALE_MS;
+    }
+
     if (bdrv_skip_filters(bs) == bdrv_skip_filters(target)) {
         error_setg(errp, "Can't mirror node into itself");
         return NULL;
@@ -1744,6 +1958,8 @@ static BlockJob *mirror_start_job(
     s->backing_mode = backing_mode;
     s->zero_target = zero_target;
     s->copy_mode = copy_mode;
+    s->max_lag = max_lag;
+    s->max_lag_ns = max_lag_ns;
     s->base = base;
     s->base_overlay = bdrv_find_overlay(bs, base);
     s->granularity = granularity;
@@ -1757,7 +1973,7 @@ static BlockJob *mirror_start_job(
     if (!s->dirty_bitmap) {
         goto fail;
     }
-    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+    if (s->copy_mode != MIRROR_COPY_MODE_BACKGROUND) {
         bdrv_disable_dirty_bitmap(s->dirty_bitmap);
     }
 
@@ -1860,7 +2076,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, int64_t max_lag,
+                  int64_t max_lag_ns, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1879,7 +2096,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, errp);
+                     filter_node_name, true, copy_mode, max_lag, max_lag_ns,
+                     errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1908,7 +2126,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     errp);
+                     0, 0, errp);
     if (!job) {
         goto error_restore_flags;
     }
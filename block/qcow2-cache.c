@@ -24,16 +24,67 @@
 
 #include "qemu/osdep.h"
 #include "qemu/memalign.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "qemu/xxhash.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qom/object_interfaces.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Immutable copy of a cached table, looked up by readers that do not hold
+ * s->lock.  It is withdrawn as soon as the cached table may change or is
+ * evicted, and freed after an RCU grace period.  @aux is data that the
+ * publisher derived from the table, and shares its lifetime.
+ */
+typedef struct Qcow2CachePublished {
+    struct rcu_head rcu;
+    uint64_t key;
+    int index;
+    void *aux;
+    uint64_t table[];
+} Qcow2CachePublished;
+
+/*
+ * Tables are replaced using ARC (Megiddo and Modha, "ARC: A Self-Tuning, Low
+ * Overhead Replacement Cache", FAST 2003).  Tables that have been used once
+ * since they were loaded are in the RECENT list, tables used again are in
+ * the FREQUENT list.  The GHOST lists remember the offsets of tables that
+ * were recently evicted from either list, and a miss that hits a ghost
+ * moves the target size of the RECENT list towards the list that would
+ * have kept the table.  Unused slots are in the FREE list; their memory is
+ * given back to the host.
+ *
+ * All lists are kept in LRU order, with the least recently used item first.
+ */
+typedef enum Qcow2CacheList {
+    QCOW2_CACHE_FREE,
+    QCOW2_CACHE_RECENT,
+    QCOW2_CACHE_FREQUENT,
+    QCOW2_CACHE_GHOST_RECENT,
+    QCOW2_CACHE_GHOST_FREQUENT,
+    QCOW2_CACHE_LIST_MAX,
+} Qcow2CacheList;
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    Qcow2CachePublished *published;
+    Qcow2CacheList list;
+    QTAILQ_ENTRY(Qcow2CachedTable) next;
 } Qcow2CachedTable;
 
+/* Offset of an evicted table, or an unused ghost in the FREE list */
+typedef struct Qcow2CacheGhost {
+    int64_t offset;
+    Qcow2CacheList list;
+    QTAILQ_ENTRY(Qcow2CacheGhost) next;
+} Qcow2CacheGhost;
+
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
@@ -43,8 +94,33 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+    /* Published tables by key */
+    struct qht              published;
+
+    /* Cached tables and ghosts by offset */
+    GHashTable             *index;
+    GHashTable             *ghost_index;
+    Qcow2CacheGhost        *ghosts;
+    QTAILQ_HEAD(, Qcow2CachedTable) tables[QCOW2_CACHE_LIST_MAX];
+    QTAILQ_HEAD(, Qcow2CacheGhost) ghost_lists[QCOW2_CACHE_LIST_MAX];
+    int                     len[QCOW2_CACHE_LIST_MAX];
+    /* ARC target for the length of the RECENT list */
+    int                     recent_target;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
+/*
+ * Memory used by the tables of all caches in the process, and the limit
+ * set with a qcow2-cache-budget object (0 for none).  A cache that misses
+ * while the budget is used up replaces one of its own tables instead of
+ * growing, and gives back one more if the budget is exceeded.
+ */
+static uint64_t qcow2_cache_resident;
+static uint64_t qcow2_cache_budget;
+
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
 {
     return (uint8_t *) c->table_array + (size_t) table * c->table_size;
@@ -85,10 +161,195 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 #endif
 }
 
+static void qcow2_cache_move(Qcow2Cache *c, Qcow2CachedTable *t,
+                             Qcow2CacheList list)
+{
+    QTAILQ_REMOVE(&c->tables[t->list], t, next);
+    c->len[t->list]--;
+    QTAILQ_INSERT_TAIL(&c->tables[list], t, next);
+    c->len[list]++;
+
+    if (t->list == QCOW2_CACHE_FREE) {
+        qatomic_add(&qcow2_cache_resident, c->table_size);
+    } else if (list == QCOW2_CACHE_FREE) {
+        qatomic_sub(&qcow2_cache_resident, c->table_size);
+    }
+    t->list = list;
+}
+
+static void qcow2_cache_ghost_move(Qcow2Cache *c, Qcow2CacheGhost *g,
+                                   Qcow2CacheList list)
+{
+    /* c->len[QCOW2_CACHE_FREE] counts free tables, not free ghosts */
+    QTAILQ_REMOVE(&c->ghost_lists[g->list], g, next);
+    if (g->list != QCOW2_CACHE_FREE) {
+        c->len[g->list]--;
+    }
+    QTAILQ_INSERT_TAIL(&c->ghost_lists[list], g, next);
+    if (list != QCOW2_CACHE_FREE) {
+        c->len[list]++;
+    }
+    g->list = list;
+}
+
+static void qcow2_cache_ghost_forget(Qcow2Cache *c, Qcow2CacheGhost *g)
+{
+    g_hash_table_remove(c->ghost_index, &g->offset);
+    g->offset = 0;
+    qcow2_cache_ghost_move(c, g, QCOW2_CACHE_FREE);
+}
+
+static void qcow2_cache_ghost_forget_all(Qcow2Cache *c)
+{
+    Qcow2CacheGhost *g, *next_g;
+    int list;
+
+    for (list = QCOW2_CACHE_GHOST_RECENT; list < QCOW2_CACHE_LIST_MAX;
+         list++) {
+        QTAILQ_FOREACH_SAFE(g, &c->ghost_lists[list], next, next_g) {
+            qcow2_cache_ghost_forget(c, g);
+        }
+    }
+    c->recent_target = 0;
+}
+
+/* Remember the offset of a table that is about to be evicted */
+static void qcow2_cache_ghost_add(Qcow2Cache *c, int64_t offset,
+                                  Qcow2CacheList list)
+{
+    Qcow2CacheGhost *g;
+
+    /* Keep RECENT + GHOST_RECENT, and all ghosts, within the cache size */
+    if (QTAILQ_EMPTY(&c->ghost_lists[QCOW2_CACHE_FREE])) {
+        if (c->len[QCOW2_CACHE_RECENT] + c->len[QCOW2_CACHE_GHOST_RECENT] >=
+            c->size && c->len[QCOW2_CACHE_GHOST_RECENT] > 0) {
+            g = QTAILQ_FIRST(&c->ghost_lists[QCOW2_CACHE_GHOST_RECENT]);
+        } else if (c->len[QCOW2_CACHE_GHOST_FREQUENT] > 0) {
+            g = QTAILQ_FIRST(&c->ghost_lists[QCOW2_CACHE_GHOST_FREQUENT]);
+        } else {
+            g = QTAILQ_FIRST(&c->ghost_lists[QCOW2_CACHE_GHOST_RECENT]);
+        }
+        qcow2_cache_ghost_forget(c, g);
+    }
+
+    g = QTAILQ_FIRST(&c->ghost_lists[QCOW2_CACHE_FREE]);
+    g->offset = offset;
+    qcow2_cache_ghost_move(c, g, list);
+    g_hash_table_insert(c->ghost_index, &g->offset, g);
+}
+
+/* Least recently used table in @list that is not in use */
+static Qcow2CachedTable *qcow2_cache_lru(Qcow2Cache *c, Qcow2CacheList list)
+{
+    Qcow2CachedTable *t;
+
+    QTAILQ_FOREACH(t, &c->tables[list], next) {
+        if (t->ref == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Choose the table to replace on a miss, following the ARC REPLACE rule.
+ * @ghost is the ghost of the missed table, if any.
+ */
+static Qcow2CachedTable *qcow2_cache_victim(Qcow2Cache *c,
+                                            Qcow2CacheGhost *ghost)
+{
+    int recent = c->len[QCOW2_CACHE_RECENT];
+    Qcow2CachedTable *t;
+
+    if (recent > 0 &&
+        (recent > c->recent_target ||
+         (ghost && ghost->list == QCOW2_CACHE_GHOST_FREQUENT &&
+          recent == c->recent_target))) {
+        t = qcow2_cache_lru(c, QCOW2_CACHE_RECENT);
+        if (!t) {
+            t = qcow2_cache_lru(c, QCOW2_CACHE_FREQUENT);
+        }
+    } else {
+        t = qcow2_cache_lru(c, QCOW2_CACHE_FREQUENT);
+        if (!t) {
+            t = qcow2_cache_lru(c, QCOW2_CACHE_RECENT);
+        }
+    }
+    return t;
+}
+
+static uint32_t qcow2_cache_published_hash(uint64_t key)
+{
+    return qemu_xxhash2(key);
+}
+
+static bool qcow2_cache_published_cmp(const void *a, const void *b)
+{
+    const Qcow2CachePublished *pa = a;
+    const Qcow2CachePublished *pb = b;
+
+    return pa->key == pb->key;
+}
+
+static bool qcow2_cache_published_lookup(const void *obj, const void *userp)
+{
+    const Qcow2CachePublished *p = obj;
+
+    return p->key == *(const uint64_t *)userp;
+}
+
+static void qcow2_cache_published_free(Qcow2CachePublished *p)
+{
+    g_free(p->aux);
+    g_free(p);
+}
+
+static void qcow2_cache_unpublish_entry(Qcow2Cache *c, int i)
+{
+    Qcow2CachePublished *p = c->entries[i].published;
+
+    if (p) {
+        c->entries[i].published = NULL;
+        qht_remove(&c->published, p, qcow2_cache_published_hash(p->key));
+        call_rcu(p, qcow2_cache_published_free, rcu);
+    }
+}
+
+/* Withdraw all published tables */
+void qcow2_cache_unpublish_all(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        qcow2_cache_unpublish_entry(c, i);
+    }
+}
+
+/* Take a table out of the cache; the caller must have written it back */
+static void qcow2_cache_evict(Qcow2Cache *c, int i, bool ghost)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->list != QCOW2_CACHE_FREE && t->ref == 0);
+
+    qcow2_cache_unpublish_entry(c, i);
+    g_hash_table_remove(c->index, &t->offset);
+    if (ghost) {
+        qcow2_cache_ghost_add(c, t->offset,
+                              t->list == QCOW2_CACHE_RECENT ?
+                              QCOW2_CACHE_GHOST_RECENT :
+                              QCOW2_CACHE_GHOST_FREQUENT);
+    }
+    t->offset = 0;
+    t->lru_counter = 0;
+    t->dirty = false;
+    qcow2_cache_move(c, t, QCOW2_CACHE_FREE);
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
-    return t->ref == 0 && !t->dirty && t->offset != 0 &&
+    return t->ref == 0 && !t->dirty && t->list != QCOW2_CACHE_FREE &&
         t->lru_counter <= c->cache_clean_lru_counter;
 }
 
@@ -105,8 +366,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_evict(c, i, false);
             i++;
             to_clean++;
         }
@@ -124,6 +384,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -141,9 +402,27 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
         qemu_vfree(c->table_array);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qht_init(&c->published, qcow2_cache_published_cmp, num_tables,
+             QHT_MODE_AUTO_RESIZE);
+
+    c->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->ghost_index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->ghosts = g_new0(Qcow2CacheGhost, num_tables);
+    for (i = 0; i < QCOW2_CACHE_LIST_MAX; i++) {
+        QTAILQ_INIT(&c->tables[i]);
+        QTAILQ_INIT(&c->ghost_lists[i]);
+    }
+    for (i = 0; i < num_tables; i++) {
+        QTAILQ_INSERT_TAIL(&c->tables[QCOW2_CACHE_FREE], &c->entries[i],
+                           next);
+        QTAILQ_INSERT_TAIL(&c->ghost_lists[QCOW2_CACHE_FREE], &c->ghosts[i],
+                           next);
+    }
+    c->len[QCOW2_CACHE_FREE] = num_tables;
+
     return c;
 }
 
@@ -155,6 +434,14 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    qcow2_cache_unpublish_all(c);
+    qht_destroy(&c->published);
+    qatomic_sub(&qcow2_cache_resident,
+                (uint64_t) (c->size - c->len[QCOW2_CACHE_FREE]) *
+                c->table_size);
+    g_hash_table_destroy(c->index);
+    g_hash_table_destroy(c->ghost_index);
+    g_free(c->ghosts);
     qemu_vfree(c->table_array);
     g_free(c->entries);
     g_free(c);
@@ -166,7 +453,12 @@ static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
 
-    ret = qcow2_cache_flush(bs, c->depends);
+    if (qcow2_journal_active(bs)) {
+        /* Both caches go into the same journal entry, which keeps the order */
+        ret = qcow2_journal_commit(bs);
+    } else {
+        ret = qcow2_cache_flush(bs, c->depends);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -189,6 +481,11 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
                                   c == s->l2_table_cache, i);
 
+    if (qcow2_journal_active(bs)) {
+        /* All dirty tables of both caches go into a single journal entry */
+        return qcow2_journal_commit(bs);
+    }
+
     if (c->depends) {
         ret = qcow2_cache_flush_dependency(bs, c);
     } else if (c->depends_on_flush) {
@@ -243,6 +540,10 @@ int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c)
 
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
+    if (qcow2_journal_active(bs)) {
+        return qcow2_journal_commit(bs);
+    }
+
     for (i = 0; i < c->size; i++) {
         ret = qcow2_cache_entry_flush(bs, c, i);
         if (ret < 0 && result != -ENOSPC) {
@@ -306,9 +607,11 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        if (c->entries[i].list != QCOW2_CACHE_FREE) {
+            qcow2_cache_evict(c, i, false);
+        }
     }
+    qcow2_cache_ghost_forget_all(c);
 
     qcow2_cache_table_release(c, 0, c->size);
 
@@ -317,15 +620,54 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     return 0;
 }
 
+/*
+ * Give back one more table if the tables of all caches together use more
+ * memory than the budget allows.  Only clean tables are given back, so that
+ * this never needs I/O.
+ */
+static void qcow2_cache_shrink(Qcow2Cache *c)
+{
+    uint64_t budget = qatomic_read(&qcow2_cache_budget);
+    Qcow2CachedTable *t;
+    int list;
+
+    if (!budget || qatomic_read(&qcow2_cache_resident) <= budget ||
+        c->size - c->len[QCOW2_CACHE_FREE] <= 1) {
+        return;
+    }
+
+    for (list = QCOW2_CACHE_RECENT; list <= QCOW2_CACHE_FREQUENT; list++) {
+        QTAILQ_FOREACH(t, &c->tables[list], next) {
+            if (t->ref == 0 && !t->dirty) {
+                int i = t - c->entries;
+                qcow2_cache_evict(c, i, true);
+                qcow2_cache_table_release(c, i, 1);
+                c->evictions++;
+                return;
+            }
+        }
+    }
+}
+
+/* Whether a miss may use a free slot rather than replace a table */
+static bool qcow2_cache_may_grow(Qcow2Cache *c)
+{
+    uint64_t budget = qatomic_read(&qcow2_cache_budget);
+
+    return !QTAILQ_EMPTY(&c->tables[QCOW2_CACHE_FREE]) &&
+        (!budget ||
+         qatomic_read(&qcow2_cache_resident) + c->table_size <= budget);
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
+    Qcow2CacheGhost *ghost;
+    int64_t key = offset;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -340,59 +682,95 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    t = g_hash_table_lookup(c->index, &key);
+    if (t) {
+        c->hits++;
+        qcow2_cache_move(c, t, QCOW2_CACHE_FREQUENT);
+        i = t - c->entries;
+        goto found;
+    }
+
+    c->misses++;
+
+    /* Adapt the target size of the RECENT list if the table was evicted */
+    ghost = g_hash_table_lookup(c->ghost_index, &key);
+    if (ghost && ghost->list == QCOW2_CACHE_GHOST_RECENT) {
+        int delta = MAX(c->len[QCOW2_CACHE_GHOST_FREQUENT] /
+                        c->len[QCOW2_CACHE_GHOST_RECENT], 1);
+        c->recent_target = MIN(c->recent_target + delta, c->size);
+    } else if (ghost) {
+        int delta = MAX(c->len[QCOW2_CACHE_GHOST_RECENT] /
+                        c->len[QCOW2_CACHE_GHOST_FREQUENT], 1);
+        c->recent_target = MAX(c->recent_target - delta, 0);
+    }
 
-    if (min_lru_index == -1) {
+    t = NULL;
+    if (!qcow2_cache_may_grow(c)) {
+        t = qcow2_cache_victim(c, ghost);
+    }
+    if (!t) {
+        t = QTAILQ_FIRST(&c->tables[QCOW2_CACHE_FREE]);
+    }
+    if (!t) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
-    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
-                                        c == s->l2_table_cache, i);
+    i = t - c->entries;
+    if (t->list != QCOW2_CACHE_FREE) {
+        trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
+                                            c == s->l2_table_cache, i);
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        if (ret < 0) {
+            return ret;
+        }
+
+        qcow2_cache_evict(c, i, true);
+        c->evictions++;
+
+        /* The ghost may have been forgotten to make room for the new one */
+        ghost = g_hash_table_lookup(c->ghost_index, &key);
     }
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (ghost) {
+        qcow2_cache_ghost_forget(c, ghost);
+        qcow2_cache_move(c, t, QCOW2_CACHE_FREQUENT);
+    } else {
+        qcow2_cache_move(c, t, QCOW2_CACHE_RECENT);
+    }
+    /* Keep others from using the slot while the table is read */
+    t->ref++;
+
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset,
-                         qcow2_cache_get_table_addr(c, i),
-                         c->table_size);
+        /* Tables in the metadata journal are newer than their home copy */
+        ret = qcow2_journal_pread(bs, offset,
+                                  qcow2_cache_get_table_addr(c, i),
+                                  c->table_size);
         if (ret < 0) {
+            t->ref--;
+            qcow2_cache_move(c, t, QCOW2_CACHE_FREE);
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    t->ref--;
+    t->offset = offset;
+    g_hash_table_insert(c->index, &t->offset, t);
 
     /* And return the right table */
 found:
     c->entries[i].ref++;
     *table = qcow2_cache_get_table_addr(c, i);
+    qcow2_cache_shrink(c);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -431,29 +809,254 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
     int i = qcow2_cache_get_table_idx(c, table);
     assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
+    /* The caller is about to modify the table, or just did */
+    qcow2_cache_unpublish_entry(c, i);
 }
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
+{
+    int64_t key = offset;
+    Qcow2CachedTable *t = g_hash_table_lookup(c->index, &key);
+
+    return t ? qcow2_cache_get_table_addr(c, t - c->entries) : NULL;
+}
+
+void qcow2_cache_discard(Qcow2Cache *c, void *table)
+{
+    int i = qcow2_cache_get_table_idx(c, table);
+
+    assert(c->entries[i].ref == 0);
+
+    qcow2_cache_evict(c, i, false);
+    qcow2_cache_table_release(c, i, 1);
+}
+
+/*
+ * Publish a copy of @table under @key, for qcow2_cache_lookup_published().
+ * The copy is withdrawn when the table is marked dirty, evicted or
+ * discarded, or when the caller withdraws @key.  A key can only be
+ * published by one table at a time.
+ *
+ * If @aux_func is not NULL, it is called for a new copy and its result is
+ * published with it (and freed with g_free()).  Returns the auxiliary data
+ * of the published copy.
+ */
+const void *qcow2_cache_publish(BlockDriverState *bs, Qcow2Cache *c,
+                                void *table, uint64_t key,
+                                Qcow2CacheAuxFunc *aux_func)
+{
+    int i = qcow2_cache_get_table_idx(c, table);
+    Qcow2CachePublished *p = c->entries[i].published;
+    void *existing;
+    bool inserted;
+
+    if (p && p->key == key) {
+        return p->aux;
+    }
+
+    qcow2_cache_unpublish_entry(c, i);
+    qcow2_cache_unpublish(c, key);
+
+    p = g_malloc(sizeof(*p) + c->table_size);
+    p->key = key;
+    p->index = i;
+    memcpy(p->table, table, c->table_size);
+    p->aux = aux_func ? aux_func(bs, p->table, key) : NULL;
+
+    inserted = qht_insert(&c->published, p, qcow2_cache_published_hash(key),
+                          &existing);
+    assert(inserted);
+    c->entries[i].published = p;
+
+    return p->aux;
+}
+
+/* Withdraw the table published under @key, if any */
+void qcow2_cache_unpublish(Qcow2Cache *c, uint64_t key)
+{
+    Qcow2CachePublished *p;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        p = qht_lookup_custom(&c->published, &key,
+                              qcow2_cache_published_hash(key),
+                              qcow2_cache_published_lookup);
+    }
+
+    /* Only the owner of the cache removes tables, so p is still valid */
+    if (p) {
+        qcow2_cache_unpublish_entry(c, p->index);
+    }
+}
+
+/*
+ * Look up the table published under @key, without the lock protecting the
+ * cache.  Must be called in an RCU read-side critical section, which the
+ * returned table and *@aux are only valid in.
+ */
+const void *qcow2_cache_lookup_published(Qcow2Cache *c, uint64_t key,
+                                         const void **aux)
+{
+    Qcow2CachePublished *p;
+
+    p = qht_lookup_custom(&c->published, &key,
+                          qcow2_cache_published_hash(key),
+                          qcow2_cache_published_lookup);
+    if (!p) {
+        return NULL;
+    }
+
+    *aux = p->aux;
+    return p->table;
+}
+
+/*
+ * Collects the dirty tables of @c for an entry of the metadata journal: their
+ * descriptors are appended to @descs and their addresses to @tables.
+ * Returns whether the image file must be flushed before the entry is written.
+ */
+bool qcow2_cache_collect_dirty(Qcow2Cache *c, uint32_t type, GArray *descs,
+                               GPtrArray *tables)
 {
     int i;
 
     for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
+        if (c->entries[i].dirty && c->entries[i].offset) {
+            Qcow2JournalTable desc = {
+                .offset = c->entries[i].offset,
+                .size = c->table_size,
+                .type = type,
+            };
+            g_array_append_val(descs, desc);
+            g_ptr_array_add(tables, qcow2_cache_get_table_addr(c, i));
         }
     }
-    return NULL;
+
+    return c->depends_on_flush;
 }
 
-void qcow2_cache_discard(Qcow2Cache *c, void *table)
+/*
+ * Marks all tables of @c clean after they have been written to the metadata
+ * journal.  Dependencies between the caches are met, because a journal entry
+ * is replayed either completely or not at all.
+ */
+void qcow2_cache_mark_journaled(Qcow2Cache *c)
 {
-    int i = qcow2_cache_get_table_idx(c, table);
+    int i;
 
-    assert(c->entries[i].ref == 0);
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].dirty = false;
+    }
+    c->depends = NULL;
+    c->depends_on_flush = false;
+}
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
-    c->entries[i].dirty = false;
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c)
+{
+    Qcow2CacheStats *stats = g_new(Qcow2CacheStats, 1);
+
+    *stats = (Qcow2CacheStats) {
+        .hits = c->hits,
+        .misses = c->misses,
+        .evictions = c->evictions,
+        .size = (uint64_t) (c->size - c->len[QCOW2_CACHE_FREE]) *
+                c->table_size,
+        .max_size = (uint64_t) c->size * c->table_size,
+    };
+
+    return stats;
+}
 
-    qcow2_cache_table_release(c, i, 1);
+#define TYPE_QCOW2_CACHE_BUDGET "qcow2-cache-budget"
+OBJECT_DECLARE_SIMPLE_TYPE(Qcow2CacheBudget, QCOW2_CACHE_BUDGET)
+
+struct Qcow2CacheBudget {
+    Object parent_obj;
+    uint64_t size;
+};
+
+/* The object that sets qcow2_cache_budget, there is at most one */
+static Qcow2CacheBudget *qcow2_cache_budget_obj;
+
+static void qcow2_cache_budget_get_size(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(obj);
+
+    visit_type_size(v, name, &b->size, errp);
+}
+
+static void qcow2_cache_budget_set_size(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(obj);
+    uint64_t value;
+
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+
+    b->size = value;
+    if (qcow2_cache_budget_obj == b) {
+        qatomic_set(&qcow2_cache_budget, value);
+    }
+}
+
+static void qcow2_cache_budget_complete(UserCreatable *uc, Error **errp)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(uc);
+
+    if (qcow2_cache_budget_obj) {
+        error_setg(errp, "There can only be one %s object",
+                   TYPE_QCOW2_CACHE_BUDGET);
+        return;
+    }
+
+    qcow2_cache_budget_obj = b;
+    qatomic_set(&qcow2_cache_budget, b->size);
+}
+
+static void qcow2_cache_budget_finalize(Object *obj)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(obj);
+
+    if (qcow2_cache_budget_obj == b) {
+        qcow2_cache_budget_obj = NULL;
+        qatomic_set(&qcow2_cache_budget, 0);
+    }
+}
+
+static void qcow2_cache_budget_class_init(ObjectClass *oc, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ucc->complete = qcow2_cache_budget_complete;
+
+    object_class_property_add(oc, "size", "int",
+                              qcow2_cache_budget_get_size,
+                              qcow2_cache_budget_set_size,
+                              NULL, NULL);
+    object_class_property_set_description(oc, "size",
+        "Maximum total size of the metadata caches of all qcow2 images "
+        "(0 for no limit)");
 }
+
+static const TypeInfo qcow2_cache_budget_info = {
+    .name = TYPE_QCOW2_CACHE_BUDGET,
+    .parent = TYPE_OBJECT,
+    .class_init = qcow2_cache_budget_class_init,
+    .instance_size = sizeof(Qcow2CacheBudget),
+    .instance_finalize = qcow2_cache_budget_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    },
+};
+
+static void qcow2_cache_budget_register_types(void)
+{
+    type_register_static(&qcow2_cache_budget_info);
+}
+
+type_init(qcow2_cache_budget_register_types);
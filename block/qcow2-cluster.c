@@ -64,6 +64,7 @@ int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t exact_size)
         if ((s->l1_table[i] & L1E_OFFSET_MASK) == 0) {
             continue;
         }
+        l2_unpublish(s, i);
         qcow2_free_clusters(bs, s->l1_table[i] & L1E_OFFSET_MASK,
                             s->cluster_size, QCOW2_DISCARD_ALWAYS);
         s->l1_table[i] = 0;
@@ -216,6 +217,27 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                            (void **)l2_slice);
 }
 
+/*
+ * L2 slices are published in the L2 cache by guest offset, for
+ * qcow2_get_host_offset_lockless()
+ */
+static uint64_t l2_slice_key(BDRVQcow2State *s, uint64_t offset)
+{
+    return offset >> s->cluster_bits >> ctz32(s->l2_slice_size);
+}
+
+/* Withdraw the published L2 slices of the L2 table of @l1_index */
+static void l2_unpublish(BDRVQcow2State *s, int l1_index)
+{
+    int n_slices = s->l2_size / s->l2_slice_size;
+    uint64_t key;
+
+    for (key = (uint64_t)l1_index * n_slices;
+         key < (uint64_t)(l1_index + 1) * n_slices; key++) {
+        qcow2_cache_unpublish(s->l2_table_cache, key);
+    }
+}
+
 /*
  * Writes an L1 entry to disk (note that depending on the alignment
  * requirements this function may write more that just one entry in
@@ -354,6 +376,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
+    l2_unpublish(s, l1_index);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
     ret = qcow2_write_l1_entry(bs, l1_index);
     if (ret < 0) {
@@ -489,6 +512,180 @@ static int count_contiguous_subclusters(BlockDriverState *bs, int nb_clusters,
     return count;
 }
 
+/*
+ * Runs of subclusters in a published L2 slice that have the same type and,
+ * if they have a host offset, are contiguous in the image file.  They let
+ * qcow2_get_host_offset() map a request of any length with a binary search
+ * instead of looking at every L2 entry it covers.
+ */
+typedef struct Qcow2L2Extent {
+    uint32_t end;               /* Index of the first subcluster after it */
+    QCow2SubclusterType type;
+    /* Of the first subcluster, or the L2 entry of a compressed cluster */
+    uint64_t host_offset;
+} Qcow2L2Extent;
+
+typedef struct Qcow2L2Extents {
+    unsigned int nb_extents;
+    Qcow2L2Extent extents[];
+} Qcow2L2Extents;
+
+static bool subcluster_type_has_host_offset(QCow2SubclusterType type)
+{
+    return type == QCOW2_SUBCLUSTER_NORMAL ||
+           type == QCOW2_SUBCLUSTER_ZERO_ALLOC ||
+           type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC;
+}
+
+/*
+ * Qcow2CacheAuxFunc that collapses the L2 slice @table, published under
+ * @key, into extents.  Returns NULL if the slice is too fragmented to
+ * benefit, or contains anything that qcow2_get_host_offset() must report
+ * as corruption.
+ */
+static void *l2_build_extents(BlockDriverState *bs, const void *table,
+                              uint64_t key)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice = (uint64_t *) table;
+    unsigned int max_extents = MAX(s->l2_slice_size / 4, 1);
+    uint64_t guest_offset = (key * s->l2_slice_size) << s->cluster_bits;
+    g_autofree Qcow2L2Extents *x = NULL;
+    Qcow2L2Extent *last = NULL;
+    uint32_t last_start = 0;
+    unsigned int n;
+    int l2_index;
+
+    x = g_malloc(sizeof(*x) + max_extents * sizeof(x->extents[0]));
+    x->nb_extents = 0;
+
+    for (l2_index = 0; l2_index < s->l2_slice_size; l2_index++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+        uint64_t host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
+        unsigned sc = 0;
+
+        while (sc < s->subclusters_per_cluster) {
+            uint32_t idx = l2_index * s->subclusters_per_cluster + sc;
+            QCow2SubclusterType type;
+            uint64_t host_offset = 0;
+            int ret;
+
+            ret = qcow2_get_subcluster_range_type(bs, l2_entry, l2_bitmap, sc,
+                                                  &type);
+            if (ret < 0) {
+                return NULL;
+            }
+
+            switch (type) {
+            case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+                if (s->qcow_version < 3) {
+                    return NULL;
+                }
+                break;
+            case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+                break;
+            case QCOW2_SUBCLUSTER_COMPRESSED:
+                if (has_data_file(bs)) {
+                    return NULL;
+                }
+                host_offset = l2_entry;
+                break;
+            case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+                if (s->qcow_version < 3) {
+                    return NULL;
+                }
+                /* fall through */
+            case QCOW2_SUBCLUSTER_NORMAL:
+            case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+                if (offset_into_cluster(s, host_cluster_offset) ||
+                    (has_data_file(bs) && host_cluster_offset !=
+                     guest_offset + ((uint64_t) l2_index << s->cluster_bits)))
+                {
+                    return NULL;
+                }
+                host_offset = host_cluster_offset +
+                              ((uint64_t) sc << s->subcluster_bits);
+                break;
+            default:
+                return NULL;
+            }
+
+            /* Compressed clusters are always processed one by one */
+            if (last && last->type == type &&
+                type != QCOW2_SUBCLUSTER_COMPRESSED &&
+                (!subcluster_type_has_host_offset(type) ||
+                 last->host_offset +
+                 ((uint64_t) (idx - last_start) << s->subcluster_bits) ==
+                 host_offset))
+            {
+                last->end = idx + ret;
+            } else {
+                if (x->nb_extents == max_extents) {
+                    return NULL;
+                }
+                last_start = last ? last->end : 0;
+                last = &x->extents[x->nb_extents++];
+                *last = (Qcow2L2Extent) {
+                    .end = idx + ret,
+                    .type = type,
+                    .host_offset = host_offset,
+                };
+            }
+            sc += ret;
+        }
+    }
+
+    n = x->nb_extents;
+    return g_realloc(g_steal_pointer(&x),
+                     sizeof(*x) + n * sizeof(x->extents[0]));
+}
+
+/*
+ * Maps @offset with the extents of its L2 slice.  Returns the number of
+ * bytes from the start of the cluster of @offset that have the same type
+ * and are contiguous in the image file, like count_contiguous_subclusters().
+ */
+static uint64_t l2_extents_lookup(BlockDriverState *bs,
+                                  const Qcow2L2Extents *x, uint64_t offset,
+                                  uint64_t *host_offset,
+                                  QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned int sc_index = offset_to_sc_index(s, offset);
+    uint32_t idx = offset_to_l2_slice_index(s, offset) *
+                   s->subclusters_per_cluster + sc_index;
+    unsigned int lo = 0, hi = x->nb_extents - 1;
+    const Qcow2L2Extent *e;
+    uint32_t start;
+
+    /* Find the first extent that ends after idx */
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (x->extents[mid].end > idx) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    e = &x->extents[lo];
+    start = lo ? x->extents[lo - 1].end : 0;
+    assert(start <= idx && idx < e->end);
+
+    *subcluster_type = e->type;
+    if (e->type == QCOW2_SUBCLUSTER_COMPRESSED) {
+        *host_offset = e->host_offset;
+    } else if (subcluster_type_has_host_offset(e->type)) {
+        *host_offset = e->host_offset +
+                       ((uint64_t) (idx - start) << s->subcluster_bits) +
+                       (offset & (s->subcluster_size - 1));
+    } else {
+        *host_offset = 0;
+    }
+
+    return (uint64_t) (e->end - idx + sc_index) << s->subcluster_bits;
+}
+
 static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
                                             uint64_t src_cluster_offset,
                                             unsigned offset_in_cluster,
@@ -592,6 +789,7 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
     int sc;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
+    const Qcow2L2Extents *extents;
     QCow2SubclusterType type;
     int ret;
 
@@ -638,6 +836,14 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
     if (ret < 0) {
         return ret;
     }
+    extents = qcow2_cache_publish(bs, s->l2_table_cache, l2_slice,
+                                  l2_slice_key(s, offset), l2_build_extents);
+    if (extents) {
+        bytes_available = l2_extents_lookup(bs, extents, offset, host_offset,
+                                            &type);
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        goto out;
+    }
 
     /* find the cluster offset for the given disk offset */
 
@@ -741,6 +947,104 @@ fail:
     return ret;
 }
 
+/*
+ * Like qcow2_get_host_offset(), but without s->lock: only L2 slices that
+ * qcow2_get_host_offset() published in the L2 cache are looked at.
+ *
+ * Returns -EAGAIN if the slice is not published, or if the entry needs more
+ * than a lookup (compressed clusters, invalid entries); the caller must then
+ * take s->lock and use qcow2_get_host_offset().
+ */
+int qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                   unsigned int *bytes, uint64_t *host_offset,
+                                   QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned int l2_index, sc_index, offset_in_cluster;
+    uint64_t *l2_slice, l2_entry, l2_bitmap, key;
+    uint64_t bytes_available, bytes_needed, nb_clusters;
+    const Qcow2L2Extents *extents;
+    const void *aux;
+    QCow2SubclusterType type;
+    int sc;
+
+    offset_in_cluster = offset_into_cluster(s, offset);
+    bytes_needed = (uint64_t) *bytes + offset_in_cluster;
+    bytes_available =
+        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
+        << s->cluster_bits;
+    bytes_needed = MIN(bytes_needed, bytes_available);
+    nb_clusters = size_to_clusters(s, bytes_needed);
+    l2_index = offset_to_l2_slice_index(s, offset);
+    sc_index = offset_to_sc_index(s, offset);
+
+    RCU_READ_LOCK_GUARD();
+
+    /* The published copy is never modified */
+    key = l2_slice_key(s, offset);
+    l2_slice = (uint64_t *)qcow2_cache_lookup_published(s->l2_table_cache, key,
+                                                        &aux);
+    if (!l2_slice) {
+        return -EAGAIN;
+    }
+
+    extents = aux;
+    if (extents) {
+        bytes_available = l2_extents_lookup(bs, extents, offset, host_offset,
+                                            &type);
+        if (type == QCOW2_SUBCLUSTER_COMPRESSED) {
+            return -EAGAIN;
+        }
+        goto out;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    type = qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, sc_index);
+
+    /* Leave errors to qcow2_get_host_offset(), which reports corruption */
+    switch (type) {
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        if (s->qcow_version < 3) {
+            return -EAGAIN;
+        }
+        /* fall through */
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        *host_offset = 0;
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+        if (s->qcow_version < 3) {
+            return -EAGAIN;
+        }
+        /* fall through */
+    case QCOW2_SUBCLUSTER_NORMAL:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        *host_offset = (l2_entry & L2E_OFFSET_MASK) + offset_in_cluster;
+        if (offset_into_cluster(s, l2_entry & L2E_OFFSET_MASK) ||
+            (has_data_file(bs) && *host_offset != offset)) {
+            return -EAGAIN;
+        }
+        break;
+    default:
+        return -EAGAIN;
+    }
+
+    sc = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                      l2_slice, &l2_index);
+    if (sc < 0) {
+        return -EAGAIN;
+    }
+
+    bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
+
+out:
+    bytes_available = MIN(bytes_available, bytes_needed);
+    *bytes = bytes_available - offset_in_cluster;
+    *subcluster_type = type;
+
+    return 0;
+}
+
 /*
  * get_cluster_table
  *
@@ -1612,6 +1916,19 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
+    if (s->alloc_extent_size) {
+        int64_t ret = qcow2_alloc_clusters_reserved(bs, guest_offset,
+                                                    host_offset,
+                                                    *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        } else if (ret > 0) {
+            *nb_clusters = ret;
+            return 0;
+        }
+        /* Not contiguous with the reserved extent, try the usual way */
+    }
+
     if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
@@ -0,0 +1,417 @@
+/*
+ * Cache of decompressed clusters for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/memalign.h"
+#include "block/aio_task.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/*
+ * Number of following guest clusters that are decompressed together with a
+ * cluster that is not in the cache, if they are stored right after it
+ */
+#define QCOW2_COMPRESSED_READAHEAD 8
+
+typedef struct Qcow2CompressedEntry {
+    uint64_t coffset;
+    int csize;
+    uint8_t *data;
+    int ref;
+    bool loading;       /* Still being read and decompressed */
+    bool detached;      /* No longer in the cache, freed by the last user */
+    int ret;            /* Result of loading */
+    CoQueue waiters;    /* Readers waiting for the end of loading */
+    QTAILQ_ENTRY(Qcow2CompressedEntry) next;
+} Qcow2CompressedEntry;
+
+struct Qcow2CompressedCache {
+    GHashTable *entries;    /* Qcow2CompressedEntry by coffset */
+    QTAILQ_HEAD(, Qcow2CompressedEntry) lru;
+    int nb_entries;
+    int max_entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs,
+                                                    uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = g_new0(Qcow2CompressedCache, 1);
+
+    c->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&c->lru);
+    c->max_entries = MAX(size / s->cluster_size, 1);
+
+    return c;
+}
+
+static void qcow2_compressed_entry_free(Qcow2CompressedEntry *e)
+{
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+/* Removes @e from the cache; it is freed once it is no longer in use */
+static void qcow2_compressed_cache_detach(Qcow2CompressedCache *c,
+                                          Qcow2CompressedEntry *e)
+{
+    g_hash_table_remove(c->entries, &e->coffset);
+    QTAILQ_REMOVE(&c->lru, e, next);
+    c->nb_entries--;
+    e->detached = true;
+
+    if (e->ref == 0) {
+        qcow2_compressed_entry_free(e);
+    }
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    Qcow2CompressedEntry *e, *next;
+
+    if (!c) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &c->lru, next, next) {
+        assert(e->ref == 0);
+        qcow2_compressed_cache_detach(c, e);
+    }
+    g_hash_table_destroy(c->entries);
+    g_free(c);
+}
+
+/*
+ * Drops the clusters whose compressed data starts in the host range
+ * [@offset, @offset + @length), which is being freed.  The cache is small
+ * enough for a linear search to be cheaper than a second index.
+ */
+void qcow2_compressed_cache_discard(BlockDriverState *bs, uint64_t offset,
+                                    uint64_t length)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedEntry *e, *next;
+
+    if (!c || !c->nb_entries) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &c->lru, next, next) {
+        if (e->coffset >= offset && e->coffset - offset < length) {
+            qcow2_compressed_cache_detach(c, e);
+        }
+    }
+}
+
+/*
+ * Inserts a new entry for the compressed cluster at @coffset, which the
+ * caller must load.  Evicts the least recently used unused entry if the
+ * cache is full.  Returns NULL if no memory is available.
+ */
+static Qcow2CompressedEntry *
+qcow2_compressed_cache_insert(BlockDriverState *bs, uint64_t coffset,
+                              int csize)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedEntry *e;
+
+    if (c->nb_entries >= c->max_entries) {
+        QTAILQ_FOREACH(e, &c->lru, next) {
+            if (e->ref == 0) {
+                qcow2_compressed_cache_detach(c, e);
+                c->evictions++;
+                break;
+            }
+        }
+    }
+
+    e = g_new0(Qcow2CompressedEntry, 1);
+    e->data = qemu_try_blockalign(bs, s->cluster_size);
+    if (!e->data) {
+        g_free(e);
+        return NULL;
+    }
+
+    e->coffset = coffset;
+    e->csize = csize;
+    e->ref = 1;
+    e->loading = true;
+    qemu_co_queue_init(&e->waiters);
+
+    g_hash_table_insert(c->entries, &e->coffset, e);
+    QTAILQ_INSERT_TAIL(&c->lru, e, next);
+    c->nb_entries++;
+
+    return e;
+}
+
+static void qcow2_compressed_cache_put(Qcow2CompressedCache *c,
+                                       Qcow2CompressedEntry *e)
+{
+    assert(e->ref > 0);
+    if (--e->ref == 0 && e->detached) {
+        qcow2_compressed_entry_free(e);
+    }
+}
+
+/* Completes loading of @e and wakes up the readers that wait for it */
+static void qcow2_compressed_cache_loaded(Qcow2CompressedCache *c,
+                                          Qcow2CompressedEntry *e, int ret)
+{
+    e->ret = ret;
+    e->loading = false;
+    qemu_co_queue_restart_all(&e->waiters);
+
+    if (ret < 0 && !e->detached) {
+        qcow2_compressed_cache_detach(c, e);
+    }
+    qcow2_compressed_cache_put(c, e);
+}
+
+typedef struct Qcow2DecompressTask {
+    AioTask task;
+    BlockDriverState *bs;
+    Qcow2CompressedEntry *entry;
+    const uint8_t *buf;
+} Qcow2DecompressTask;
+
+static coroutine_fn int qcow2_decompress_task_entry(AioTask *task)
+{
+    Qcow2DecompressTask *t = container_of(task, Qcow2DecompressTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    Qcow2CompressedEntry *e = t->entry;
+
+    if (qcow2_co_decompress(t->bs, e->data, s->cluster_size, t->buf,
+                            e->csize) < 0) {
+        qcow2_compressed_cache_loaded(s->compressed_cache, e, -EIO);
+        return -EIO;
+    }
+
+    qcow2_compressed_cache_loaded(s->compressed_cache, e, 0);
+    return 0;
+}
+
+/*
+ * Looks up the compressed clusters that follow the guest cluster at @offset
+ * and whose compressed data directly follows @first in the image file, and
+ * adds entries for those that are not cached yet to @entries.
+ */
+static void coroutine_fn
+qcow2_compressed_cache_readahead(BlockDriverState *bs, uint64_t offset,
+                                 Qcow2CompressedEntry *first,
+                                 GPtrArray *entries)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t end = first->coffset + first->csize;
+    uint64_t guest_end = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t guest_offset, l2_entry, coffset;
+    QCow2SubclusterType type;
+    unsigned int bytes;
+    int i, csize, ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 1; i <= QCOW2_COMPRESSED_READAHEAD; i++) {
+        Qcow2CompressedEntry *e;
+
+        guest_offset = start_of_cluster(s, offset) + i * s->cluster_size;
+        if (guest_offset >= guest_end) {
+            break;
+        }
+
+        bytes = s->cluster_size;
+        ret = qcow2_get_host_offset(bs, guest_offset, &bytes, &l2_entry,
+                                    &type);
+        if (ret < 0 || type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            break;
+        }
+
+        /* Only read what is stored contiguously after the requested cluster */
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        if (coffset < first->coffset || coffset > end ||
+            coffset + csize - first->coffset >
+            QCOW2_COMPRESSED_READAHEAD * s->cluster_size) {
+            break;
+        }
+        end = MAX(end, coffset + csize);
+
+        if (g_hash_table_contains(c->entries, &coffset)) {
+            continue;
+        }
+
+        e = qcow2_compressed_cache_insert(bs, coffset, csize);
+        if (!e) {
+            break;
+        }
+        g_ptr_array_add(entries, e);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+/*
+ * Reads and decompresses the cluster of @first and the clusters that are
+ * read ahead with it.  The clusters are decompressed in parallel in the
+ * thread pool.
+ */
+static int coroutine_fn
+qcow2_compressed_cache_load(BlockDriverState *bs, uint64_t offset,
+                            Qcow2CompressedEntry *first)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    g_autoptr(GPtrArray) entries = g_ptr_array_new();
+    AioTaskPool *aio = NULL;
+    uint64_t start = first->coffset, end = first->coffset + first->csize;
+    uint8_t *buf;
+    guint i;
+    int ret;
+
+    /* The reader keeps its own reference to @first */
+    first->ref++;
+    g_ptr_array_add(entries, first);
+    qcow2_compressed_cache_readahead(bs, offset, first, entries);
+
+    for (i = 1; i < entries->len; i++) {
+        Qcow2CompressedEntry *e = g_ptr_array_index(entries, i);
+        end = MAX(end, e->coffset + e->csize);
+    }
+
+    trace_qcow2_compressed_cache_load(bs, start, end - start, entries->len);
+
+    buf = g_try_malloc(end - start);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (entries->len == 1) {
+        ret = qcow2_co_decompress(bs, first->data, s->cluster_size, buf,
+                                  first->csize) < 0 ? -EIO : 0;
+        qcow2_compressed_cache_loaded(c, first, ret);
+        g_free(buf);
+        return ret;
+    }
+
+    aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    for (i = 0; i < entries->len; i++) {
+        Qcow2CompressedEntry *e = g_ptr_array_index(entries, i);
+        Qcow2DecompressTask *t = g_new(Qcow2DecompressTask, 1);
+
+        *t = (Qcow2DecompressTask) {
+            .task.func = qcow2_decompress_task_entry,
+            .bs = bs,
+            .entry = e,
+            .buf = buf + (e->coffset - start),
+        };
+        aio_task_pool_wait_slot(aio);
+        aio_task_pool_start_task(aio, &t->task);
+    }
+    aio_task_pool_wait_all(aio);
+    g_free(aio);
+    g_free(buf);
+
+    /* Only the result for the requested cluster matters to the caller */
+    return first->ret;
+
+fail:
+    g_free(buf);
+    for (i = 0; i < entries->len; i++) {
+        qcow2_compressed_cache_loaded(c, g_ptr_array_index(entries, i), ret);
+    }
+    return ret;
+}
+
+/*
+ * Reads @bytes at guest @offset from the compressed cluster described by
+ * @l2_entry through the cache.
+ */
+int coroutine_fn
+qcow2_compressed_cache_read(BlockDriverState *bs, uint64_t l2_entry,
+                            uint64_t offset, uint64_t bytes,
+                            QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedEntry *e;
+    uint64_t coffset;
+    int csize, ret;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+
+    e = g_hash_table_lookup(c->entries, &coffset);
+    if (e && e->csize == csize) {
+        c->hits++;
+        e->ref++;
+        QTAILQ_REMOVE(&c->lru, e, next);
+        QTAILQ_INSERT_TAIL(&c->lru, e, next);
+        while (e->loading) {
+            qemu_co_queue_wait(&e->waiters, NULL);
+        }
+        ret = e->ret;
+    } else {
+        if (e) {
+            qcow2_compressed_cache_detach(c, e);
+        }
+        c->misses++;
+        e = qcow2_compressed_cache_insert(bs, coffset, csize);
+        if (!e) {
+            return -ENOMEM;
+        }
+        ret = qcow2_compressed_cache_load(bs, offset, e);
+    }
+
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            e->data + offset_into_cluster(s, offset), bytes);
+    }
+    qcow2_compressed_cache_put(c, e);
+
+    return ret;
+}
+
+Qcow2CacheStats *qcow2_compressed_cache_get_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CacheStats *stats = g_new(Qcow2CacheStats, 1);
+
+    *stats = (Qcow2CacheStats) {
+        .hits = c->hits,
+        .misses = c->misses,
+        .evictions = c->evictions,
+        .size = (uint64_t) c->nb_entries * s->cluster_size,
+        .max_size = (uint64_t) c->max_entries * s->cluster_size,
+    };
+
+    return stats;
+}
@@ -0,0 +1,885 @@
+/*
+ * Metadata journal for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * With a metadata journal, the dirty L2 tables and refcount blocks of both
+ * caches are not written to their home location when the caches are written
+ * back.  Instead, all of them are appended to the journal as one entry,
+ * which is a single sequential write that needs no ordering flushes.
+ * Checkpoints copy the newest journaled version of each table to its home
+ * location and then start a new, empty generation of the journal.
+ *
+ * Entries are only valid if their sequence number matches the journal
+ * header and their checksum is correct, so a torn entry and everything after
+ * it is ignored on replay.  The on-disk format is described in
+ * docs/interop/qcow2.txt.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/crc32c.h"
+#include "qemu/memalign.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define QCOW2_JOURNAL_MAGIC       0x716a6e6c /* "qjnl" */
+#define QCOW2_JOURNAL_ENTRY_MAGIC 0x716a6e65 /* "qjne" */
+#define QCOW2_JOURNAL_VERSION     1
+
+/* Alignment of the journal header and of every entry */
+#define QCOW2_JOURNAL_ALIGN 4096
+
+typedef struct QEMU_PACKED Qcow2JournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence;
+} Qcow2JournalHeader;
+
+typedef struct QEMU_PACKED Qcow2JournalEntry {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint64_t length;
+    uint32_t nb_tables;
+    uint32_t reserved;
+} Qcow2JournalEntry;
+
+/* Where the newest journaled copy of (a part of) a table is */
+typedef struct Qcow2JournalMapping {
+    uint64_t offset;
+    uint64_t journal_offset;
+    uint32_t size;
+    uint32_t type;
+} Qcow2JournalMapping;
+
+/* Journaled tables in one host cluster, oldest first */
+typedef struct Qcow2JournalCluster {
+    int64_t offset;
+    GArray *tables;
+} Qcow2JournalCluster;
+
+typedef struct Qcow2Journal {
+    uint64_t sequence;
+    uint64_t next;          /* Offset of the next entry in the journal area */
+    bool active;            /* Cache write-back goes to the journal */
+    bool check_suspended;   /* Not active during a repairing check */
+    bool checkpoint_scheduled;
+    GHashTable *clusters;   /* Qcow2JournalCluster by cluster offset */
+} Qcow2Journal;
+
+static void qcow2_journal_cluster_free(gpointer data)
+{
+    Qcow2JournalCluster *jc = data;
+
+    g_array_free(jc->tables, true);
+    g_free(jc);
+}
+
+static Qcow2Journal *qcow2_journal_new(void)
+{
+    Qcow2Journal *j = g_new0(Qcow2Journal, 1);
+
+    j->next = QCOW2_JOURNAL_ALIGN;
+    j->clusters = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                        qcow2_journal_cluster_free);
+    return j;
+}
+
+void qcow2_journal_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->journal) {
+        g_hash_table_destroy(s->journal->clusters);
+        g_free(s->journal);
+        s->journal = NULL;
+    }
+}
+
+bool qcow2_journal_active(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return s->journal && s->journal->active;
+}
+
+/* Whether the journal contains tables that are newer than their home copy */
+bool qcow2_journal_pending(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return s->journal && s->journal->next > QCOW2_JOURNAL_ALIGN;
+}
+
+static void qcow2_journal_add_table(BlockDriverState *bs,
+                                    const Qcow2JournalTable *t,
+                                    uint64_t journal_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t cluster = start_of_cluster(s, t->offset);
+    Qcow2JournalCluster *jc;
+    Qcow2JournalMapping m = {
+        .offset = t->offset,
+        .journal_offset = journal_offset,
+        .size = t->size,
+        .type = t->type,
+    };
+    guint i;
+
+    jc = g_hash_table_lookup(s->journal->clusters, &cluster);
+    if (!jc) {
+        jc = g_new0(Qcow2JournalCluster, 1);
+        jc->offset = cluster;
+        jc->tables = g_array_new(false, false, sizeof(Qcow2JournalMapping));
+        g_hash_table_insert(s->journal->clusters, &jc->offset, jc);
+    }
+
+    /* Forget older copies that the new one completely replaces */
+    for (i = 0; i < jc->tables->len;) {
+        Qcow2JournalMapping *old =
+            &g_array_index(jc->tables, Qcow2JournalMapping, i);
+        if (old->offset >= m.offset &&
+            old->offset + old->size <= m.offset + m.size) {
+            g_array_remove_index(jc->tables, i);
+        } else {
+            i++;
+        }
+    }
+    g_array_append_val(jc->tables, m);
+}
+
+/*
+ * Reads the table at @offset into @buf, taking the journaled parts from the
+ * journal.  Returns 0 if no part of the table is in the journal (and @buf
+ * was not read), 1 on success, or -errno.
+ */
+static int qcow2_journal_read_table(BlockDriverState *bs, uint64_t offset,
+                                    void *buf, int size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t cluster = start_of_cluster(s, offset);
+    Qcow2JournalCluster *jc;
+    bool covered = false;
+    guint i;
+    int ret;
+
+    if (!s->journal) {
+        return 0;
+    }
+
+    jc = g_hash_table_lookup(s->journal->clusters, &cluster);
+    if (!jc) {
+        return 0;
+    }
+
+    for (i = 0; i < jc->tables->len; i++) {
+        Qcow2JournalMapping *m =
+            &g_array_index(jc->tables, Qcow2JournalMapping, i);
+        if (m->offset <= offset && m->offset + m->size >= offset + size) {
+            covered = true;
+        }
+    }
+
+    if (!covered) {
+        ret = bdrv_pread(bs->file, offset, buf, size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < jc->tables->len; i++) {
+        Qcow2JournalMapping *m =
+            &g_array_index(jc->tables, Qcow2JournalMapping, i);
+        uint64_t start = MAX(m->offset, offset);
+        uint64_t end = MIN(m->offset + m->size, offset + size);
+
+        if (start < end) {
+            ret = bdrv_pread(bs->file, m->journal_offset + (start - m->offset),
+                             (uint8_t *) buf + (start - offset), end - start);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Reads the L2 table or refcount block at @offset into @buf.  Tables in the
+ * journal are newer than their home copy, so they are taken from there.
+ * Returns 0 on success or -errno.
+ */
+int qcow2_journal_pread(BlockDriverState *bs, uint64_t offset,
+                        void *buf, int size)
+{
+    int ret;
+
+    ret = qcow2_journal_read_table(bs, offset, buf, size);
+    if (ret == 0) {
+        ret = bdrv_pread(bs->file, offset, buf, size);
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static int qcow2_journal_write_header(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader header = {
+        .magic = cpu_to_be32(QCOW2_JOURNAL_MAGIC),
+        .version = cpu_to_be32(QCOW2_JOURNAL_VERSION),
+        .sequence = cpu_to_be64(s->journal->sequence),
+    };
+    int ret;
+
+    ret = bdrv_pwrite(bs->file, s->journal_offset, &header, sizeof(header));
+    return ret < 0 ? ret : 0;
+}
+
+/* Sets or clears the incompatible feature bit for a non-empty journal */
+static int qcow2_journal_set_pending(BlockDriverState *bs, bool pending)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t features = s->incompatible_features;
+    uint64_t val;
+    int ret;
+
+    if (pending) {
+        features |= QCOW2_INCOMPAT_JOURNAL;
+    } else {
+        features &= ~QCOW2_INCOMPAT_JOURNAL;
+    }
+    if (features == s->incompatible_features) {
+        return 0;
+    }
+
+    val = cpu_to_be64(features);
+    ret = bdrv_pwrite(bs->file, offsetof(QCowHeader, incompatible_features),
+                      &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->incompatible_features = features;
+    return 0;
+}
+
+static gint qcow2_journal_mapping_cmp(gconstpointer a, gconstpointer b)
+{
+    const Qcow2JournalMapping *ma = a;
+    const Qcow2JournalMapping *mb = b;
+
+    return ma->journal_offset < mb->journal_offset ? -1 :
+           ma->journal_offset > mb->journal_offset;
+}
+
+/*
+ * Writes all journaled tables to their home location and empties the
+ * journal.  The caller must hold s->lock if it runs in a coroutine.
+ */
+int qcow2_journal_checkpoint(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    g_autoptr(GArray) tables = NULL;
+    GHashTableIter iter;
+    Qcow2JournalCluster *jc;
+    void *buf = NULL;
+    guint i;
+    int ret;
+
+    if (!qcow2_journal_pending(bs) || !bdrv_is_writable(bs)) {
+        return 0;
+    }
+
+    trace_qcow2_journal_checkpoint(bs, j->sequence, j->next);
+
+    /* Copy the tables in journal order, parts may overlap */
+    tables = g_array_new(false, false, sizeof(Qcow2JournalMapping));
+    g_hash_table_iter_init(&iter, j->clusters);
+    while (g_hash_table_iter_next(&iter, NULL, (void **) &jc)) {
+        g_array_append_vals(tables, jc->tables->data, jc->tables->len);
+    }
+    g_array_sort(tables, qcow2_journal_mapping_cmp);
+
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < tables->len; i++) {
+        Qcow2JournalMapping *m = &g_array_index(tables, Qcow2JournalMapping, i);
+
+        ret = bdrv_pread(bs->file, m->journal_offset, buf, m->size);
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, m->type, m->offset, m->size,
+                                            false);
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bdrv_pwrite(bs->file, m->offset, buf, m->size);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Start a new generation, which invalidates all existing entries */
+    j->sequence++;
+    ret = qcow2_journal_write_header(bs);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    g_hash_table_remove_all(j->clusters);
+    j->next = QCOW2_JOURNAL_ALIGN;
+
+    ret = qcow2_journal_set_pending(bs, false);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void coroutine_fn qcow2_journal_checkpoint_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        /* Not fatal, the journal is checkpointed again when it is full */
+        trace_qcow2_journal_checkpoint_failed(bs, ret);
+    }
+    s->journal->checkpoint_scheduled = false;
+    qemu_co_mutex_unlock(&s->lock);
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Starts a checkpoint in a new coroutine, so that it does not delay the
+ * request that filled the journal.  The coroutine runs once the caller
+ * yields and then waits for s->lock.
+ */
+static void qcow2_journal_schedule_checkpoint(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->journal->checkpoint_scheduled || !qemu_in_coroutine()) {
+        return;
+    }
+
+    s->journal->checkpoint_scheduled = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_journal_checkpoint_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+/*
+ * Appends the dirty tables of both caches to the journal as one entry and
+ * marks them clean.  The entry is not flushed to disk.
+ */
+int qcow2_journal_commit(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    g_autoptr(GArray) descs = NULL;
+    g_autoptr(GPtrArray) tables = NULL;
+    Qcow2JournalEntry *entry;
+    Qcow2JournalTable *disk_descs;
+    uint64_t desc_len, length, pos, data;
+    uint8_t *buf, *p;
+    bool need_flush;
+    guint i;
+    int ret;
+
+    descs = g_array_new(false, false, sizeof(Qcow2JournalTable));
+    tables = g_ptr_array_new();
+    need_flush = qcow2_cache_collect_dirty(s->refcount_block_cache,
+                                           QCOW2_OL_REFCOUNT_BLOCK,
+                                           descs, tables);
+    need_flush |= qcow2_cache_collect_dirty(s->l2_table_cache,
+                                            QCOW2_OL_ACTIVE_L2,
+                                            descs, tables);
+    if (descs->len == 0) {
+        return 0;
+    }
+
+    desc_len = ROUND_UP(sizeof(*entry) + descs->len * sizeof(*disk_descs),
+                        QCOW2_JOURNAL_ALIGN);
+    length = desc_len;
+    for (i = 0; i < descs->len; i++) {
+        length += g_array_index(descs, Qcow2JournalTable, i).size;
+    }
+    length = ROUND_UP(length, QCOW2_JOURNAL_ALIGN);
+
+    if (length > s->journal_size - QCOW2_JOURNAL_ALIGN) {
+        /* The entry can never fit, write the tables in place as usual */
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        j->active = false;
+        ret = qcow2_cache_write(bs, s->l2_table_cache);
+        if (ret == 0) {
+            ret = qcow2_cache_write(bs, s->refcount_block_cache);
+        }
+        j->active = true;
+        return ret;
+    }
+
+    if (j->next + length > s->journal_size) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (need_flush) {
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (!qcow2_journal_pending(bs)) {
+        ret = qcow2_journal_set_pending(bs, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, length);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    memset(buf, 0, desc_len);
+    entry = (Qcow2JournalEntry *) buf;
+    *entry = (Qcow2JournalEntry) {
+        .magic = cpu_to_be32(QCOW2_JOURNAL_ENTRY_MAGIC),
+        .sequence = cpu_to_be64(j->sequence),
+        .length = cpu_to_be64(length),
+        .nb_tables = cpu_to_be32(descs->len),
+    };
+
+    disk_descs = (Qcow2JournalTable *) (buf + sizeof(*entry));
+    p = buf + desc_len;
+    for (i = 0; i < descs->len; i++) {
+        Qcow2JournalTable *d = &g_array_index(descs, Qcow2JournalTable, i);
+
+        disk_descs[i] = (Qcow2JournalTable) {
+            .offset = cpu_to_be64(d->offset),
+            .size = cpu_to_be32(d->size),
+            .type = cpu_to_be32(d->type),
+        };
+        memcpy(p, g_ptr_array_index(tables, i), d->size);
+        p += d->size;
+    }
+    memset(p, 0, buf + length - p);
+    entry->checksum = cpu_to_be32(crc32c(0xffffffff, buf, length));
+
+    pos = s->journal_offset + j->next;
+    ret = bdrv_pwrite(bs->file, pos, buf, length);
+    qemu_vfree(buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_qcow2_journal_commit(bs, j->sequence, j->next, descs->len, length);
+
+    data = pos + desc_len;
+    for (i = 0; i < descs->len; i++) {
+        Qcow2JournalTable *d = &g_array_index(descs, Qcow2JournalTable, i);
+        qcow2_journal_add_table(bs, d, data);
+        data += d->size;
+    }
+    j->next += length;
+
+    qcow2_cache_mark_journaled(s->refcount_block_cache);
+    qcow2_cache_mark_journaled(s->l2_table_cache);
+
+    if (j->next > s->journal_size / 2) {
+        qcow2_journal_schedule_checkpoint(bs);
+    }
+
+    return 0;
+}
+
+/*
+ * Must be called before host clusters are reused.  If the journal holds a
+ * table that was stored in one of them, a later checkpoint or replay would
+ * overwrite the new contents, so the journal is checkpointed first.
+ */
+int qcow2_journal_reuse(BlockDriverState *bs, uint64_t offset, uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t cluster;
+
+    if (!qcow2_journal_pending(bs)) {
+        return 0;
+    }
+
+    for (cluster = start_of_cluster(s, offset); cluster < offset + size;
+         cluster += s->cluster_size) {
+        if (g_hash_table_contains(s->journal->clusters, &cluster)) {
+            return qcow2_journal_checkpoint(bs);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the entry at s->journal->next and adds its tables.  Returns 1 if a
+ * valid entry was found, 0 if the journal ends there, or -errno.
+ */
+static int qcow2_journal_load_entry(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    uint64_t pos = s->journal_offset + j->next;
+    Qcow2JournalEntry entry;
+    Qcow2JournalTable *disk_descs;
+    uint64_t length, desc_len, data;
+    uint32_t nb_tables, checksum;
+    uint8_t *buf;
+    uint32_t i;
+    int ret;
+
+    ret = bdrv_pread(bs->file, pos, &entry, sizeof(entry));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read metadata journal entry");
+        return ret;
+    }
+
+    length = be64_to_cpu(entry.length);
+    nb_tables = be32_to_cpu(entry.nb_tables);
+    if (be32_to_cpu(entry.magic) != QCOW2_JOURNAL_ENTRY_MAGIC ||
+        be64_to_cpu(entry.sequence) != j->sequence ||
+        nb_tables > s->journal_size / (1 << MIN_CLUSTER_BITS)) {
+        return 0;
+    }
+
+    desc_len = ROUND_UP(sizeof(entry) + nb_tables * sizeof(*disk_descs),
+                        QCOW2_JOURNAL_ALIGN);
+    if (length < desc_len || !QEMU_IS_ALIGNED(length, QCOW2_JOURNAL_ALIGN) ||
+        length > s->journal_size - j->next) {
+        return 0;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, length);
+    if (!buf) {
+        error_setg(errp, "Could not allocate metadata journal buffer");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, pos, buf, length);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read metadata journal entry");
+        goto out;
+    }
+
+    /* An incompletely written entry ends the journal */
+    checksum = be32_to_cpu(((Qcow2JournalEntry *) buf)->checksum);
+    ((Qcow2JournalEntry *) buf)->checksum = 0;
+    if (crc32c(0xffffffff, buf, length) != checksum) {
+        ret = 0;
+        goto out;
+    }
+
+    disk_descs = (Qcow2JournalTable *) (buf + sizeof(entry));
+    data = desc_len;
+    for (i = 0; i < nb_tables; i++) {
+        Qcow2JournalTable d = {
+            .offset = be64_to_cpu(disk_descs[i].offset),
+            .size = be32_to_cpu(disk_descs[i].size),
+            .type = be32_to_cpu(disk_descs[i].type),
+        };
+
+        if (d.size < (1 << MIN_CLUSTER_BITS) || d.size > s->cluster_size ||
+            !is_power_of_2(d.size) || !QEMU_IS_ALIGNED(d.offset, d.size) ||
+            (d.type != QCOW2_OL_ACTIVE_L2 &&
+             d.type != QCOW2_OL_REFCOUNT_BLOCK) ||
+            d.size > length - data) {
+            error_setg(errp, "Invalid table in metadata journal entry at "
+                       "offset 0x%" PRIx64, pos);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        qcow2_journal_add_table(bs, &d, pos + data);
+        data += d.size;
+    }
+
+    j->next += length;
+    ret = 1;
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int qcow2_journal_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Journal *j = s->journal;
+    Qcow2JournalHeader header;
+    int ret;
+
+    ret = bdrv_pread(bs->file, s->journal_offset, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read metadata journal header");
+        return ret;
+    }
+
+    if (be32_to_cpu(header.magic) != QCOW2_JOURNAL_MAGIC ||
+        be32_to_cpu(header.version) != QCOW2_JOURNAL_VERSION) {
+        error_setg(errp, "Invalid metadata journal header");
+        return -EINVAL;
+    }
+
+    j->sequence = be64_to_cpu(header.sequence);
+    j->next = QCOW2_JOURNAL_ALIGN;
+
+    do {
+        ret = qcow2_journal_load_entry(bs, errp);
+    } while (ret > 0 && j->next < s->journal_size);
+
+    if (ret >= 0) {
+        trace_qcow2_journal_load(bs, j->sequence, j->next);
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static int qcow2_journal_create(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = ROUND_UP(s->journal_size_opt, s->cluster_size);
+    int64_t offset;
+    int ret;
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        error_setg_errno(errp, -offset, "Could not allocate metadata journal");
+        return offset;
+    }
+
+    s->journal_offset = offset;
+    s->journal_size = size;
+    s->journal = qcow2_journal_new();
+
+    /*
+     * Start with a random sequence number, so that entries left in the
+     * clusters by an earlier journal are never valid.
+     */
+    s->journal->sequence = ((uint64_t) g_random_int() << 32) | g_random_int();
+    ret = qcow2_journal_write_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->journal->active = true;
+    return 0;
+
+fail:
+    error_setg_errno(errp, -ret, "Could not create metadata journal");
+    qcow2_journal_close(bs);
+    s->journal_offset = 0;
+    s->journal_size = 0;
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+    return ret;
+}
+
+/* Drops the journal area of an image that no longer uses a journal */
+static int qcow2_journal_remove(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->journal_offset;
+    uint64_t size = s->journal_size;
+    int ret;
+
+    qcow2_journal_close(bs);
+    s->journal_offset = 0;
+    s->journal_size = 0;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not remove metadata journal");
+        return ret;
+    }
+
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    return 0;
+}
+
+/*
+ * Loads the journal of the image, replays it if the image is writable, and
+ * creates or removes the journal according to the metadata-journal-size
+ * option.  A read-only image with a non-empty journal keeps serving the
+ * journaled tables from the journal.
+ */
+int qcow2_journal_open(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    bool writable = bdrv_is_writable(bs);
+    int ret;
+
+    if (s->journal_size_opt && s->qcow_version < 3) {
+        error_setg(errp, "A metadata journal requires a qcow2 image with at "
+                   "least qemu 1.1 compatibility level");
+        return -EINVAL;
+    }
+
+    if (!s->journal_offset) {
+        if (s->incompatible_features & QCOW2_INCOMPAT_JOURNAL) {
+            error_setg(errp, "Metadata journal bit set, but the image has no "
+                       "metadata journal");
+            return -EINVAL;
+        }
+        if (s->journal_size_opt && writable) {
+            return qcow2_journal_create(bs, errp);
+        }
+        return 0;
+    }
+
+    s->journal = qcow2_journal_new();
+    ret = qcow2_journal_load(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (!writable) {
+        return 0;
+    }
+
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not replay the metadata journal");
+        goto fail;
+    }
+
+    if (!s->journal_size_opt) {
+        return qcow2_journal_remove(bs, errp);
+    }
+
+    s->journal->active = true;
+    return 0;
+
+fail:
+    qcow2_journal_close(bs);
+    return ret;
+}
+
+/*
+ * Called when the image becomes writable.  The journal is not created here,
+ * but an existing one is used, and must be used as long as it is not empty:
+ * tables written in place could otherwise be overwritten by older journaled
+ * versions.
+ */
+void qcow2_journal_reopen_rw(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->journal) {
+        return;
+    }
+
+    s->journal->active = true;
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        error_report("%s: Failed to checkpoint the metadata journal: %s",
+                     bdrv_get_node_name(bs), strerror(-ret));
+        return;
+    }
+
+    s->journal->active = s->journal_size_opt != 0;
+}
+
+/*
+ * Prepares the journal for a check.  A non-empty journal is not an error: it
+ * was left by a crash, and the tables in it are the current ones.  Without
+ * repairs, the check reads them from the journal with qcow2_journal_pread().
+ * Repairs write tables in place, so the journal is replayed and not used
+ * until qcow2_check_journal_done().
+ */
+int qcow2_check_journal(BlockDriverState *bs, BdrvCheckResult *res,
+                        BdrvCheckMode fix)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!fix || !qcow2_journal_active(bs)) {
+        return 0;
+    }
+
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR replaying metadata journal: %s\n",
+                strerror(-ret));
+        res->check_errors++;
+        return ret;
+    }
+
+    s->journal->active = false;
+    s->journal->check_suspended = true;
+    return 0;
+}
+
+/* Uses the journal again after qcow2_check_journal() */
+void qcow2_check_journal_done(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->journal && s->journal->check_suspended) {
+        s->journal->check_suspended = false;
+        s->journal->active = true;
+    }
+}
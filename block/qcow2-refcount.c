@@ -902,6 +902,8 @@ static int update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            qcow2_compressed_cache_discard(bs, cluster_offset, s->cluster_size);
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -971,6 +973,7 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t i, nb_clusters, refcount;
+    int64_t offset;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -1004,7 +1007,15 @@ retry:
             size,
             (s->free_cluster_index - nb_clusters) << s->cluster_bits);
 #endif
-    return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
+    offset = (s->free_cluster_index - nb_clusters) << s->cluster_bits;
+
+    /* Journaled tables must not be written back over the new contents */
+    ret = qcow2_journal_reuse(bs, offset, nb_clusters << s->cluster_bits);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return offset;
 }
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
@@ -1063,9 +1074,83 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
+    ret = qcow2_journal_reuse(bs, offset, i << s->cluster_bits);
+    if (ret < 0) {
+        return ret;
+    }
+
     return i;
 }
 
+/*
+ * Allocates up to @nb_clusters data clusters for the write at @guest_offset
+ * from the extent reserved for its guest zone. The extent is refilled with
+ * a single refcount update of s->alloc_extent_size bytes when it is used up,
+ * so that concurrent sequential writers do not walk and update the refcount
+ * blocks for every request and their clusters stay contiguous on the host.
+ *
+ * If *host_offset is not INV_OFFSET, clusters are only taken if the extent
+ * continues exactly at *host_offset.
+ *
+ * Returns the number of clusters allocated (which may be less than
+ * @nb_clusters) and sets *host_offset, 0 if nothing could be taken from the
+ * extent, or -errno.
+ */
+int64_t qcow2_alloc_clusters_reserved(BlockDriverState *bs,
+                                      uint64_t guest_offset,
+                                      uint64_t *host_offset,
+                                      uint64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t zone = guest_offset / s->alloc_extent_size;
+    Qcow2AllocExtent *e = &s->alloc_extents[zone % QCOW2_ALLOC_EXTENTS];
+    uint64_t avail;
+
+    if (*host_offset != INV_OFFSET) {
+        if (e->offset != *host_offset) {
+            return 0;
+        }
+    } else if (e->offset == e->end) {
+        uint64_t size = MAX(s->alloc_extent_size,
+                            nb_clusters << s->cluster_bits);
+        int64_t offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            return offset;
+        }
+        e->offset = offset;
+        e->end = offset + size;
+    }
+
+    avail = (e->end - e->offset) >> s->cluster_bits;
+    nb_clusters = MIN(nb_clusters, avail);
+
+    *host_offset = e->offset;
+    e->offset += nb_clusters << s->cluster_bits;
+    return nb_clusters;
+}
+
+/*
+ * Drops the references held by the unused part of the reserved extents.
+ * Must be called before anything that assumes all allocated clusters are
+ * referenced, and before the image is closed or inactivated.
+ */
+void qcow2_release_alloc_extents(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < QCOW2_ALLOC_EXTENTS; i++) {
+        if (s->alloc_extents[i].offset < s->alloc_extents[i].end) {
+            qcow2_free_clusters(bs, s->alloc_extents[i].offset,
+                                s->alloc_extents[i].end -
+                                s->alloc_extents[i].offset,
+                                QCOW2_DISCARD_NEVER);
+        }
+        s->alloc_extents[i].offset = 0;
+        s->alloc_extents[i].end = 0;
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1671,8 +1756,8 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size_bytes);
+    /* Read L2 table from disk, or from the metadata journal */
+    ret = qcow2_journal_pread(bs, l2_offset, l2_table, l2_size_bytes);
     if (ret < 0) {
         fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
         res->check_errors++;
@@ -2004,8 +2089,8 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * l2_entry_size(s));
+        ret = qcow2_journal_pread(bs, l2_offset, l2_table,
+                                  s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -2285,6 +2370,15 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    /* metadata journal */
+    if (s->journal_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->journal_offset, s->journal_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* bitmaps */
     ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
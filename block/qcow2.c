@@ -72,6 +72,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_JOURNAL 0x4a524e4c
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -428,6 +429,51 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_JOURNAL:
+        {
+            Qcow2JournalHeaderExtension journal_ext;
+
+            if (ext.len != sizeof(journal_ext)) {
+                error_setg(errp, "metadata journal header extension size %u, "
+                           "but expected size %zu", ext.len,
+                           sizeof(journal_ext));
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &journal_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Unable to read metadata journal "
+                                 "header extension");
+                return ret;
+            }
+            journal_ext.offset = be64_to_cpu(journal_ext.offset);
+            journal_ext.size = be64_to_cpu(journal_ext.size);
+
+            if (journal_ext.size < QCOW2_MIN_JOURNAL_SIZE ||
+                journal_ext.size > QCOW2_MAX_JOURNAL_SIZE ||
+                offset_into_cluster(s, journal_ext.size)) {
+                error_setg(errp, "Invalid metadata journal size %" PRIu64,
+                           journal_ext.size);
+                return -EINVAL;
+            }
+
+            ret = qcow2_validate_table(bs, journal_ext.offset,
+                                       journal_ext.size, 1,
+                                       QCOW2_MAX_JOURNAL_SIZE,
+                                       "Metadata journal", errp);
+            if (ret < 0) {
+                return ret;
+            }
+
+            s->journal_offset = journal_ext.offset;
+            s->journal_size = journal_ext.size;
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got metadata journal at %" PRIu64 "\n",
+                   s->journal_offset);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -612,32 +658,40 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
     memset(result, 0, sizeof(*result));
 
+    ret = qcow2_check_journal(bs, result, fix);
+    if (ret < 0) {
+        return ret;
+    }
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
-        return ret;
+        goto out;
     }
 
     ret = qcow2_check_refcounts(bs, &refcount_res, fix);
     qcow2_add_check_result(result, &refcount_res, true);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
-        return ret;
+        goto out;
     }
 
     ret = qcow2_check_fix_snapshot_table(bs, &snapshot_res, fix);
     qcow2_add_check_result(result, &snapshot_res, false);
     if (ret < 0) {
-        return ret;
+        goto out;
     }
 
     if (fix && result->check_errors == 0 && result->corruptions == 0) {
         ret = qcow2_mark_clean(bs);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
-        return qcow2_mark_consistent(bs);
+        ret = qcow2_mark_consistent(bs);
     }
+
+out:
+    qcow2_check_journal_done(bs);
     return ret;
 }
 
@@ -698,6 +752,9 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_ALLOC_EXTENT_SIZE,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+    QCOW2_OPT_WORKER_THREADS,
     NULL
 };
 
@@ -809,6 +866,30 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_EXTENT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Allocate data clusters from extents of this size "
+                    "(0 disables)",
+        },
+        {
+            .name = QCOW2_OPT_METADATA_JOURNAL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the metadata journal (0 writes metadata in "
+                    "place)",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the cache of decompressed clusters "
+                    "(0 disables)",
+        },
+        {
+            .name = QCOW2_OPT_WORKER_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of threads compressing, decompressing "
+                    "or encrypting clusters in parallel",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -970,6 +1051,10 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t alloc_extent_size;
+    uint64_t journal_size;
+    uint64_t compressed_cache_size;
+    int max_threads;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1071,6 +1156,41 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->alloc_extent_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_EXTENT_SIZE, 0);
+    if (r->alloc_extent_size > QCOW2_MAX_ALLOC_EXTENT_SIZE) {
+        error_setg(errp, QCOW2_OPT_ALLOC_EXTENT_SIZE " must not exceed %"
+                   PRIu64, (uint64_t)QCOW2_MAX_ALLOC_EXTENT_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->alloc_extent_size = ROUND_UP(r->alloc_extent_size, s->cluster_size);
+
+    r->journal_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_METADATA_JOURNAL_SIZE, 0);
+    if (r->journal_size && (r->journal_size < QCOW2_MIN_JOURNAL_SIZE ||
+                            r->journal_size > QCOW2_MAX_JOURNAL_SIZE)) {
+        error_setg(errp, QCOW2_OPT_METADATA_JOURNAL_SIZE " must be 0 or "
+                   "between %" PRIu64 " and %" PRIu64,
+                   (uint64_t)QCOW2_MIN_JOURNAL_SIZE,
+                   (uint64_t)QCOW2_MAX_JOURNAL_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->journal_size = ROUND_UP(r->journal_size, s->cluster_size);
+
+    r->compressed_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE, 0);
+
+    r->max_threads = qemu_opt_get_number(opts, QCOW2_OPT_WORKER_THREADS,
+                                         QCOW2_MAX_THREADS);
+    if (r->max_threads < 1 || r->max_threads > QCOW2_WORKER_THREADS_MAX) {
+        error_setg(errp, QCOW2_OPT_WORKER_THREADS " must be between 1 and %d",
+                   QCOW2_WORKER_THREADS_MAX);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1226,6 +1346,24 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    s->alloc_extent_size = r->alloc_extent_size;
+
+    s->journal_size_opt = r->journal_size;
+
+    /* Reopening is drained, so no reader uses the old cache */
+    if (r->compressed_cache_size != s->compressed_cache_size) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+        s->compressed_cache = NULL;
+        if (r->compressed_cache_size) {
+            s->compressed_cache =
+                qcow2_compressed_cache_create(bs, r->compressed_cache_size);
+        }
+        s->compressed_cache_size = r->compressed_cache_size;
+    }
+
+    /* Tasks already running may exceed a lowered limit until they finish */
+    s->max_threads = r->max_threads;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1722,6 +1860,12 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
     }
 
+    /* Replay, create or remove the metadata journal */
+    ret = qcow2_journal_open(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* Clear unknown autoclear feature bits */
     update_header |= s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK;
     update_header = update_header && bdrv_is_writable(bs);
@@ -1834,6 +1978,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    QSIMPLEQ_INIT(&s->compressed_writes);
+    qemu_co_queue_init(&s->compressed_write_queue);
 
     return ret;
 
@@ -1846,6 +1992,9 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
+    qcow2_journal_close(bs);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
@@ -1940,6 +2089,12 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
         goto fail;
     }
 
+    if (r->alloc_extent_size != s->alloc_extent_size ||
+        (state->flags & BDRV_O_RDWR) == 0)
+    {
+        qcow2_release_alloc_extents(state->bs);
+    }
+
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
@@ -1952,6 +2107,13 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             goto fail;
         }
 
+        ret = qcow2_journal_checkpoint(state->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not checkpoint the metadata "
+                             "journal");
+            goto fail;
+        }
+
         ret = qcow2_mark_clean(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2006,6 +2168,8 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        qcow2_journal_reopen_rw(state->bs);
     }
 }
 
@@ -2331,10 +2495,14 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
+        ret = qcow2_get_host_offset_lockless(bs, offset, &cur_bytes,
+                                             &host_offset, &type);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto out;
         }
@@ -2693,6 +2861,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_alloc_extents(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2707,6 +2877,13 @@ static int qcow2_inactivate(BlockDriverState *bs)
                      strerror(-ret));
     }
 
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret) {
+        result = ret;
+        error_report("Failed to checkpoint the metadata journal: %s",
+                     strerror(-ret));
+    }
+
     if (result == 0) {
         qcow2_mark_clean(bs);
     }
@@ -2745,6 +2922,9 @@ static void qcow2_close(BlockDriverState *bs)
         s->data_file = NULL;
     }
 
+    qcow2_journal_close(bs);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -2944,6 +3124,23 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Metadata journal header extension */
+    if (s->journal_offset) {
+        Qcow2JournalHeaderExtension journal_ext = {
+            .offset = cpu_to_be64(s->journal_offset),
+            .size   = cpu_to_be64(s->journal_size),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_JOURNAL,
+                             &journal_ext, sizeof(journal_ext),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /*
      * Feature table.  A mere 8 feature names occupies 392 bytes, and
      * when coupled with the v3 minimum header of 104 bytes plus the
@@ -2979,6 +3176,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_JOURNAL_BITNR,
+                .name = "metadata journal",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -4230,6 +4432,9 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
             goto fail;
         }
 
+        /* Unused reserved clusters would keep the file from shrinking */
+        qcow2_release_alloc_extents(bs);
+
         ret = qcow2_cluster_discard(bs, ROUND_UP(offset, s->cluster_size),
                                     old_length - ROUND_UP(offset,
                                                           s->cluster_size),
@@ -4253,6 +4458,17 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
             goto fail;
         }
 
+        /* Journaled tables must not be written back beyond the new end */
+        ret = qcow2_write_caches(bs);
+        if (ret == 0) {
+            ret = qcow2_journal_checkpoint(bs);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Failed to checkpoint the metadata journal");
+            goto fail;
+        }
+
         old_file_size = bdrv_getlength(bs->file->bs);
         if (old_file_size < 0) {
             error_setg_errno(errp, -old_file_size,
@@ -4552,16 +4768,164 @@ fail:
     return ret;
 }
 
+struct Qcow2CompressedWrite {
+    uint64_t offset;
+    void *buf;
+    size_t len;
+    int ret;
+    bool ready;
+    bool done;
+    QSIMPLEQ_ENTRY(Qcow2CompressedWrite) next;
+};
+
+/*
+ * Reserve a place for the cluster at guest @offset in the queue of compressed
+ * clusters to write.  Clusters are placed in the image file in the order of
+ * their reservation, so this is done before compressing the data in parallel.
+ */
+static void coroutine_fn
+qcow2_co_queue_compressed(BlockDriverState *bs, Qcow2CompressedWrite *w,
+                          uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    *w = (Qcow2CompressedWrite) {
+        .offset = offset,
+    };
+
+    qemu_co_mutex_lock(&s->lock);
+    QSIMPLEQ_INSERT_TAIL(&s->compressed_writes, w, next);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+/* Give up a place reserved with qcow2_co_queue_compressed() */
+static void coroutine_fn
+qcow2_co_dequeue_compressed(BlockDriverState *bs, Qcow2CompressedWrite *w)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    QSIMPLEQ_REMOVE(&s->compressed_writes, w, Qcow2CompressedWrite, next);
+    /* Later clusters may have been waiting for this one */
+    qemu_co_queue_restart_all(&s->compressed_write_queue);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+/*
+ * Allocate host space for a batch of queued compressed clusters and write
+ * their data, merging clusters that were placed back to back into a single
+ * request.  Called and returns with s->lock held, but drops it while writing.
+ */
+static void coroutine_fn qcow2_co_write_compressed_batch(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedWrite *batch[QCOW2_COMPRESSED_BATCH_MAX];
+    uint64_t host_offset[QCOW2_COMPRESSED_BATCH_MAX];
+    int i, j, n = 0;
+    int ret;
+
+    while (n < QCOW2_COMPRESSED_BATCH_MAX &&
+           !QSIMPLEQ_EMPTY(&s->compressed_writes) &&
+           QSIMPLEQ_FIRST(&s->compressed_writes)->ready)
+    {
+        Qcow2CompressedWrite *w = QSIMPLEQ_FIRST(&s->compressed_writes);
+
+        QSIMPLEQ_REMOVE_HEAD(&s->compressed_writes, next);
+
+        ret = qcow2_alloc_compressed_cluster_offset(bs, w->offset, w->len,
+                                                    &host_offset[n]);
+        if (ret == 0) {
+            ret = qcow2_pre_write_overlap_check(bs, 0, host_offset[n], w->len,
+                                                true);
+        }
+        if (ret < 0) {
+            w->ret = ret;
+            w->done = true;
+            continue;
+        }
+        batch[n++] = w;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    for (i = 0; i < n; i = j) {
+        QEMUIOVector qiov;
+        uint64_t end = host_offset[i];
+
+        qemu_iovec_init(&qiov, n - i);
+        for (j = i; j < n && host_offset[j] == end; j++) {
+            qemu_iovec_add(&qiov, batch[j]->buf, batch[j]->len);
+            end += batch[j]->len;
+        }
+
+        trace_qcow2_compressed_write_batch(qemu_coroutine_self(),
+                                           host_offset[i], j - i, qiov.size);
+        BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
+        ret = bdrv_co_pwritev(s->data_file, host_offset[i], qiov.size, &qiov,
+                              0);
+        qemu_iovec_destroy(&qiov);
+
+        while (i < j) {
+            batch[i++]->ret = ret < 0 ? ret : 0;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    for (i = 0; i < n; i++) {
+        batch[i]->done = true;
+    }
+}
+
+/*
+ * Write the compressed data of a cluster queued with
+ * qcow2_co_queue_compressed().
+ *
+ * Compressed clusters are appended to the image, so instead of each of the
+ * parallel compression tasks allocating and writing its own cluster, they
+ * hand their data over here.  If no write is in progress and the first
+ * queued cluster has its data, all clusters ready up to the first one that
+ * is still being compressed are written, otherwise we wait for that.
+ */
+static int coroutine_fn
+qcow2_co_write_compressed(BlockDriverState *bs, Qcow2CompressedWrite *w,
+                          void *buf, size_t len)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    w->buf = buf;
+    w->len = len;
+    w->ready = true;
+
+    while (!w->done) {
+        if (s->compressed_writer ||
+            !QSIMPLEQ_FIRST(&s->compressed_writes)->ready)
+        {
+            qemu_co_queue_wait(&s->compressed_write_queue, &s->lock);
+            continue;
+        }
+
+        s->compressed_writer = true;
+        qcow2_co_write_compressed_batch(bs);
+        s->compressed_writer = false;
+        qemu_co_queue_restart_all(&s->compressed_write_queue);
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    return w->ret;
+}
+
 static coroutine_fn int
 qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
                                  uint64_t offset, uint64_t bytes,
                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedWrite w;
     int ret;
     ssize_t out_len;
     uint8_t *buf, *out_buf;
-    uint64_t cluster_offset;
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
@@ -4575,8 +4939,12 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     out_buf = g_malloc(s->cluster_size);
 
+    qcow2_co_queue_compressed(bs, &w, offset);
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
+    if (out_len < 0) {
+        qcow2_co_dequeue_compressed(bs, &w);
+    }
     if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
@@ -4589,22 +4957,7 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
         goto fail;
     }
 
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
-                                                &cluster_offset);
-    if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
-        goto fail;
-    }
-
-    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
-    qemu_co_mutex_unlock(&s->lock);
-    if (ret < 0) {
-        goto fail;
-    }
-
-    BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
-    ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
+    ret = qcow2_co_write_compressed(bs, &w, out_buf, out_len);
     if (ret < 0) {
         goto fail;
     }
@@ -4669,7 +5022,8 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
 
         if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+            /* Keep enough clusters in flight to feed all worker threads */
+            aio = aio_task_pool_new(MAX(QCOW2_MAX_WORKERS, s->max_threads));
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
@@ -4707,6 +5061,11 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
     uint8_t *buf, *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
 
+    if (s->compressed_cache) {
+        return qcow2_compressed_cache_read(bs, l2_entry, offset, bytes,
+                                           qiov, qiov_offset);
+    }
+
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
     buf = g_try_malloc(csize);
@@ -4760,6 +5119,9 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    /* All clusters are freed without going through update_refcount() */
+    qcow2_compressed_cache_discard(bs, 0, UINT64_MAX);
+
     /* Refcounts will be broken utterly */
     ret = qcow2_mark_dirty(bs);
     if (ret < 0) {
@@ -4894,21 +5256,23 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int step = QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size);
     int l1_clusters, ret = 0;
 
+    qcow2_release_alloc_extents(bs);
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
-        !has_data_file(bs)) {
+        !s->journal_offset && !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
-         * empties the image.  Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one
-         * refcount block) have to fit inside one refcount block. It
-         * only resets the image file, i.e. does not work with an
-         * external data file. */
+         * LUKS header, persistent bitmaps, or a metadata journal),
+         * because it completely empties the image.  Furthermore, the
+         * L1 table and three additional clusters (image header,
+         * refcount table, one refcount block) have to fit inside one
+         * refcount block. It only resets the image file, i.e. does not
+         * work with an external data file. */
         return make_completely_empty(bs);
     }
 
@@ -5120,6 +5484,25 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVQcow2State *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2 = (BlockStatsSpecificQcow2) {
+        .l2_cache = qcow2_cache_get_stats(s->l2_table_cache),
+        .refcount_cache = qcow2_cache_get_stats(s->refcount_block_cache),
+    };
+    if (s->compressed_cache) {
+        stats->u.qcow2.has_compressed_cache = true;
+        stats->u.qcow2.compressed_cache =
+            qcow2_compressed_cache_get_stats(bs);
+    }
+
+    return stats;
+}
+
 static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
                                                   Error **errp)
 {
@@ -5656,6 +6039,17 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                             (encryption_update == true)
     };
 
+    /*
+     * Both rewrite metadata without the caches.  The journal is removed when
+     * the image is opened without metadata-journal-size.
+     */
+    if (s->journal_offset &&
+        (new_version < old_version || s->refcount_bits != refcount_bits)) {
+        error_setg(errp, "Cannot change the compatibility level or the "
+                   "refcount width of an image with a metadata journal");
+        return -ENOTSUP;
+    }
+
     /* Upgrade first (some features may require compat=1.1) */
     if (new_version > old_version) {
         helper_cb_info.current_operation = QCOW2_UPGRADING;
@@ -6049,6 +6443,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -128,6 +128,14 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Size limits of the metadata journal */
+#define QCOW2_MIN_JOURNAL_SIZE (1 * MiB)
+#define QCOW2_MAX_JOURNAL_SIZE (1 * GiB)
+
+/* Number of host extents reserved for data cluster allocation */
+#define QCOW2_ALLOC_EXTENTS 8
+#define QCOW2_MAX_ALLOC_EXTENT_SIZE (1 * GiB)
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -149,6 +157,10 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_ALLOC_EXTENT_SIZE "alloc-extent-size"
+#define QCOW2_OPT_METADATA_JOURNAL_SIZE "metadata-journal-size"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
+#define QCOW2_OPT_WORKER_THREADS "worker-threads"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,11 +242,23 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+typedef struct Qcow2CompressedWrite Qcow2CompressedWrite;
+
+/* Derives data from a table that is published with it */
+typedef void *Qcow2CacheAuxFunc(BlockDriverState *bs, const void *table,
+                                uint64_t key);
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
 } QEMU_PACKED Qcow2CryptoHeaderExtension;
 
+typedef struct Qcow2JournalHeaderExtension {
+    uint64_t offset;
+    uint64_t size;
+} QEMU_PACKED Qcow2JournalHeaderExtension;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -255,17 +279,20 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_JOURNAL_BITNR    = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_JOURNAL          = 1 << QCOW2_INCOMPAT_JOURNAL_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_JOURNAL,
 };
 
 /* Compatible feature bits */
@@ -309,6 +336,22 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+/*
+ * Host clusters that are allocated (refcount 1) but not referenced by any
+ * L2 entry yet; [offset, end) is still free for use.
+ */
+typedef struct Qcow2AllocExtent {
+    uint64_t offset;
+    uint64_t end;
+} Qcow2AllocExtent;
+
+/* Describes a metadata table in an entry of the metadata journal */
+typedef struct QEMU_PACKED Qcow2JournalTable {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t type; /* QCOW2_OL_ACTIVE_L2 or QCOW2_OL_REFCOUNT_BLOCK */
+} Qcow2JournalTable;
+
 typedef uint64_t Qcow2GetRefcountFunc(const void *refcount_array,
                                       uint64_t index);
 typedef void Qcow2SetRefcountFunc(void *refcount_array,
@@ -321,7 +364,12 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+/* Default and upper limit of the worker-threads option */
 #define QCOW2_MAX_THREADS 4
+#define QCOW2_WORKER_THREADS_MAX 64
+
+/* Most compressed clusters that are appended to the image in one go */
+#define QCOW2_COMPRESSED_BATCH_MAX 64
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -356,6 +404,14 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Host clusters that have been allocated in advance for data writes.
+     * Guest zone n (of alloc_extent_size bytes each) allocates from
+     * alloc_extents[n % QCOW2_ALLOC_EXTENTS].
+     */
+    uint64_t alloc_extent_size;
+    Qcow2AllocExtent alloc_extents[QCOW2_ALLOC_EXTENTS];
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -373,6 +429,16 @@ typedef struct BDRVQcow2State {
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
 
+    /* Metadata journal area (header extension), and its runtime state */
+    uint64_t journal_offset;
+    uint64_t journal_size;
+    uint64_t journal_size_opt;
+    struct Qcow2Journal *journal;
+
+    /* Decompressed clusters, NULL if compressed-cache-size is 0 */
+    Qcow2CompressedCache *compressed_cache;
+    uint64_t compressed_cache_size;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -407,6 +473,15 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
+
+    /*
+     * Compressed clusters waiting to be written, and whether a coroutine is
+     * writing a batch of them.  See qcow2_co_write_compressed().
+     */
+    QSIMPLEQ_HEAD(, Qcow2CompressedWrite) compressed_writes;
+    bool compressed_writer;
+    CoQueue compressed_write_queue;
 
     BdrvChild *data_file;
 
@@ -865,6 +940,11 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_clusters_reserved(BlockDriverState *bs,
+                                      uint64_t guest_offset,
+                                      uint64_t *host_offset,
+                                      uint64_t nb_clusters);
+void qcow2_release_alloc_extents(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -908,6 +988,9 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
+int qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                   unsigned int *bytes, uint64_t *host_offset,
+                                   QCow2SubclusterType *subcluster_type);
 int qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                             unsigned int *bytes, uint64_t *host_offset,
                             QCowL2Meta **m);
@@ -976,6 +1059,44 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+const void *qcow2_cache_publish(BlockDriverState *bs, Qcow2Cache *c,
+                                void *table, uint64_t key,
+                                Qcow2CacheAuxFunc *aux_func);
+void qcow2_cache_unpublish(Qcow2Cache *c, uint64_t key);
+void qcow2_cache_unpublish_all(Qcow2Cache *c);
+const void *qcow2_cache_lookup_published(Qcow2Cache *c, uint64_t key,
+                                         const void **aux);
+bool qcow2_cache_collect_dirty(Qcow2Cache *c, uint32_t type, GArray *descs,
+                               GPtrArray *tables);
+void qcow2_cache_mark_journaled(Qcow2Cache *c);
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c);
+
+/* qcow2-journal.c functions */
+int qcow2_journal_open(BlockDriverState *bs, Error **errp);
+void qcow2_journal_close(BlockDriverState *bs);
+void qcow2_journal_reopen_rw(BlockDriverState *bs);
+bool qcow2_journal_active(BlockDriverState *bs);
+bool qcow2_journal_pending(BlockDriverState *bs);
+int qcow2_journal_commit(BlockDriverState *bs);
+int qcow2_journal_checkpoint(BlockDriverState *bs);
+int qcow2_journal_pread(BlockDriverState *bs, uint64_t offset,
+                        void *buf, int size);
+int qcow2_journal_reuse(BlockDriverState *bs, uint64_t offset, uint64_t size);
+int qcow2_check_journal(BlockDriverState *bs, BdrvCheckResult *res,
+                        BdrvCheckMode fix);
+void qcow2_check_journal_done(BlockDriverState *bs);
+
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs,
+                                                    uint64_t size);
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_discard(BlockDriverState *bs, uint64_t offset,
+                                    uint64_t length);
+int coroutine_fn
+qcow2_compressed_cache_read(BlockDriverState *bs, uint64_t l2_entry,
+                            uint64_t offset, uint64_t bytes,
+                            QEMUIOVector *qiov, size_t qiov_offset);
+Qcow2CacheStats *qcow2_compressed_cache_get_stats(BlockDriverState *bs);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -2830,6 +2830,9 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         if (backup->x_perf->has_max_chunk) {
             perf.max_chunk = backup->x_perf->max_chunk;
         }
+        if (backup->x_perf->has_dedup) {
+            perf.dedup = backup->x_perf->dedup;
+        }
     }
 
     if ((backup->sync == MIRROR_SYNC_MODE_BITMAP) ||
@@ -2964,6 +2967,8 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_filter_node_name,
                                    const char *filter_node_name,
                                    bool has_copy_mode, MirrorCopyMode copy_mode,
+                                   bool has_max_lag, int64_t max_lag,
+                                   bool has_max_lag_ms, int64_t max_lag_ms,
                                    bool has_auto_finalize, bool auto_finalize,
                                    bool has_auto_dismiss, bool auto_dismiss,
                                    Error **errp)
@@ -2995,6 +3000,12 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (!has_copy_mode) {
         copy_mode = MIRROR_COPY_MODE_BACKGROUND;
     }
+    if (!has_max_lag) {
+        max_lag = 0;
+    }
+    if (!has_max_lag_ms) {
+        max_lag_ms = MIRROR_DEFAULT_MAX_LAG_MS;
+    }
     if (has_auto_finalize && !auto_finalize) {
         job_flags |= JOB_MANUAL_FINALIZE;
     }
@@ -3012,6 +3023,18 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                    "a power of 2");
         return;
     }
+    if ((has_max_lag || has_max_lag_ms) &&
+        copy_mode != MIRROR_COPY_MODE_WRITE_ASYNC)
+    {
+        error_setg(errp, "max-lag and max-lag-ms require copy-mode "
+                   "'write-async'");
+        return;
+    }
+    if (max_lag_ms <= 0 || max_lag_ms > INT64_MAX / SCALE_MS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-lag-ms",
+                   "a positive number of milliseconds");
+        return;
+    }
 
     if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_MIRROR_SOURCE, errp)) {
         return;
@@ -3073,7 +3096,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                  has_replaces ? replaces : NULL, job_flags,
                  speed, granularity, buf_size, sync, backing_mode, zero_target,
                  on_source_error, on_target_error, unmap, filter_node_name,
-                 copy_mode, errp);
+                 copy_mode, max_lag, max_lag_ms * SCALE_MS, errp);
 }
 
 void qmp_drive_mirror(DriveMirror *arg, Error **errp)
@@ -3225,6 +3248,8 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_unmap, arg->unmap,
                            false, NULL,
                            arg->has_copy_mode, arg->copy_mode,
+                           arg->has_max_lag, arg->max_lag,
+                           arg->has_max_lag_ms, arg->max_lag_ms,
                            arg->has_auto_finalize, arg->auto_finalize,
                            arg->has_auto_dismiss, arg->auto_dismiss,
                            errp);
@@ -3247,6 +3272,8 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          bool has_filter_node_name,
                          const char *filter_node_name,
                          bool has_copy_mode, MirrorCopyMode copy_mode,
+                         bool has_max_lag, int64_t max_lag,
+                         bool has_max_lag_ms, int64_t max_lag_ms,
                          bool has_auto_finalize, bool auto_finalize,
                          bool has_auto_dismiss, bool auto_dismiss,
                          Error **errp)
@@ -3295,6 +3322,8 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                            true, true,
                            has_filter_node_name, filter_node_name,
                            has_copy_mode, copy_mode,
+                           has_max_lag, max_lag,
+                           has_max_lag_ms, max_lag_ms,
                            has_auto_finalize, auto_finalize,
                            has_auto_dismiss, auto_dismiss,
                            errp);
@@ -56,6 +56,11 @@ struct ThreadPool;
 struct LinuxAioState;
 struct LuringState;
 
+/* Kernel polling modes of an io_uring ring, see luring_init() */
+#define AIO_LURING_SQPOLL   (1 << 0)
+#define AIO_LURING_IOPOLL   (1 << 1)
+#define AIO_LURING_MAX      (1 << 2)
+
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
 
@@ -206,10 +211,10 @@ struct AioContext {
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     /*
-     * State for Linux io_uring.  Uses aio_context_acquire/release for
-     * locking.
+     * State for Linux io_uring, one ring for each combination of
+     * AIO_LURING_* flags.  Uses aio_context_acquire/release for locking.
      */
-    struct LuringState *linux_io_uring;
+    struct LuringState *linux_io_uring[AIO_LURING_MAX];
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
@@ -517,11 +522,14 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
-/* Setup the LuringState bound to this AioContext */
-struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+/* Setup the LuringState with AIO_LURING_* @flags bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx,
+                                             unsigned int flags,
+                                             Error **errp);
 
-/* Return the LuringState bound to this AioContext */
-struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+/* Return the LuringState with AIO_LURING_* @flags bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx,
+                                           unsigned int flags);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -28,9 +28,15 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      const BdrvDirtyBitmap *bitmap,
                                      Error **errp);
 
-/* Function should be called prior any actual copy request */
+/*
+ * Function should be called prior any actual copy request
+ *
+ * With @dedup, the data is compared with what the target holds already and
+ * only changed clusters are written.  block_copy_dedup_bytes() reports how
+ * much was saved this way.
+ */
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
-                              bool compress);
+                              bool compress, bool dedup);
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm);
 
 void block_copy_state_free(BlockCopyState *s);
@@ -93,6 +99,7 @@ void block_copy_call_cancel(BlockCopyCallState *call_state);
 
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 int64_t block_copy_cluster_size(BlockCopyState *s);
+int64_t block_copy_dedup_bytes(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
 #endif /* BLOCK_COPY_H */
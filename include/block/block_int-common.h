@@ -88,12 +88,23 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    QLIST_ENTRY(BdrvTrackedRequest) index_list; /* see tracked_requests_index */
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+typedef QLIST_HEAD(, BdrvTrackedRequest) BdrvTrackedRequestList;
+
+/*
+ * Tracked requests are also indexed by the granule their overlap range
+ * starts in, so that overlap checks only look at nearby requests.  Requests
+ * larger than a granule are kept in a separate list.
+ */
+#define BDRV_TRACKED_REQ_GRANULE_BITS 20
+#define BDRV_TRACKED_REQ_BUCKETS 64
+
 
 struct BlockDriver {
     /*
@@ -1168,7 +1179,9 @@ struct BlockDriverState {
 
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
-    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    BdrvTrackedRequestList tracked_requests;
+    BdrvTrackedRequestList tracked_requests_index[BDRV_TRACKED_REQ_BUCKETS];
+    BdrvTrackedRequestList tracked_requests_large;
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
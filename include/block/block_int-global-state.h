@@ -114,6 +114,9 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                               const char *filter_node_name,
                               BlockCompletionFunc *cb, void *opaque,
                               bool auto_complete, Error **errp);
+/* Default for the time bound on the target lag in write-async mode */
+#define MIRROR_DEFAULT_MAX_LAG_MS 1000
+
 /*
  * mirror_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -137,6 +140,10 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @max_lag: In write-async copy mode, the maximum number of bytes that may
+ *           still be on their way to the target, or 0 for @buf_size.
+ * @max_lag_ns: In write-async copy mode, the maximum time a write may take
+ *              to reach the target, or 0 for %MIRROR_DEFAULT_MAX_LAG_MS.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -153,7 +160,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, int64_t max_lag,
+                  int64_t max_lag_ns, Error **errp);
 
 /*
  * backup_job_create:
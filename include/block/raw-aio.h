@@ -62,10 +62,14 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s,
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
 typedef struct LuringState LuringState;
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(unsigned int flags, Error **errp);
 void luring_cleanup(LuringState *s);
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
                                 uint64_t offset, QEMUIOVector *qiov, int type);
+bool luring_has_fallocate(LuringState *s);
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int mode, uint64_t offset,
+                                     uint64_t len);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 void luring_io_plug(BlockDriverState *bs, LuringState *s);
@@ -71,6 +71,16 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * With the mapped-ram migration capability, the pages of this block
+     * live at @pages_offset of the migration file, and @bitmap_offset holds
+     * @file_bmap: a bit set for each page saved there.  Pages with a clear
+     * bit are zero.
+     */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 #endif
 #endif
@@ -182,6 +182,13 @@ struct VMStateDescription {
     int version_id;
     int minimum_version_id;
     MigrationPriority priority;
+    /*
+     * The state only depends on, and only changes, the device itself, and
+     * none of the callbacks needs the BQL.  With device-state-threads, it
+     * is then saved and loaded on a separate thread, concurrently with
+     * other devices.
+     */
+    bool parallel;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
     int (*pre_save)(void *opaque);
@@ -129,6 +129,7 @@ static const VMStateDescription vmstate_globalstate = {
     .name = "globalstate",
     .version_id = 1,
     .minimum_version_id = 1,
+    .parallel = true,
     .post_load = global_state_post_load,
     .pre_save = global_state_pre_save,
     .needed = global_state_needed,
@@ -0,0 +1,475 @@
+/*
+ * Parallel file I/O for the mapped-ram migration capability
+ *
+ * With mapped-ram, each RAM page has a fixed slot in the migration file.
+ * The migration thread only queues extents of guest memory together with
+ * their file offset; a pool of threads pwrite()s them (or pread()s them
+ * back on the destination) in parallel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/madvise.h"
+#include "qemu/timer.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "io/channel-file.h"
+#include "migration.h"
+#include "qemu-file.h"
+#include "mapped-ram.h"
+#include "trace.h"
+
+/* Largest extent handed to a thread at once */
+#define MAPPED_RAM_MAX_EXTENT (1 * MiB)
+/* Number of extents that can be in flight for each thread */
+#define MAPPED_RAM_JOBS_PER_THREAD 4
+/* Amount of mapped guest memory prefetched at once */
+#define MAPPED_RAM_PREFETCH_CHUNK (16 * MiB)
+
+typedef struct MappedRamJob {
+    /* Guest memory the extent is written from or read into */
+    uint8_t *host;
+    /* Copy of the extent to write, if the pool was set up with copy */
+    uint8_t *buf;
+    size_t len;
+    off_t offset;
+    QSIMPLEQ_ENTRY(MappedRamJob) next;
+} MappedRamJob;
+
+typedef struct MappedRamRange {
+    uint8_t *host;
+    size_t len;
+} MappedRamRange;
+
+typedef struct MappedRamFile {
+    dev_t dev;
+    ino_t ino;
+} MappedRamFile;
+
+/*
+ * MappedRamFile of the files guest memory was mapped from.  The mappings
+ * stay until QEMU exits, so these files must never be written again.
+ */
+static GArray *mapped_ram_files;
+
+static struct {
+    int fd;
+    bool write;
+    bool copy;
+    QemuThread *threads;
+    int threads_num;
+    MappedRamJob *jobs;
+    int jobs_num;
+    /* Extent being built by the migration thread, not queued yet */
+    MappedRamJob *cur;
+    QemuMutex mutex;
+    /* Signalled when a job is queued, or the threads should quit */
+    QemuCond cond;
+    /* Signalled when a job went back to the free list */
+    QemuCond done_cond;
+    QSIMPLEQ_HEAD(, MappedRamJob) pending;
+    QSIMPLEQ_HEAD(, MappedRamJob) free;
+    /* Number of jobs queued or being processed */
+    int busy;
+    bool quit;
+    /* First error hit by a thread */
+    int error;
+    /* MappedRamRange of guest memory mapped from the file */
+    GArray *mapped;
+    /* Whether the file was added to mapped_ram_files */
+    bool file_mapped;
+} *mapped_ram_state;
+
+static int mapped_ram_do_io(MappedRamJob *job)
+{
+    uint8_t *p = mapped_ram_state->copy ? job->buf : job->host;
+    size_t done = 0;
+
+    while (done < job->len) {
+        ssize_t ret;
+
+        if (mapped_ram_state->write) {
+            ret = pwrite(mapped_ram_state->fd, p + done, job->len - done,
+                         job->offset + done);
+        } else {
+            ret = pread(mapped_ram_state->fd, p + done, job->len - done,
+                        job->offset + done);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* The file is shorter than what its header says */
+            return -EIO;
+        }
+        done += ret;
+    }
+
+    return 0;
+}
+
+static void *mapped_ram_thread(void *opaque)
+{
+    MappedRamJob *job;
+    int ret;
+
+    qemu_mutex_lock(&mapped_ram_state->mutex);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&mapped_ram_state->pending);
+        if (!job) {
+            if (mapped_ram_state->quit) {
+                break;
+            }
+            qemu_cond_wait(&mapped_ram_state->cond, &mapped_ram_state->mutex);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&mapped_ram_state->pending, next);
+        qemu_mutex_unlock(&mapped_ram_state->mutex);
+
+        ret = mapped_ram_do_io(job);
+
+        qemu_mutex_lock(&mapped_ram_state->mutex);
+        if (ret && !mapped_ram_state->error) {
+            mapped_ram_state->error = ret;
+        }
+        QSIMPLEQ_INSERT_TAIL(&mapped_ram_state->free, job, next);
+        mapped_ram_state->busy--;
+        qemu_cond_broadcast(&mapped_ram_state->done_cond);
+    }
+    qemu_mutex_unlock(&mapped_ram_state->mutex);
+
+    return NULL;
+}
+
+/**
+ * mapped_ram_setup: start the threads accessing the migration file
+ *
+ * Returns 0 for success or -1 with @errp set if @f is not backed by a
+ * seekable file.
+ *
+ * @f: the migration file
+ * @write: whether the threads write (source) or read (destination)
+ * @copy: copy extents when they are queued, so that guest memory can change
+ *        before they are written
+ * @errp: pointer to an error
+ */
+int mapped_ram_setup(QEMUFile *f, bool write, bool copy, Error **errp)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    int nthreads = migrate_multifd_channels();
+    int fd, i;
+
+    if (!ioc || !object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "mapped-ram requires migrating to or from a file");
+        return -1;
+    }
+    fd = QIO_CHANNEL_FILE(ioc)->fd;
+    if (lseek(fd, 0, SEEK_CUR) < 0) {
+        error_setg_errno(errp, errno, "mapped-ram requires a seekable file");
+        return -1;
+    }
+    if (write && mapped_ram_fd_in_use(fd)) {
+        error_setg(errp, "Cannot migrate to a file that guest memory is "
+                   "mapped from");
+        return -1;
+    }
+
+    mapped_ram_state = g_new0(typeof(*mapped_ram_state), 1);
+    mapped_ram_state->fd = fd;
+    mapped_ram_state->write = write;
+    mapped_ram_state->copy = write && copy;
+    qemu_mutex_init(&mapped_ram_state->mutex);
+    qemu_cond_init(&mapped_ram_state->cond);
+    qemu_cond_init(&mapped_ram_state->done_cond);
+    QSIMPLEQ_INIT(&mapped_ram_state->pending);
+    QSIMPLEQ_INIT(&mapped_ram_state->free);
+    mapped_ram_state->mapped = g_array_new(false, false,
+                                           sizeof(MappedRamRange));
+
+    mapped_ram_state->jobs_num = nthreads * MAPPED_RAM_JOBS_PER_THREAD;
+    mapped_ram_state->jobs = g_new0(MappedRamJob, mapped_ram_state->jobs_num);
+    for (i = 0; i < mapped_ram_state->jobs_num; i++) {
+        MappedRamJob *job = &mapped_ram_state->jobs[i];
+
+        if (mapped_ram_state->copy) {
+            job->buf = g_malloc(MAPPED_RAM_MAX_EXTENT);
+        }
+        QSIMPLEQ_INSERT_TAIL(&mapped_ram_state->free, job, next);
+    }
+
+    mapped_ram_state->threads = g_new0(QemuThread, nthreads);
+    mapped_ram_state->threads_num = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_create(&mapped_ram_state->threads[i], "mapped-ram",
+                           mapped_ram_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+
+    trace_mapped_ram_setup(nthreads, write, mapped_ram_state->copy);
+
+    return 0;
+}
+
+/* Queue the extent being built, if any */
+static void mapped_ram_submit(void)
+{
+    MappedRamJob *job = mapped_ram_state->cur;
+
+    if (!job) {
+        return;
+    }
+    mapped_ram_state->cur = NULL;
+
+    qemu_mutex_lock(&mapped_ram_state->mutex);
+    mapped_ram_state->busy++;
+    QSIMPLEQ_INSERT_TAIL(&mapped_ram_state->pending, job, next);
+    qemu_cond_signal(&mapped_ram_state->cond);
+    qemu_mutex_unlock(&mapped_ram_state->mutex);
+}
+
+/**
+ * mapped_ram_queue: write or read an extent of guest memory
+ *
+ * Returns 0 for success or the negative errno of the first failed I/O.
+ * The I/O is only guaranteed to be done once mapped_ram_flush() returns.
+ *
+ * Contiguous extents are merged, up to MAPPED_RAM_MAX_EXTENT bytes.  Waits
+ * for a thread to finish its I/O if too many extents are in flight.
+ *
+ * @host: guest memory to write from, or read into
+ * @len: length of the extent
+ * @offset: offset of the extent in the migration file
+ */
+int mapped_ram_queue(uint8_t *host, size_t len, off_t offset)
+{
+    while (len) {
+        MappedRamJob *job = mapped_ram_state->cur;
+        size_t chunk;
+        int ret = 0;
+
+        if (job && job->host + job->len == host &&
+            job->offset + job->len == offset &&
+            job->len < MAPPED_RAM_MAX_EXTENT) {
+            chunk = MIN(len, MAPPED_RAM_MAX_EXTENT - job->len);
+        } else {
+            mapped_ram_submit();
+
+            qemu_mutex_lock(&mapped_ram_state->mutex);
+            while (!(job = QSIMPLEQ_FIRST(&mapped_ram_state->free)) &&
+                   !mapped_ram_state->error) {
+                qemu_cond_wait(&mapped_ram_state->done_cond,
+                               &mapped_ram_state->mutex);
+            }
+            ret = mapped_ram_state->error;
+            if (!ret) {
+                QSIMPLEQ_REMOVE_HEAD(&mapped_ram_state->free, next);
+            }
+            qemu_mutex_unlock(&mapped_ram_state->mutex);
+            if (ret) {
+                return ret;
+            }
+
+            job->host = host;
+            job->len = 0;
+            job->offset = offset;
+            mapped_ram_state->cur = job;
+            chunk = MIN(len, MAPPED_RAM_MAX_EXTENT);
+        }
+
+        if (mapped_ram_state->copy) {
+            memcpy(job->buf + job->len, host, chunk);
+        }
+        job->len += chunk;
+        host += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * mapped_ram_flush: wait for all the queued extents to be written or read
+ *
+ * Returns 0 for success or the negative errno of the first failed I/O.
+ */
+int mapped_ram_flush(void)
+{
+    int ret;
+
+    mapped_ram_submit();
+
+    qemu_mutex_lock(&mapped_ram_state->mutex);
+    while (mapped_ram_state->busy) {
+        qemu_cond_wait(&mapped_ram_state->done_cond, &mapped_ram_state->mutex);
+    }
+    ret = mapped_ram_state->error;
+    qemu_mutex_unlock(&mapped_ram_state->mutex);
+
+    return ret;
+}
+
+/**
+ * mapped_ram_map: map an extent of the migration file over guest memory
+ *
+ * Returns 0 for success or a negative errno.
+ *
+ * The mapping is private: the file is only read when a page is first
+ * accessed, and guest writes never reach it.  @host must be anonymous
+ * memory, aligned to the host page size like @len and @offset.
+ *
+ * @host: guest memory to replace
+ * @len: length of the extent
+ * @offset: offset of the extent in the migration file
+ */
+int mapped_ram_map(uint8_t *host, size_t len, off_t offset)
+{
+    MappedRamRange range = { .host = host, .len = len };
+    void *ptr;
+
+    if (!mapped_ram_state->file_mapped) {
+        struct stat st;
+        MappedRamFile file;
+
+        if (fstat(mapped_ram_state->fd, &st) < 0) {
+            return -errno;
+        }
+        file = (MappedRamFile) { .dev = st.st_dev, .ino = st.st_ino };
+        if (!mapped_ram_files) {
+            mapped_ram_files = g_array_new(false, false,
+                                           sizeof(MappedRamFile));
+        }
+        g_array_append_val(mapped_ram_files, file);
+        mapped_ram_state->file_mapped = true;
+    }
+
+    ptr = mmap(host, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+               mapped_ram_state->fd, offset);
+    if (ptr == MAP_FAILED) {
+        return -errno;
+    }
+
+    g_array_append_val(mapped_ram_state->mapped, range);
+    trace_mapped_ram_map(host, len, offset);
+
+    return 0;
+}
+
+/**
+ * mapped_ram_file_in_use: whether guest memory is mapped from a file
+ *
+ * Pages of the file that the guest has not written yet are still read from
+ * it, so writing the file would change guest memory, and truncating it
+ * would make accesses to these pages raise SIGBUS.
+ *
+ * @st: the result of stat() or fstat() for the file
+ */
+bool mapped_ram_file_in_use(const struct stat *st)
+{
+    int i;
+
+    for (i = 0; mapped_ram_files && i < mapped_ram_files->len; i++) {
+        MappedRamFile *file = &g_array_index(mapped_ram_files,
+                                             MappedRamFile, i);
+
+        if (file->dev == st->st_dev && file->ino == st->st_ino) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Like mapped_ram_file_in_use(), for an open file */
+bool mapped_ram_fd_in_use(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && mapped_ram_file_in_use(&st);
+}
+
+static void *mapped_ram_prefetch_thread(void *opaque)
+{
+    GArray *mapped = opaque;
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < mapped->len; i++) {
+        MappedRamRange *range = &g_array_index(mapped, MappedRamRange, i);
+        size_t done, chunk;
+
+        for (done = 0; done < range->len; done += chunk) {
+            chunk = MIN(range->len - done, MAPPED_RAM_PREFETCH_CHUNK);
+            /* Only reads the file into the page cache, pages stay shared */
+            qemu_madvise(range->host + done, chunk, QEMU_MADV_WILLNEED);
+        }
+        total += range->len;
+    }
+    g_array_free(mapped, true);
+
+    trace_mapped_ram_prefetch_done(total,
+                                   qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                   start);
+
+    return NULL;
+}
+
+/*
+ * Start reading the memory mapped with mapped_ram_map() in the background,
+ * so that the guest finds most pages in the page cache when it first
+ * accesses them.
+ */
+void mapped_ram_prefetch_start(void)
+{
+    QemuThread thread;
+
+    if (!mapped_ram_state->mapped->len) {
+        return;
+    }
+
+    qemu_thread_create(&thread, "mapped-ram-pf", mapped_ram_prefetch_thread,
+                       mapped_ram_state->mapped, QEMU_THREAD_DETACHED);
+    mapped_ram_state->mapped = g_array_new(false, false,
+                                           sizeof(MappedRamRange));
+}
+
+void mapped_ram_cleanup(void)
+{
+    int i;
+
+    if (!mapped_ram_state) {
+        return;
+    }
+
+    qemu_mutex_lock(&mapped_ram_state->mutex);
+    /* Don't bother with an extent that was never queued */
+    mapped_ram_state->cur = NULL;
+    mapped_ram_state->quit = true;
+    qemu_cond_broadcast(&mapped_ram_state->cond);
+    qemu_mutex_unlock(&mapped_ram_state->mutex);
+
+    for (i = 0; i < mapped_ram_state->threads_num; i++) {
+        qemu_thread_join(&mapped_ram_state->threads[i]);
+    }
+    g_free(mapped_ram_state->threads);
+
+    for (i = 0; i < mapped_ram_state->jobs_num; i++) {
+        g_free(mapped_ram_state->jobs[i].buf);
+    }
+    g_free(mapped_ram_state->jobs);
+    g_array_free(mapped_ram_state->mapped, true);
+
+    qemu_cond_destroy(&mapped_ram_state->done_cond);
+    qemu_cond_destroy(&mapped_ram_state->cond);
+    qemu_mutex_destroy(&mapped_ram_state->mutex);
+    g_free(mapped_ram_state);
+    mapped_ram_state = NULL;
+
+    trace_mapped_ram_cleanup();
+}
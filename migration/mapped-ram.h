@@ -0,0 +1,20 @@
+/*
+ * Parallel file I/O for the mapped-ram migration capability
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_MAPPED_RAM_H
+#define QEMU_MIGRATION_MAPPED_RAM_H
+
+int mapped_ram_setup(QEMUFile *f, bool write, bool copy, Error **errp);
+void mapped_ram_cleanup(void);
+int mapped_ram_queue(uint8_t *host, size_t len, off_t offset);
+int mapped_ram_flush(void);
+int mapped_ram_map(uint8_t *host, size_t len, off_t offset);
+void mapped_ram_prefetch_start(void);
+bool mapped_ram_file_in_use(const struct stat *st);
+bool mapped_ram_fd_in_use(int fd);
+
+#endif
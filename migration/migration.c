@@ -20,6 +20,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -101,6 +102,15 @@
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* 0: pages are placed by the thread loading them */
+#define DEFAULT_MIGRATE_POSTCOPY_PLACE_THREADS 0
+#define MAX_MIGRATE_POSTCOPY_PLACE_THREADS 64
+/* 0: all device state is saved and loaded by the migration thread */
+#define DEFAULT_MIGRATE_DEVICE_STATE_THREADS 0
+#define MAX_MIGRATE_DEVICE_STATE_THREADS 64
+/* The default number of dirty bitmap sync threads */
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 0
+#define MAX_MIGRATE_DIRTY_SYNC_THREADS 64
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -129,6 +139,7 @@ enum mig_rp_message_type {
     MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
     MIG_RP_MSG_RECV_BITMAP,  /* send recved_bitmap back to source */
     MIG_RP_MSG_RESUME_ACK,   /* tell source that we are ready to resume */
+    MIG_RP_MSG_SWITCHOVER_TIME, /* data (time after the stream: be64 us) */
 
     MIG_RP_MSG_MAX
 };
@@ -165,6 +176,15 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_X_COLO,
     MIGRATION_CAPABILITY_VALIDATE_UUID);
 
+/* Mapped-ram compatibility check list */
+static const
+INITIALIZE_MIGRATE_CAPS_SET(check_caps_mapped_ram,
+    MIGRATION_CAPABILITY_POSTCOPY_RAM,
+    MIGRATION_CAPABILITY_MULTIFD,
+    MIGRATION_CAPABILITY_COMPRESS,
+    MIGRATION_CAPABILITY_XBZRLE,
+    MIGRATION_CAPABILITY_X_COLO);
+
 /* When we add fault tolerance, we could have several
    migrations at once.  For now we don't need to add
    dynamic creation of migration */
@@ -296,6 +316,11 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        migration_ioc_unregister_yank_from_file(mis->postcopy_qemufile_dst);
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -415,10 +440,14 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         if (!received && !g_tree_lookup(mis->page_requested, aligned)) {
             /*
              * The page has not been received, and it's not yet in the page
-             * request list.  Queue it.  Set the value of element to 1, so that
-             * things like g_tree_lookup() will return TRUE (1) when found.
+             * request list.  Queue it.  The value of the element is the
+             * time of the request, used to account the latency once the
+             * page is placed; the lowest bit is always set so that things
+             * like g_tree_lookup() will return non-NULL when found.
              */
-            g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+            uintptr_t stamp = qemu_clock_get_us(QEMU_CLOCK_REALTIME) | 1;
+
+            g_tree_insert(mis->page_requested, aligned, (gpointer)stamp);
             mis->page_requested_count++;
             trace_postcopy_page_req_add(aligned, mis->page_requested_count);
         }
@@ -469,12 +498,12 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p = NULL;
 
-    migrate_protocol_allow_multifd(false); /* reset it anyway */
+    migrate_protocol_allow_multi_channels(false); /* reset it anyway */
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (strstart(uri, "tcp:", &p) ||
         strstart(uri, "unix:", NULL) ||
         strstart(uri, "vsock:", NULL)) {
-        migrate_protocol_allow_multifd(true);
+        migrate_protocol_allow_multi_channels(true);
         socket_start_incoming_migration(p ? p : uri, errp);
 #ifdef CONFIG_RDMA
     } else if (strstart(uri, "rdma:", &p)) {
@@ -484,6 +513,8 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -542,6 +573,10 @@ static void process_incoming_migration_bh(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
+    if (mis->to_src_file && migrate_switchover_predict()) {
+        migrate_send_rp_switchover_time(mis,
+            qemu_clock_get_us(QEMU_CLOCK_REALTIME) - mis->stream_end_us);
+    }
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -723,17 +758,24 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd and postcopy-preempt need more than one
+         * channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
-    } else {
+        start_migration = !migrate_use_multifd() &&
+                          !migrate_postcopy_preempt();
+    } else if (migrate_use_multifd()) {
         /* Multiple connections */
-        assert(migrate_use_multifd());
         start_migration = multifd_recv_new_channel(ioc, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
         }
+    } else {
+        /* The only other extra connection is the postcopy preempt one */
+        QEMUFile *f = qemu_fopen_channel_input(ioc);
+
+        assert(migrate_postcopy_preempt());
+        start_migration = postcopy_preempt_new_channel(mis, f);
     }
 
     if (start_migration) {
@@ -754,6 +796,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -784,6 +830,21 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
     migrate_send_rp_message(mis, MIG_RP_MSG_PONG, sizeof(buf), &buf);
 }
 
+/*
+ * Send a 'SWITCHOVER_TIME' message on the return channel with the time
+ * spent after the end of the migration stream until the guest could resume,
+ * in microseconds
+ */
+void migrate_send_rp_switchover_time(MigrationIncomingState *mis,
+                                     uint64_t value)
+{
+    uint64_t buf;
+
+    buf = cpu_to_be64(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_SWITCHOVER_TIME, sizeof(buf),
+                            &buf);
+}
+
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name)
 {
@@ -913,6 +974,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->announce_rounds = s->parameters.announce_rounds;
     params->has_announce_step = true;
     params->announce_step = s->parameters.announce_step;
+    params->has_postcopy_place_threads = true;
+    params->postcopy_place_threads = s->parameters.postcopy_place_threads;
+    params->has_device_state_threads = true;
+    params->device_state_threads = s->parameters.device_state_threads;
+    params->has_dirty_sync_threads = true;
+    params->dirty_sync_threads = s->parameters.dirty_sync_threads;
 
     if (s->parameters.has_block_bitmap_mapping) {
         params->has_block_bitmap_mapping = true;
@@ -992,6 +1059,11 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
         info->total_time = s->total_time;
         info->has_downtime = true;
         info->downtime = s->downtime;
+        if (s->downtime_actual.total) {
+            info->has_downtime_actual = true;
+            info->downtime_actual = QAPI_CLONE(DowntimeStats,
+                                               &s->downtime_actual);
+        }
     } else {
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
@@ -999,6 +1071,11 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
     }
+    if (migrate_switchover_predict() && s->downtime_predicted.total) {
+        info->has_downtime_predicted = true;
+        info->downtime_predicted = QAPI_CLONE(DowntimeStats,
+                                              &s->downtime_predicted);
+    }
 }
 
 static void populate_ram_info(MigrationInfo *info, MigrationState *s)
@@ -1016,9 +1093,12 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->normal_bytes = ram_counters.normal * page_size;
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = ram_counters.dirty_sync_count;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
+    info->ram->dirty_sync_time_max = ram_counters.dirty_sync_time_max;
     info->ram->postcopy_requests = ram_counters.postcopy_requests;
     info->ram->page_size = page_size;
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
+    info->ram->mapped_ram_bytes = ram_counters.mapped_ram_bytes;
     info->ram->pages_per_second = s->pages_per_second;
     info->ram->precopy_bytes = ram_counters.precopy_bytes;
     info->ram->downtime_bytes = ram_counters.downtime_bytes;
@@ -1122,6 +1202,13 @@ static void fill_source_migration_info(MigrationInfo *info)
         populate_time_info(info, s);
         populate_ram_info(info, s);
         populate_vfio_info(info);
+        if (s->device_state_times) {
+            /* Outgoing migration wins over an earlier incoming one */
+            qapi_free_DeviceStateTimeList(info->device_state);
+            info->has_device_state = true;
+            info->device_state = QAPI_CLONE(DeviceStateTimeList,
+                                            s->device_state_times);
+        }
         break;
     case MIGRATION_STATUS_FAILED:
         info->has_status = true;
@@ -1226,6 +1313,56 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /*
+         * Preempt mode requires urgent pages to be sent in separate
+         * channel, OTOH compression logic will disorder all pages into
+         * different compression channels, which is not compatible with the
+         * preempt assumptions on channel assignments.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt not compatible with compress");
+            return false;
+        }
+
+        /*
+         * The destination tells the channels apart by the order they
+         * connect in, which only works if nothing else opens extra ones.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt not compatible with multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        int idx;
+        /*
+         * Pages are only written to their slot in the file; there is no
+         * stream for postcopy to request them on, nor for the other
+         * features to encode them into.
+         */
+        for (idx = 0; idx < check_caps_mapped_ram.size; idx++) {
+            int incomp_cap = check_caps_mapped_ram.caps[idx];
+            if (cap_list[incomp_cap]) {
+                error_setg(errp, "Mapped-ram is not compatible with %s",
+                           MigrationCapability_str(incomp_cap));
+                return false;
+            }
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM_LAZY] &&
+        !cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        error_setg(errp, "Mapped-ram-lazy requires mapped-ram");
+        return false;
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1261,15 +1398,56 @@ static bool migrate_caps_check(bool *cap_list,
 
     /* incoming side only */
     if (runstate_check(RUN_STATE_INMIGRATE) &&
-        !migrate_multifd_is_allowed() &&
+        !migrate_multi_channels_is_allowed() &&
         cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
         error_setg(errp, "multifd is not supported by current protocol");
         return false;
     }
 
+    if (runstate_check(RUN_STATE_INMIGRATE) &&
+        !migrate_multi_channels_is_allowed() &&
+        cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        error_setg(errp, "postcopy-preempt is not supported by current "
+                   "protocol");
+        return false;
+    }
+
     return true;
 }
 
+static void fill_destination_postcopy_latency_info(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyLatencyInfo *latency;
+    int i;
+
+    if (postcopy_state_get() < POSTCOPY_INCOMING_LISTENING) {
+        return;
+    }
+
+    latency = g_new0(PostcopyLatencyInfo, 1);
+
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        latency->requests = mis->page_request_latency_count;
+        if (latency->requests) {
+            latency->average = mis->page_request_latency_total /
+                               latency->requests;
+        }
+        latency->max = mis->page_request_latency_max;
+        for (i = POSTCOPY_LATENCY_BINS - 1; i >= 0; i--) {
+            QAPI_LIST_PREPEND(latency->bins,
+                              mis->page_request_latency_bins[i]);
+            if (i) {
+                QAPI_LIST_PREPEND(latency->boundaries,
+                                  1ULL << (POSTCOPY_LATENCY_SHIFT_MIN + i - 1));
+            }
+        }
+    }
+
+    info->has_postcopy_latency = true;
+    info->postcopy_latency = latency;
+}
+
 static void fill_destination_migration_info(MigrationInfo *info)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
@@ -1297,8 +1475,14 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        if (mis->device_state_times) {
+            info->has_device_state = true;
+            info->device_state = QAPI_CLONE(DeviceStateTimeList,
+                                            mis->device_state_times);
+        }
         break;
     }
+    fill_destination_postcopy_latency_info(info);
     info->status = mis->state;
 }
 
@@ -1428,6 +1612,33 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_postcopy_place_threads &&
+        (params->postcopy_place_threads > MAX_MIGRATE_POSTCOPY_PLACE_THREADS)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_place_threads",
+                   "a value between 0 and "
+                   stringify(MAX_MIGRATE_POSTCOPY_PLACE_THREADS));
+        return false;
+    }
+
+    if (params->has_device_state_threads &&
+        (params->device_state_threads > MAX_MIGRATE_DEVICE_STATE_THREADS)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "device_state_threads",
+                   "a value between 0 and "
+                   stringify(MAX_MIGRATE_DEVICE_STATE_THREADS));
+        return false;
+    }
+
+    if (params->has_dirty_sync_threads &&
+        (params->dirty_sync_threads > MAX_MIGRATE_DIRTY_SYNC_THREADS)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "dirty_sync_threads",
+                   "a value between 0 and "
+                   stringify(MAX_MIGRATE_DIRTY_SYNC_THREADS));
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1576,6 +1787,15 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_announce_step) {
         dest->announce_step = params->announce_step;
     }
+    if (params->has_postcopy_place_threads) {
+        dest->postcopy_place_threads = params->postcopy_place_threads;
+    }
+    if (params->has_device_state_threads) {
+        dest->device_state_threads = params->device_state_threads;
+    }
+    if (params->has_dirty_sync_threads) {
+        dest->dirty_sync_threads = params->dirty_sync_threads;
+    }
 
     if (params->has_block_bitmap_mapping) {
         dest->has_block_bitmap_mapping = true;
@@ -1693,6 +1913,15 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_announce_step) {
         s->parameters.announce_step = params->announce_step;
     }
+    if (params->has_postcopy_place_threads) {
+        s->parameters.postcopy_place_threads = params->postcopy_place_threads;
+    }
+    if (params->has_device_state_threads) {
+        s->parameters.device_state_threads = params->device_state_threads;
+    }
+    if (params->has_dirty_sync_threads) {
+        s->parameters.dirty_sync_threads = params->dirty_sync_threads;
+    }
 
     if (params->has_block_bitmap_mapping) {
         qapi_free_BitmapMigrationNodeAliasList(
@@ -1835,6 +2064,12 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_fclose(tmp);
     }
 
+    if (s->postcopy_qemufile_src) {
+        migration_ioc_unregister_yank_from_file(s->postcopy_qemufile_src);
+        qemu_fclose(s->postcopy_qemufile_src);
+        s->postcopy_qemufile_src = NULL;
+    }
+
     assert(!migration_is_active(s));
 
     if (s->state == MIGRATION_STATUS_CANCELLING) {
@@ -2057,6 +2292,7 @@ void migrate_init(MigrationState *s)
     s->setup_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
+    s->postcopy_qemufile_src = NULL;
     s->migration_thread_running = false;
     error_free(s->error);
     s->error = NULL;
@@ -2069,6 +2305,9 @@ void migrate_init(MigrationState *s)
     s->vm_was_running = false;
     s->iteration_initial_bytes = 0;
     s->threshold_size = 0;
+    s->bandwidth = 0;
+    memset(&s->downtime_predicted, 0, sizeof(s->downtime_predicted));
+    s->downtime_actual.total = 0;
 }
 
 int migrate_add_blocker_internal(Error *reason, Error **errp)
@@ -2242,6 +2481,17 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
             return false;
         }
 
+        /*
+         * The preempt channel is only established when the migration
+         * starts, so there is nothing to send urgent pages on after a
+         * network failure.
+         */
+        if (migrate_postcopy_preempt()) {
+            error_setg(errp, "Postcopy recovery is not supported "
+                       "with postcopy-preempt yet");
+            return false;
+        }
+
         /* This is a resume, skip init status */
         return true;
     }
@@ -2319,11 +2569,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         }
     }
 
-    migrate_protocol_allow_multifd(false);
+    migrate_protocol_allow_multi_channels(false);
     if (strstart(uri, "tcp:", &p) ||
         strstart(uri, "unix:", NULL) ||
         strstart(uri, "vsock:", NULL)) {
-        migrate_protocol_allow_multifd(true);
+        migrate_protocol_allow_multi_channels(true);
         socket_start_outgoing_migration(s, p ? p : uri, &local_err);
 #ifdef CONFIG_RDMA
     } else if (strstart(uri, "rdma:", &p)) {
@@ -2333,6 +2583,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         if (!(has_resume && resume)) {
             yank_unregister_instance(MIGRATION_YANK_INSTANCE);
@@ -2394,6 +2646,42 @@ bool migrate_postcopy(void)
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_mapped_ram_lazy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM_LAZY];
+}
+
+bool migrate_switchover_predict(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_SWITCHOVER_PREDICT];
+}
+
 bool migrate_auto_converge(void)
 {
     MigrationState *s;
@@ -2557,6 +2845,33 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+int migrate_postcopy_place_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_place_threads;
+}
+
+int migrate_device_state_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.device_state_threads;
+}
+
+int migrate_dirty_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.dirty_sync_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2602,6 +2917,22 @@ bool migrate_use_return_path(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_RETURN_PATH];
 }
 
+static bool migrate_allow_multi_channels = true;
+
+/*
+ * Whether the transport of the current migration can open more than one
+ * connection to the other side (needed by multifd and postcopy-preempt).
+ */
+void migrate_protocol_allow_multi_channels(bool allow)
+{
+    migrate_allow_multi_channels = allow;
+}
+
+bool migrate_multi_channels_is_allowed(void)
+{
+    return migrate_allow_multi_channels;
+}
+
 bool migrate_use_block_incremental(void)
 {
     MigrationState *s;
@@ -2641,6 +2972,7 @@ static struct rp_cmd_args {
     [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
     [MIG_RP_MSG_RECV_BITMAP]    = { .len = -1, .name = "RECV_BITMAP" },
     [MIG_RP_MSG_RESUME_ACK]     = { .len =  4, .name = "RESUME_ACK" },
+    [MIG_RP_MSG_SWITCHOVER_TIME] = { .len = 8, .name = "SWITCHOVER_TIME" },
     [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
 };
 
@@ -2863,6 +3195,12 @@ retry:
             }
             break;
 
+        case MIG_RP_MSG_SWITCHOVER_TIME:
+            ms->downtime_actual.destination = ldq_be_p(buf);
+            trace_source_return_path_thread_switchover_time(
+                ms->downtime_actual.destination);
+            break;
+
         default:
             break;
         }
@@ -3173,10 +3511,13 @@ static void migration_completion(MigrationState *s)
 {
     int ret;
     int current_active_state = s->state;
+    DowntimeStats *actual = &s->downtime_actual;
+    int64_t start;
 
     if (s->state == MIGRATION_STATUS_ACTIVE) {
         qemu_mutex_lock_iothread();
         s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
         s->vm_was_running = runstate_is_running();
         ret = global_state_store();
@@ -3185,14 +3526,25 @@ static void migration_completion(MigrationState *s)
             bool inactivate = !migrate_colo_enabled();
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
             trace_migration_completion_vm_stop(ret);
+            actual->stop = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
             if (ret >= 0) {
                 ret = migration_maybe_pause(s, &current_active_state,
                                             MIGRATION_STATUS_DEVICE);
             }
             if (ret >= 0) {
                 qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+                /* Set by the return path thread, if the destination can */
+                actual->destination = 0;
+                start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
                 ret = qemu_savevm_state_complete_precopy(s->to_dst_file, false,
                                                          inactivate);
+                /* The final bitmap sync and device state are measured inside */
+                actual->dirty_sync = ram_counters.dirty_sync_time;
+                actual->transfer = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   start;
+                actual->transfer -= MIN(actual->transfer,
+                                        actual->dirty_sync +
+                                        actual->device_state);
             }
             if (inactivate && ret >= 0) {
                 s->block_inactive = true;
@@ -3236,6 +3588,15 @@ static void migration_completion(MigrationState *s)
         goto fail_invalidate;
     }
 
+    if (current_active_state != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        downtime_stats_sum(actual);
+        trace_migration_completion_downtime(actual->total, actual->stop,
+                                            actual->transfer,
+                                            actual->dirty_sync,
+                                            actual->device_state,
+                                            actual->destination);
+    }
+
     if (migrate_colo_enabled() && s->state == MIGRATION_STATUS_ACTIVE) {
         /* COLO does not support postcopy */
         migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
@@ -3404,6 +3765,11 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /* The preempt channel is useless too; it's closed on cleanup */
+        if (s->postcopy_qemufile_src) {
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+        }
+
         migrate_set_state(&s->state, s->state,
                           MIGRATION_STATUS_POSTCOPY_PAUSED);
 
@@ -3461,6 +3827,9 @@ static MigThrError migration_detect_error(MigrationState *s)
 
     /* Try to detect any file errors */
     ret = qemu_file_get_error_obj(s->to_dst_file, &local_error);
+    if (!ret && s->postcopy_qemufile_src) {
+        ret = qemu_file_get_error_obj(s->postcopy_qemufile_src, &local_error);
+    }
     if (!ret) {
         /* Everything is fine */
         assert(!local_error);
@@ -3495,7 +3864,13 @@ static MigThrError migration_detect_error(MigrationState *s)
 /* How many bytes have we transferred since the beginning of the migration */
 static uint64_t migration_total_bytes(MigrationState *s)
 {
-    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes;
+    uint64_t bytes = qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes +
+                     ram_counters.mapped_ram_bytes;
+
+    if (s->postcopy_qemufile_src) {
+        bytes += qemu_ftell(s->postcopy_qemufile_src);
+    }
+    return bytes;
 }
 
 static void migration_calculate_complete(MigrationState *s)
@@ -3546,6 +3921,7 @@ static void migration_update_counters(MigrationState *s,
     time_spent = current_time - s->iteration_start_time;
     bandwidth = (double)transferred / time_spent;
     s->threshold_size = bandwidth * s->parameters.downtime_limit;
+    s->bandwidth = bandwidth;
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -3571,6 +3947,52 @@ static void migration_update_counters(MigrationState *s,
                               bandwidth, s->threshold_size);
 }
 
+static void downtime_stats_sum(DowntimeStats *d)
+{
+    d->total = d->stop + d->transfer + d->dirty_sync + d->device_state +
+               d->destination;
+}
+
+/*
+ * Whether the remaining @pending bytes are small enough to switch over.
+ * With switchover-predict, a precopy switchover must fit the whole predicted
+ * downtime in downtime-limit: the components that can only be measured
+ * during a switchover are taken from the last one.
+ */
+static bool migration_can_switchover(MigrationState *s, uint64_t pending,
+                                     bool in_postcopy)
+{
+    DowntimeStats *p = &s->downtime_predicted;
+    DowntimeStats *last = &s->downtime_actual;
+    double transfer;
+
+    if (!pending) {
+        return true;
+    }
+    if (in_postcopy || !migrate_switchover_predict()) {
+        return pending < s->threshold_size;
+    }
+    if (!s->bandwidth) {
+        /* Nothing measured yet */
+        return false;
+    }
+
+    transfer = pending / s->bandwidth * 1000;
+    p->stop = last->stop;
+    p->transfer = transfer < INT64_MAX ? transfer : INT64_MAX;
+    p->dirty_sync = ram_counters.dirty_sync_time;
+    p->device_state = last->device_state;
+    p->destination = last->destination;
+    downtime_stats_sum(p);
+    s->expected_downtime = p->total / 1000;
+
+    trace_migration_switchover_predict(p->total, p->stop, p->transfer,
+                                       p->dirty_sync, p->device_state,
+                                       p->destination);
+
+    return p->total <= s->parameters.downtime_limit * 1000;
+}
+
 /* Migration thread iteration status */
 typedef enum {
     MIG_ITERATE_RESUME,         /* Resume current iteration */
@@ -3594,7 +4016,7 @@ static MigIterateState migration_iteration_run(MigrationState *s)
     trace_migrate_pending(pending_size, s->threshold_size,
                           pend_pre, pend_compat, pend_post);
 
-    if (pending_size && pending_size >= s->threshold_size) {
+    if (!migration_can_switchover(s, pending_size, in_postcopy)) {
         /* Still a significant amount to transfer */
         if (!in_postcopy && pend_pre <= s->threshold_size &&
             qatomic_read(&s->start_postcopy)) {
@@ -3796,6 +4218,16 @@ static void *migration_thread(void *opaque)
     object_ref(OBJECT(s));
     update_iteration_initial_status(s);
 
+    /*
+     * The destination won't start loading until it got all the channels,
+     * so make sure the preempt one is there before sending anything.
+     */
+    if (postcopy_preempt_wait_channel(s)) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        goto out;
+    }
+
     qemu_savevm_state_header(s->to_dst_file);
 
     /*
@@ -3863,6 +4295,7 @@ static void *migration_thread(void *opaque)
         urgent = migration_rate_limit();
     }
 
+out:
     trace_migration_thread_after_loop();
     migration_iteration_finish(s);
     object_unref(OBJECT(s));
@@ -4113,6 +4546,14 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    if (postcopy_preempt_setup(s, &local_err)) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     if (migrate_background_snapshot()) {
         qemu_thread_create(&s->thread, "bg_snapshot",
                 bg_migration_thread, s, QEMU_THREAD_JOINABLE);
@@ -4200,6 +4641,15 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
                       parameters.multifd_zstd_level,
                       DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT8("postcopy-place-threads", MigrationState,
+                      parameters.postcopy_place_threads,
+                      DEFAULT_MIGRATE_POSTCOPY_PLACE_THREADS),
+    DEFINE_PROP_UINT8("device-state-threads", MigrationState,
+                      parameters.device_state_threads,
+                      DEFAULT_MIGRATE_DEVICE_STATE_THREADS),
+    DEFINE_PROP_UINT8("dirty-sync-threads", MigrationState,
+                      parameters.dirty_sync_threads,
+                      DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -4237,6 +4687,13 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram-lazy",
+            MIGRATION_CAPABILITY_MAPPED_RAM_LAZY),
+    DEFINE_PROP_MIG_CAP("x-switchover-predict",
+            MIGRATION_CAPABILITY_SWITCHOVER_PREDICT),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -4258,11 +4715,13 @@ static void migration_instance_finalize(Object *obj)
     qemu_mutex_destroy(&ms->qemu_file_lock);
     g_free(params->tls_hostname);
     g_free(params->tls_creds);
+    qapi_free_DeviceStateTimeList(ms->device_state_times);
     qemu_sem_destroy(&ms->wait_unplug_sem);
     qemu_sem_destroy(&ms->rate_limit_sem);
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     error_free(ms->error);
 }
@@ -4304,9 +4763,13 @@ static void migration_instance_init(Object *obj)
     params->has_announce_max = true;
     params->has_announce_rounds = true;
     params->has_announce_step = true;
+    params->has_postcopy_place_threads = true;
+    params->has_device_state_threads = true;
+    params->has_dirty_sync_threads = true;
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
@@ -25,6 +25,7 @@
 #include "qom/object.h"
 
 struct PostcopyBlocktimeContext;
+typedef struct DeviceStatePool DeviceStatePool;
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
 
@@ -45,6 +46,22 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/* Postcopy preempt channels */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
+/*
+ * Postcopy page request latencies are accounted in a histogram of
+ * power-of-two bins; the first bin covers everything below
+ * 1 << POSTCOPY_LATENCY_SHIFT_MIN microseconds and the last one
+ * everything that took longer than the biggest boundary.
+ */
+#define POSTCOPY_LATENCY_SHIFT_MIN        4
+#define POSTCOPY_LATENCY_BINS             18
+
 /* This is an abstraction of a "temp huge page" for postcopy's purpose */
 typedef struct {
     /*
@@ -63,11 +80,24 @@ typedef struct {
     bool all_zero;
 } PostcopyTmpPage;
 
+/* A host page handed over to the postcopy placement threads */
+typedef struct PostcopyPlaceJob {
+    /*
+     * Temporary huge page owned by this job.  It's swapped with the one of
+     * the PostcopyTmpPage that assembled the page being queued.
+     */
+    void *buffer;
+    void *host_addr;
+    RAMBlock *rb;
+    bool all_zero;
+    QSIMPLEQ_ENTRY(PostcopyPlaceJob) next;
+} PostcopyPlaceJob;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
-    /* Previously received RAM's RAMBlock pointer */
-    RAMBlock *last_recv_block;
+    /* Previously received RAM's RAMBlock pointer, one for each channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
     /* A hook to allow cleanup at the end of incoming migration */
     void *transport_data;
     void (*transport_cleanup)(void *data);
@@ -121,6 +151,35 @@ struct MigrationIncomingState {
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
+    /*
+     * When postcopy-preempt is enabled, urgent pages requested by the fault
+     * thread are received on this separate channel by postcopy_prio_thread.
+     */
+    QEMUFile *postcopy_qemufile_dst;
+    QemuThread postcopy_prio_thread;
+    bool postcopy_prio_thread_created;
+    /*
+     * Threads placing the host pages loaded from the main channel
+     * (postcopy-place-threads), so that UFFDIO_COPY of one page overlaps
+     * with receiving the next ones.  The number of jobs bounds the pages
+     * in flight.
+     */
+    QemuThread *postcopy_place_threads;
+    int postcopy_place_threads_num;
+    PostcopyPlaceJob *postcopy_place_jobs;
+    int postcopy_place_jobs_num;
+    QemuMutex postcopy_place_mutex;
+    /* Signalled when a job is queued, or the threads should quit */
+    QemuCond postcopy_place_cond;
+    /* Signalled when a job went back to the free list */
+    QemuCond postcopy_place_free_cond;
+    QSIMPLEQ_HEAD(, PostcopyPlaceJob) postcopy_place_pending;
+    QSIMPLEQ_HEAD(, PostcopyPlaceJob) postcopy_place_free;
+    /* Number of jobs queued or being placed */
+    int postcopy_place_busy;
+    bool postcopy_place_quit;
+    /* First error hit by a placement thread */
+    int postcopy_place_error;
 
     QEMUBH *bh;
 
@@ -162,6 +221,22 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+
+    /*
+     * Latency of page requests, from the request being sent to the source
+     * until the page got placed.  Protected by page_request_mutex.
+     */
+    uint64_t page_request_latency_bins[POSTCOPY_LATENCY_BINS];
+    uint64_t page_request_latency_count;
+    uint64_t page_request_latency_total;
+    uint64_t page_request_latency_max;
+
+    /* Threads loading device-state-threads sections, created on demand */
+    DeviceStatePool *device_state_pool;
+    /* Time spent loading each device, slowest first */
+    DeviceStateTimeList *device_state_times;
+    /* Time the migration stream was fully read, in microseconds */
+    int64_t stream_end_us;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -222,6 +297,8 @@ struct MigrationState {
      * measured bandwidth
      */
     int64_t threshold_size;
+    /* Bandwidth measured during the last iteration, in bytes per ms */
+    double bandwidth;
 
     /* params from 'migrate-set-parameters' */
     MigrationParameters parameters;
@@ -255,6 +332,17 @@ struct MigrationState {
     int64_t expected_downtime;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
+    /* Time spent saving each device during downtime, slowest first */
+    DeviceStateTimeList *device_state_times;
+    /*
+     * Downtime components predicted by switchover-predict at the last
+     * iteration, and measured during the last switchover.  The measured
+     * components are kept across migrations, as the ones only known after
+     * a switchover are predicted from them; total is reset when a
+     * migration starts.
+     */
+    DowntimeStats downtime_predicted;
+    DowntimeStats downtime_actual;
     /*
      * Whether guest was running when we enter the completion stage.
      * If migration is interrupted by any reason, we need to continue
@@ -267,6 +355,14 @@ struct MigrationState {
     /* Flag set after postcopy has sent the device state */
     bool postcopy_after_devices;
 
+    /*
+     * The channel urgent postcopy pages are sent on when postcopy-preempt
+     * is enabled; only touched by the migration thread once established.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the connection of postcopy_qemufile_src finished */
+    QemuSemaphore postcopy_qemufile_src_sem;
+
     /* Flag set once the migration thread is running (and needs joining) */
     bool migration_thread_running;
 
@@ -360,6 +456,10 @@ bool migration_in_postcopy(void);
 MigrationState *migrate_get_current(void);
 
 bool migrate_postcopy(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_mapped_ram(void);
+bool migrate_mapped_ram_lazy(void);
+bool migrate_switchover_predict(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
@@ -375,6 +475,9 @@ int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+int migrate_postcopy_place_threads(void);
+int migrate_device_state_threads(void);
+int migrate_dirty_sync_threads(void);
 
 int migrate_use_xbzrle(void);
 uint64_t migrate_xbzrle_cache_size(void);
@@ -385,6 +488,9 @@ bool migrate_use_block_incremental(void);
 int migrate_max_cpu_throttle(void);
 bool migrate_use_return_path(void);
 
+bool migrate_multi_channels_is_allowed(void);
+void migrate_protocol_allow_multi_channels(bool allow);
+
 uint64_t ram_get_total_transferred_pages(void);
 
 bool migrate_use_compression(void);
@@ -408,6 +514,8 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_switchover_time(MigrationIncomingState *mis,
+                                     uint64_t value);
 
 void dirty_bitmap_mig_before_vm_start(void);
 void dirty_bitmap_mig_cancel_outgoing(void);
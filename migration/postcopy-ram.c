@@ -33,6 +33,10 @@
 #include "trace.h"
 #include "hw/boards.h"
 #include "exec/ramblock.h"
+#include "qemu/host-utils.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
+#include "yank_functions.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -538,6 +542,211 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
     return 0;
 }
 
+/* Number of host pages that can be in flight for each placement thread */
+#define POSTCOPY_PLACE_JOBS_PER_THREAD 2
+
+static void *postcopy_place_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    PostcopyPlaceJob *job;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    qemu_sem_post(&mis->thread_sync_sem);
+
+    qemu_mutex_lock(&mis->postcopy_place_mutex);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&mis->postcopy_place_pending);
+        if (!job) {
+            /* Only quit once everything queued has been placed */
+            if (mis->postcopy_place_quit) {
+                break;
+            }
+            qemu_cond_wait(&mis->postcopy_place_cond,
+                           &mis->postcopy_place_mutex);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&mis->postcopy_place_pending, next);
+        qemu_mutex_unlock(&mis->postcopy_place_mutex);
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            if (job->all_zero) {
+                ret = postcopy_place_page_zero(mis, job->host_addr, job->rb);
+            } else {
+                ret = postcopy_place_page(mis, job->host_addr, job->buffer,
+                                          job->rb);
+            }
+        }
+
+        qemu_mutex_lock(&mis->postcopy_place_mutex);
+        if (ret && !mis->postcopy_place_error) {
+            mis->postcopy_place_error = ret;
+        }
+        QSIMPLEQ_INSERT_TAIL(&mis->postcopy_place_free, job, next);
+        mis->postcopy_place_busy--;
+        qemu_cond_broadcast(&mis->postcopy_place_free_cond);
+    }
+    qemu_mutex_unlock(&mis->postcopy_place_mutex);
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static int postcopy_place_threads_setup(MigrationIncomingState *mis)
+{
+    int nthreads = migrate_postcopy_place_threads();
+    int i, err;
+
+    if (!nthreads) {
+        return 0;
+    }
+
+    qemu_mutex_init(&mis->postcopy_place_mutex);
+    qemu_cond_init(&mis->postcopy_place_cond);
+    qemu_cond_init(&mis->postcopy_place_free_cond);
+    QSIMPLEQ_INIT(&mis->postcopy_place_pending);
+    QSIMPLEQ_INIT(&mis->postcopy_place_free);
+    mis->postcopy_place_busy = 0;
+    mis->postcopy_place_quit = false;
+    mis->postcopy_place_error = 0;
+
+    mis->postcopy_place_jobs_num = nthreads * POSTCOPY_PLACE_JOBS_PER_THREAD;
+    mis->postcopy_place_jobs = g_new0(PostcopyPlaceJob,
+                                      mis->postcopy_place_jobs_num);
+    for (i = 0; i < mis->postcopy_place_jobs_num; i++) {
+        PostcopyPlaceJob *job = &mis->postcopy_place_jobs[i];
+        void *buffer = mmap(NULL, mis->largest_page_size,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (buffer == MAP_FAILED) {
+            err = errno;
+            error_report("%s: Failed to map postcopy_place_jobs[%d]: %s",
+                         __func__, i, strerror(err));
+            /* Clean up will be done later */
+            return -err;
+        }
+        job->buffer = buffer;
+        QSIMPLEQ_INSERT_TAIL(&mis->postcopy_place_free, job, next);
+    }
+
+    mis->postcopy_place_threads = g_new0(QemuThread, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        postcopy_thread_create(mis, &mis->postcopy_place_threads[i],
+                               "postcopy/place", postcopy_place_thread,
+                               QEMU_THREAD_JOINABLE);
+        mis->postcopy_place_threads_num++;
+    }
+
+    trace_postcopy_place_threads_setup(nthreads, mis->postcopy_place_jobs_num);
+
+    return 0;
+}
+
+/* Placement threads flush all the queued pages before quitting */
+static void postcopy_place_threads_cleanup(MigrationIncomingState *mis)
+{
+    int i;
+
+    if (!mis->postcopy_place_jobs) {
+        return;
+    }
+
+    qemu_mutex_lock(&mis->postcopy_place_mutex);
+    mis->postcopy_place_quit = true;
+    qemu_cond_broadcast(&mis->postcopy_place_cond);
+    qemu_mutex_unlock(&mis->postcopy_place_mutex);
+
+    for (i = 0; i < mis->postcopy_place_threads_num; i++) {
+        qemu_thread_join(&mis->postcopy_place_threads[i]);
+    }
+    g_free(mis->postcopy_place_threads);
+    mis->postcopy_place_threads = NULL;
+    mis->postcopy_place_threads_num = 0;
+
+    if (mis->postcopy_place_error) {
+        error_report("%s: placing postcopy pages failed: %s", __func__,
+                     strerror(-mis->postcopy_place_error));
+    }
+
+    for (i = 0; i < mis->postcopy_place_jobs_num; i++) {
+        if (mis->postcopy_place_jobs[i].buffer) {
+            munmap(mis->postcopy_place_jobs[i].buffer, mis->largest_page_size);
+        }
+    }
+    g_free(mis->postcopy_place_jobs);
+    mis->postcopy_place_jobs = NULL;
+    mis->postcopy_place_jobs_num = 0;
+
+    qemu_cond_destroy(&mis->postcopy_place_free_cond);
+    qemu_cond_destroy(&mis->postcopy_place_cond);
+    qemu_mutex_destroy(&mis->postcopy_place_mutex);
+}
+
+/*
+ * Hand the host page assembled in @tmp_page over to the placement threads.
+ * @tmp_page gets the buffer of a free job in exchange, to assemble the next
+ * page into; waits for one if all of them are in flight.
+ *
+ * Returns 0 on success, or the first error hit by a placement thread.
+ */
+int postcopy_place_page_async(MigrationIncomingState *mis,
+                              PostcopyTmpPage *tmp_page, RAMBlock *rb)
+{
+    PostcopyPlaceJob *job;
+    void *buffer;
+    int ret;
+
+    qemu_mutex_lock(&mis->postcopy_place_mutex);
+    while (!(job = QSIMPLEQ_FIRST(&mis->postcopy_place_free)) &&
+           !mis->postcopy_place_error) {
+        qemu_cond_wait(&mis->postcopy_place_free_cond,
+                       &mis->postcopy_place_mutex);
+    }
+
+    ret = mis->postcopy_place_error;
+    if (!ret) {
+        QSIMPLEQ_REMOVE_HEAD(&mis->postcopy_place_free, next);
+        job->host_addr = tmp_page->host_addr;
+        job->rb = rb;
+        job->all_zero = tmp_page->all_zero;
+        if (!job->all_zero) {
+            buffer = job->buffer;
+            job->buffer = tmp_page->tmp_huge_page;
+            tmp_page->tmp_huge_page = buffer;
+        }
+        mis->postcopy_place_busy++;
+        QSIMPLEQ_INSERT_TAIL(&mis->postcopy_place_pending, job, next);
+        qemu_cond_signal(&mis->postcopy_place_cond);
+    }
+    qemu_mutex_unlock(&mis->postcopy_place_mutex);
+
+    return ret;
+}
+
+/*
+ * Wait until all the pages handed over to the placement threads have been
+ * placed.
+ *
+ * Returns 0 on success, or the first error hit by a placement thread.
+ */
+int postcopy_place_threads_drain(MigrationIncomingState *mis)
+{
+    int ret;
+
+    qemu_mutex_lock(&mis->postcopy_place_mutex);
+    while (mis->postcopy_place_busy) {
+        qemu_cond_wait(&mis->postcopy_place_free_cond,
+                       &mis->postcopy_place_mutex);
+    }
+    ret = mis->postcopy_place_error;
+    qemu_mutex_unlock(&mis->postcopy_place_mutex);
+
+    return ret;
+}
+
 static void postcopy_temp_pages_cleanup(MigrationIncomingState *mis)
 {
     int i;
@@ -567,6 +776,21 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->postcopy_prio_thread_created) {
+        /*
+         * The source terminates the preempt channel after the last urgent
+         * page, so the thread normally quits by itself.  Kick it out if
+         * the main channel failed, as no terminator will come then.
+         */
+        if (mis->from_src_file && qemu_file_get_error(mis->from_src_file)) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->postcopy_prio_thread);
+        mis->postcopy_prio_thread_created = false;
+    }
+
+    postcopy_place_threads_cleanup(mis);
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -1096,14 +1320,42 @@ retry:
     return NULL;
 }
 
+/*
+ * Loads the urgent pages sent by the source on the postcopy preempt channel,
+ * so that they are not queued up behind the background precopy stream.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+
+    rcu_register_thread();
+
+    qemu_sem_post(&mis->thread_sync_sem);
+
+    ret = ram_load_postcopy_preempt(mis->postcopy_qemufile_dst);
+    if (ret) {
+        error_report("%s: loading urgent pages failed: %s", __func__,
+                     strerror(-ret));
+    }
+
+    rcu_unregister_thread();
+
+    trace_postcopy_preempt_thread_exit(ret);
+
+    return NULL;
+}
+
 static int postcopy_temp_pages_setup(MigrationIncomingState *mis)
 {
     PostcopyTmpPage *tmp_page;
     int err, i, channels;
     void *temp_page;
 
-    /* TODO: will be boosted when enable postcopy preemption */
-    mis->postcopy_channels = 1;
+    /* One temporary page per loading channel */
+    mis->postcopy_channels = migrate_postcopy_preempt() ? RAM_CHANNEL_MAX : 1;
 
     channels = mis->postcopy_channels;
     mis->postcopy_tmp_pages = g_malloc0_n(sizeof(PostcopyTmpPage), channels);
@@ -1185,11 +1437,55 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
+    if (postcopy_place_threads_setup(mis)) {
+        /* Error dumped in the sub-function */
+        return -1;
+    }
+
+    if (migrate_postcopy_preempt()) {
+        if (!mis->postcopy_qemufile_dst) {
+            error_report("%s: postcopy preempt channel not established",
+                         __func__);
+            return -1;
+        }
+        /* The thread loading urgent pages uses postcopy_tmp_pages[1] */
+        postcopy_thread_create(mis, &mis->postcopy_prio_thread,
+                               "postcopy/preempt", postcopy_preempt_thread,
+                               QEMU_THREAD_JOINABLE);
+        mis->postcopy_prio_thread_created = true;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
 }
 
+/*
+ * Account the time between sending a page request to the source and the
+ * page being placed.  Called with page_request_mutex held.
+ */
+static void postcopy_account_request_latency(MigrationIncomingState *mis,
+                                             uintptr_t stamp)
+{
+    uintptr_t latency = (uintptr_t)qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                        stamp;
+    int bin;
+
+    /* The stamp has its lowest bit set, so it can be 1us in the future */
+    if ((intptr_t)latency < 0) {
+        latency = 0;
+    }
+
+    bin = 64 - clz64(latency) - POSTCOPY_LATENCY_SHIFT_MIN;
+    bin = MIN(MAX(bin, 0), POSTCOPY_LATENCY_BINS - 1);
+
+    mis->page_request_latency_bins[bin]++;
+    mis->page_request_latency_count++;
+    mis->page_request_latency_total += latency;
+    mis->page_request_latency_max = MAX(mis->page_request_latency_max,
+                                        latency);
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
@@ -1211,6 +1507,8 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
         ret = ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
     }
     if (!ret) {
+        uintptr_t stamp;
+
         qemu_mutex_lock(&mis->page_request_mutex);
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
@@ -1218,7 +1516,9 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
          * If this page resolves a page fault for a previous recorded faulted
          * address, take a special note to maintain the requested page list.
          */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
+        stamp = (uintptr_t)g_tree_lookup(mis->page_requested, host_addr);
+        if (stamp) {
+            postcopy_account_request_latency(mis, stamp);
             g_tree_remove(mis->page_requested, host_addr);
             mis->page_requested_count--;
             trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
@@ -1358,6 +1658,19 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
+int postcopy_place_page_async(MigrationIncomingState *mis,
+                              PostcopyTmpPage *tmp_page, RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_threads_drain(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
 int postcopy_wake_shared(struct PostCopyFD *pcfd,
                          uint64_t client_addr,
                          RAMBlock *rb)
@@ -1394,6 +1707,84 @@ void postcopy_fault_thread_notify(MigrationIncomingState *mis)
     }
 }
 
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+    } else {
+        migration_ioc_register_yank(ioc);
+        s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+        trace_postcopy_preempt_new_channel();
+    }
+
+    /*
+     * Post the semaphore even on failure, the migration thread is waiting
+     * for the result.
+     */
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+    object_unref(OBJECT(ioc));
+}
+
+/*
+ * Start connecting the postcopy preempt channel on the source.  The
+ * migration thread waits for it in postcopy_preempt_wait_channel().
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (!migrate_multi_channels_is_allowed()) {
+        error_setg(errp, "Postcopy preempt is not supported as current "
+                   "migration stream does not support multi-channels");
+        return -1;
+    }
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt does not support TLS yet");
+        return -1;
+    }
+
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+
+    return 0;
+}
+
+/*
+ * Returns 0 if the postcopy preempt channel is not needed or has been
+ * established, -1 if it failed to connect.
+ */
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+
+    return s->postcopy_qemufile_src ? 0 : -1;
+}
+
+/*
+ * Called on the destination when the postcopy preempt channel got
+ * connected; returns true since the incoming migration can start.
+ */
+bool postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    /* The channel is read by its own thread, so make it blocking */
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    trace_postcopy_preempt_new_channel();
+
+    return true;
+}
+
 /**
  * postcopy_discard_send_init: Called at the start of each RAMBlock before
  *   asking to discard individual ranges.
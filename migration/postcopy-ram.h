@@ -78,6 +78,15 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
 int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                              RAMBlock *rb);
 
+/*
+ * Queue the host page assembled in tmp_page for placement by the
+ * postcopy-place-threads, and wait for the queued ones to be placed.
+ * returns 0 on success
+ */
+int postcopy_place_page_async(MigrationIncomingState *mis,
+                              PostcopyTmpPage *tmp_page, RAMBlock *rb);
+int postcopy_place_threads_drain(MigrationIncomingState *mis);
+
 /* The current postcopy state is read/set by postcopy_state_get/set
  * which update it atomically.
  * The state is updated as postcopy messages are received, and
@@ -183,4 +192,9 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Postcopy preempt: urgent pages are sent on a separate channel */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+int postcopy_preempt_wait_channel(MigrationState *s);
+bool postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+
 #endif
@@ -867,3 +867,68 @@ QIOChannel *qemu_file_get_ioc(QEMUFile *file)
 {
     return file->has_ioc ? QIO_CHANNEL(file->opaque) : NULL;
 }
+
+/*
+ * Return the offset in the channel backing @f of the next byte that will
+ * be read or written through @f.  Only channels that can seek, like files,
+ * support this.
+ *
+ * Returns the offset, or -1 on error with the error state of @f set.
+ */
+off_t qemu_file_get_offset(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_error = NULL;
+    off_t offset;
+
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -1;
+    }
+
+    qemu_fflush(f);
+    offset = qio_channel_io_seek(ioc, 0, SEEK_CUR, &local_error);
+    if (offset < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return -1;
+    }
+
+    if (!qemu_file_is_writable(f)) {
+        /* Data read ahead into the buffer hasn't been consumed yet */
+        offset -= f->buf_size - f->buf_index;
+    }
+
+    return offset;
+}
+
+/*
+ * Move @f to @offset of its backing channel; the next byte read or written
+ * through @f will be the one at @offset.  Pending writes are flushed first,
+ * data read ahead is dropped.
+ *
+ * Returns 0 on success, or a negative errno with the error state of @f set.
+ */
+int qemu_file_set_offset(QEMUFile *f, off_t offset)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_error = NULL;
+
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    if (qio_channel_io_seek(ioc, offset, SEEK_SET, &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return -EIO;
+    }
+
+    return 0;
+}
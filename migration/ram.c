@@ -28,6 +28,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
@@ -55,6 +56,7 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "mapped-ram.h"
 #include "sysemu/runstate.h"
 
 #include "hw/boards.h" /* for machine_dump_guest_core() */
@@ -305,6 +307,15 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /*
+     * Channel currently used for sending pages (RAM_CHANNEL_*).  With
+     * postcopy-preempt, f and last_sent_block are swapped with the idle
+     * channel's ones on each switch so that RAM_SAVE_FLAG_CONTINUE is
+     * tracked per channel.
+     */
+    unsigned int postcopy_channel;
+    QEMUFile *postcopy_idle_f;
+    RAMBlock *postcopy_idle_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -349,6 +360,8 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* Threads helping with the dirty bitmap sync, NULL without them */
+    struct DirtySyncPool *dirty_sync_pool;
 };
 typedef struct RAMState RAMState;
 
@@ -1003,6 +1016,200 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * With dirty-sync-threads, RAMBlocks are split into ranges of this many
+ * target pages that are synced by different threads.  Since it's a multiple
+ * of BITS_PER_LONG, two ranges never share a word of the RAMBlock bitmap and
+ * cpu_physical_memory_sync_dirty_bitmap() can keep its fast path.
+ */
+#define DIRTY_SYNC_CHUNK_PAGES (256 * 1024)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} DirtySyncRange;
+
+typedef struct DirtySyncPool {
+    QemuThread *threads;
+    int threads_num;
+    QemuMutex mutex;
+    /* Signalled when a new sync starts or when the threads should quit */
+    QemuCond cond;
+    /* Signalled when ranges are done or threads go idle */
+    QemuCond done_cond;
+    /* Ranges of the current sync, only modified with no thread running */
+    GArray *ranges;
+    /* Index of the next range to sync, atomically incremented */
+    unsigned int next;
+    /* Number of ranges synced so far */
+    unsigned int done;
+    /* Number of threads looking at ranges */
+    unsigned int running;
+    /* Incremented each time a sync starts */
+    unsigned int generation;
+    /* Pages newly dirtied in the ranges synced so far */
+    uint64_t dirty_pages;
+    bool quit;
+} DirtySyncPool;
+
+/* Called with RCU critical section */
+static void dirty_sync_pool_run(DirtySyncPool *pool)
+{
+    uint64_t dirty_pages = 0;
+    unsigned int done = 0;
+    unsigned int i;
+
+    while ((i = qatomic_fetch_inc(&pool->next)) < pool->ranges->len) {
+        DirtySyncRange *r = &g_array_index(pool->ranges, DirtySyncRange, i);
+
+        dirty_pages += cpu_physical_memory_sync_dirty_bitmap(r->block,
+                                                             r->start,
+                                                             r->length);
+        done++;
+    }
+
+    if (done) {
+        qemu_mutex_lock(&pool->mutex);
+        pool->dirty_pages += dirty_pages;
+        pool->done += done;
+        if (pool->done == pool->ranges->len) {
+            qemu_cond_broadcast(&pool->done_cond);
+        }
+        qemu_mutex_unlock(&pool->mutex);
+    }
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    DirtySyncPool *pool = opaque;
+    unsigned int generation = 0;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&pool->mutex);
+    while (true) {
+        while (!pool->quit && pool->generation == generation) {
+            qemu_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->quit) {
+            break;
+        }
+        generation = pool->generation;
+        pool->running++;
+        qemu_mutex_unlock(&pool->mutex);
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            dirty_sync_pool_run(pool);
+        }
+
+        qemu_mutex_lock(&pool->mutex);
+        if (!--pool->running) {
+            qemu_cond_broadcast(&pool->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&pool->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static DirtySyncPool *dirty_sync_pool_new(int threads_num)
+{
+    DirtySyncPool *pool = g_new0(DirtySyncPool, 1);
+    int i;
+
+    qemu_mutex_init(&pool->mutex);
+    qemu_cond_init(&pool->cond);
+    qemu_cond_init(&pool->done_cond);
+    pool->ranges = g_array_new(false, false, sizeof(DirtySyncRange));
+    pool->threads_num = threads_num;
+    pool->threads = g_new0(QemuThread, threads_num);
+    for (i = 0; i < threads_num; i++) {
+        qemu_thread_create(pool->threads + i, "dirty-sync",
+                           dirty_sync_thread, pool, QEMU_THREAD_JOINABLE);
+    }
+
+    return pool;
+}
+
+static void dirty_sync_pool_free(DirtySyncPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    qemu_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->cond);
+    qemu_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->threads_num; i++) {
+        qemu_thread_join(pool->threads + i);
+    }
+
+    g_free(pool->threads);
+    g_array_free(pool->ranges, true);
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->cond);
+    qemu_mutex_destroy(&pool->mutex);
+    g_free(pool);
+}
+
+/*
+ * Sync the dirty bitmap of all RAMBlocks, with the migration thread and the
+ * dirty-sync-threads threads each taking ranges until none are left.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ */
+static void dirty_sync_pool_sync(RAMState *rs, DirtySyncPool *pool)
+{
+    const ram_addr_t chunk = (ram_addr_t)DIRTY_SYNC_CHUNK_PAGES <<
+                             TARGET_PAGE_BITS;
+    RAMBlock *block;
+
+    QEMU_BUILD_BUG_ON(DIRTY_SYNC_CHUNK_PAGES % BITS_PER_LONG);
+
+    qemu_mutex_lock(&pool->mutex);
+    /* Threads still catching up with the previous sync must not see this */
+    while (pool->running) {
+        qemu_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+
+    g_array_set_size(pool->ranges, 0);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length; start += chunk) {
+            DirtySyncRange r = {
+                .block = block,
+                .start = start,
+                .length = MIN(chunk, block->used_length - start),
+            };
+
+            g_array_append_val(pool->ranges, r);
+        }
+    }
+    pool->next = 0;
+    pool->done = 0;
+    pool->dirty_pages = 0;
+    pool->generation++;
+    qemu_cond_broadcast(&pool->cond);
+    qemu_mutex_unlock(&pool->mutex);
+
+    dirty_sync_pool_run(pool);
+
+    qemu_mutex_lock(&pool->mutex);
+    while (pool->done < pool->ranges->len) {
+        qemu_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    rs->migration_dirty_pages += pool->dirty_pages;
+    rs->num_dirty_pages_period += pool->dirty_pages;
+    qemu_mutex_unlock(&pool->mutex);
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1114,6 +1321,7 @@ static void migration_trigger_throttle(RAMState *rs)
 static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
+    int64_t start_us, sync_us;
     int64_t end_time;
 
     ram_counters.dirty_sync_count++;
@@ -1123,19 +1331,28 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
+        if (rs->dirty_sync_pool) {
+            dirty_sync_pool_sync(rs, rs->dirty_sync_pool);
+        } else {
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                ramblock_sync_dirty_bitmap(rs, block);
+            }
         }
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
     memory_global_after_dirty_log_sync();
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    sync_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us;
+    ram_counters.dirty_sync_time = sync_us;
+    ram_counters.dirty_sync_time_max = MAX(ram_counters.dirty_sync_time_max,
+                                           sync_us);
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period, sync_us);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -2125,6 +2342,48 @@ static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return false;
 }
 
+/**
+ * ram_save_mapped_page: save a page at its slot of the migration file
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * With mapped-ram, the page doesn't go through the stream: it is queued to
+ * be written at its fixed offset of the file, and its bit in the file bitmap
+ * records whether the slot holds data.  Zero pages are skipped, unless their
+ * slot was already written: the slot of a page is always zero or up to date,
+ * so that the file can be mapped as guest memory.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_mapped_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    int ret;
+
+    if (!test_bit(page, block->file_bmap) &&
+        buffer_is_zero(p, TARGET_PAGE_SIZE)) {
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    ret = mapped_ram_queue(p, TARGET_PAGE_SIZE, block->pages_offset + offset);
+    if (ret) {
+        qemu_file_set_error(rs->f, ret);
+        return ret;
+    }
+    set_bit(page, block->file_bmap);
+
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    ram_counters.mapped_ram_bytes += TARGET_PAGE_SIZE;
+    ram_transferred_add(TARGET_PAGE_SIZE);
+    ram_counters.normal++;
+    return 1;
+}
+
 /**
  * ram_save_target_page: save one target page
  *
@@ -2143,6 +2402,10 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
         return res;
     }
 
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, block, offset);
+    }
+
     if (save_compress_page(rs, block, offset)) {
         return 1;
     }
@@ -2218,7 +2481,8 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
              * Allow rate limiting to happen in the middle of huge pages if
              * something is sent in the current iteration.
              */
-            if (pagesize_bits > 1 && tmppages > 0) {
+            if (pagesize_bits > 1 && tmppages > 0 &&
+                rs->postcopy_channel == RAM_CHANNEL_PRECOPY) {
                 migration_rate_limit();
             }
         }
@@ -2233,6 +2497,44 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
     return (res < 0 ? res : pages);
 }
 
+static bool postcopy_preempt_active(void)
+{
+    return migrate_postcopy_preempt() && migration_in_postcopy();
+}
+
+/*
+ * Switch the channel used by the page senders; a no-op if @channel is
+ * already in use.
+ */
+static void postcopy_preempt_choose_channel(RAMState *rs, unsigned int channel)
+{
+    QEMUFile *f = rs->f;
+    RAMBlock *block = rs->last_sent_block;
+
+    if (channel == rs->postcopy_channel) {
+        return;
+    }
+
+    trace_postcopy_preempt_switch_channel(channel);
+    rs->f = rs->postcopy_idle_f;
+    rs->last_sent_block = rs->postcopy_idle_last_sent_block;
+    rs->postcopy_idle_f = f;
+    rs->postcopy_idle_last_sent_block = block;
+    rs->postcopy_channel = channel;
+}
+
+/*
+ * Terminate a batch of urgent pages on the preempt channel and push it out
+ * right away, so the destination can place them without waiting for more
+ * data.
+ */
+static void postcopy_preempt_flush(RAMState *rs)
+{
+    qemu_put_be64(rs->f, RAM_SAVE_FLAG_EOS);
+    ram_transferred_add(8);
+    qemu_fflush(rs->f);
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2250,7 +2552,7 @@ static int ram_find_and_save_block(RAMState *rs)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -2268,6 +2570,7 @@ static int ram_find_and_save_block(RAMState *rs)
     do {
         again = true;
         found = get_queued_page(rs, &pss);
+        urgent = found && postcopy_preempt_active();
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -2275,7 +2578,16 @@ static int ram_find_and_save_block(RAMState *rs)
         }
 
         if (found) {
+            if (urgent) {
+                postcopy_preempt_choose_channel(rs, RAM_CHANNEL_POSTCOPY);
+            }
             pages = ram_save_host_page(rs, &pss);
+            if (urgent) {
+                if (pages > 0) {
+                    postcopy_preempt_flush(rs);
+                }
+                postcopy_preempt_choose_channel(rs, RAM_CHANNEL_PRECOPY);
+            }
         }
     } while (!pages && again);
 
@@ -2337,6 +2649,7 @@ static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
         migration_page_queue_free(*rsp);
+        dirty_sync_pool_free((*rsp)->dirty_sync_pool);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
@@ -2380,11 +2693,15 @@ static void ram_save_cleanup(void *opaque)
         }
     }
 
+    mapped_ram_cleanup();
+
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2798,6 +3115,11 @@ static int ram_init_all(RAMState **rsp)
         return -1;
     }
 
+    if (migrate_dirty_sync_threads()) {
+        (*rsp)->dirty_sync_pool =
+            dirty_sync_pool_new(migrate_dirty_sync_threads());
+    }
+
     ram_init_bitmaps(*rsp);
 
     return 0;
@@ -2891,6 +3213,49 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
  * granularity of these critical sections.
  */
 
+/* Size in bytes of the file bitmap of @block, as saved in the file */
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+    return ROUND_UP(DIV_ROUND_UP(pages, BITS_PER_BYTE), sizeof(uint64_t));
+}
+
+/**
+ * mapped_ram_setup_ramblock: lay out @block in the migration file
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * Right after the block header in the stream come the offsets of the
+ * block's bitmap and pages in the file.  The bitmap follows them
+ * immediately, the pages start at the next MiB, and the stream resumes
+ * after the last page.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block to lay out
+ */
+static int mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    size_t bitmap_size = mapped_ram_bitmap_size(block);
+    off_t offset;
+
+    block->file_bmap = g_malloc0(bitmap_size);
+
+    offset = qemu_file_get_offset(f);
+    if (offset < 0) {
+        return -1;
+    }
+    /* Skip the two offsets themselves */
+    offset += 2 * sizeof(uint64_t);
+
+    block->bitmap_offset = offset;
+    block->pages_offset = ROUND_UP(offset + bitmap_size, MiB);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    return qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
 /**
  * ram_save_setup: Setup RAM for migration
  *
@@ -2908,14 +3273,29 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         return -1;
     }
 
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+
+        if (mapped_ram_setup(f, true, migrate_background_snapshot(),
+                             &local_err)) {
+            error_report_err(local_err);
+            compress_threads_save_cleanup();
+            return -1;
+        }
+    }
+
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
+            mapped_ram_cleanup();
             compress_threads_save_cleanup();
             return -1;
         }
     }
     (*rsp)->f = f;
+    (*rsp)->postcopy_channel = RAM_CHANNEL_PRECOPY;
+    (*rsp)->postcopy_idle_f = migrate_get_current()->postcopy_qemufile_src;
+    (*rsp)->postcopy_idle_last_sent_block = NULL;
 
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
@@ -2931,6 +3311,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram() && !ramblock_is_ignored(block) &&
+                mapped_ram_setup_ramblock(f, block)) {
+                return qemu_file_get_error(f) ?: -1;
+            }
         }
     }
 
@@ -3044,6 +3428,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
 out:
+    if (ret >= 0 && migrate_mapped_ram()) {
+        ret = mapped_ram_flush();
+        if (ret) {
+            qemu_file_set_error(f, ret);
+        }
+    }
     if (ret >= 0
         && migration_is_setup_or_active(migrate_get_current()->state)) {
         multifd_send_sync_main(rs->f);
@@ -3060,6 +3450,46 @@ out:
     return done;
 }
 
+/**
+ * mapped_ram_save_bitmaps: write the final file bitmaps of all blocks
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * Waits for all pages to be written first, so that the file is complete
+ * when this returns.  Must be called with the RCU read lock held.
+ */
+static int mapped_ram_save_bitmaps(void)
+{
+    RAMBlock *block;
+    int ret;
+
+    ret = mapped_ram_flush();
+    if (ret) {
+        return ret;
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t bitmap_size = mapped_ram_bitmap_size(block);
+        unsigned long *le_bmap = g_malloc0(bitmap_size);
+
+        /*
+         * Stored little endian, like the received bitmap.  No page is saved
+         * anymore, so the converted copy replaces the bitmap until cleanup.
+         */
+        bitmap_to_le(le_bmap, block->file_bmap, pages);
+        g_free(block->file_bmap);
+        block->file_bmap = le_bmap;
+        ret = mapped_ram_queue((uint8_t *)le_bmap, bitmap_size,
+                               block->bitmap_offset);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return mapped_ram_flush();
+}
+
 /**
  * ram_save_complete: function called to send the remaining amount of ram
  *
@@ -3104,9 +3534,26 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         flush_compressed_data(rs);
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+
+        if (ret >= 0 && migrate_mapped_ram()) {
+            ret = mapped_ram_save_bitmaps();
+            if (ret) {
+                qemu_file_set_error(f, ret);
+            }
+        }
     }
 
     if (ret >= 0) {
+        if (postcopy_preempt_active()) {
+            /*
+             * All urgent pages have been flushed; a lone EOS on the
+             * preempt channel tells the destination to stop loading it.
+             */
+            QEMUFile *preempt_f = migrate_get_current()->postcopy_qemufile_src;
+
+            qemu_put_be64(preempt_f, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(preempt_f);
+        }
         multifd_send_sync_main(rs->f);
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
@@ -3188,11 +3635,13 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  * @mis: the migration incoming state pointer
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel we're using (RAM_CHANNEL_*)
  */
 static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
-                                              QEMUFile *f, int flags)
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    RAMBlock *block = mis->last_recv_block;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3219,7 +3668,7 @@ static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
         return NULL;
     }
 
-    mis->last_recv_block = block;
+    mis->last_recv_block[channel] = block;
 
     return block;
 }
@@ -3634,19 +4083,26 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load() for the main channel, and by
+ * ram_load_postcopy_preempt() for the postcopy preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel to use for loading (RAM_CHANNEL_*)
  */
-static int ram_load_postcopy(QEMUFile *f)
+static int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    /* Currently we only use channel 0.  TODO: use all the channels */
-    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[0];
+    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[channel];
+    /*
+     * Pages of the main channel are placed by the postcopy-place-threads if
+     * there are any; the preempt channel has a thread of its own already.
+     */
+    bool place_async = channel == RAM_CHANNEL_PRECOPY &&
+                       mis->postcopy_place_threads_num;
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -3673,7 +4129,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(mis, f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
             if (!block) {
                 ret = -EINVAL;
                 break;
@@ -3749,8 +4205,12 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_PAGE:
             tmp_page->all_zero = false;
-            if (!matches_target_page_size) {
-                /* For huge pages, we always use temporary buffer */
+            if (!matches_target_page_size || place_async) {
+                /*
+                 * For huge pages, we always use temporary buffer; so do we
+                 * when the page is placed asynchronously, as the QEMUFile
+                 * buffer is reused once we read on.
+                 */
                 qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
             } else {
                 /*
@@ -3778,7 +4238,13 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
+            /* Report placement failures with the section they belong to */
+            if (place_async) {
+                ret = postcopy_place_threads_drain(mis);
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3798,7 +4264,9 @@ static int ram_load_postcopy(QEMUFile *f)
         }
 
         if (!ret && place_needed) {
-            if (tmp_page->all_zero) {
+            if (place_async) {
+                ret = postcopy_place_page_async(mis, tmp_page, block);
+            } else if (tmp_page->all_zero) {
                 ret = postcopy_place_page_zero(mis, tmp_page->host_addr, block);
             } else {
                 ret = postcopy_place_page(mis, tmp_page->host_addr,
@@ -3873,6 +4341,231 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+/*
+ * Whether guest RAM can be mapped from the migration file.  Discarded pages
+ * of a private file mapping read back the file content instead of zeroes,
+ * and devices that pinned guest memory (and disabled discards for that
+ * reason, like vfio) would keep using the anonymous pages, so discards must
+ * not be in use at all.  They stay disabled for as long as the mapping
+ * exists, that is until QEMU exits.
+ */
+static bool mapped_ram_lazy_begin(void)
+{
+    if (ram_block_discard_is_disabled()) {
+        warn_report("mapped-ram-lazy: guest RAM may be pinned, reading it");
+        return false;
+    }
+    if (ram_block_discard_disable(true)) {
+        warn_report("mapped-ram-lazy: a device relies on discarding guest "
+                    "RAM, reading it");
+        return false;
+    }
+    return true;
+}
+
+/* Whether @block is anonymous memory that a file mapping can replace */
+static bool mapped_ram_can_map(RAMBlock *block)
+{
+    return block->fd < 0 && !qemu_ram_is_shared(block) &&
+           block->page_size == qemu_real_host_page_size &&
+           QEMU_PTR_IS_ALIGNED(block->host, qemu_real_host_page_size) &&
+           QEMU_IS_ALIGNED(block->used_length, qemu_real_host_page_size) &&
+           QEMU_IS_ALIGNED(block->pages_offset, qemu_real_host_page_size);
+}
+
+/*
+ * Upper bound for the number of mappings of a single block, so that a
+ * fragmented bitmap does not exhaust vm.max_map_count.
+ */
+#define MAPPED_RAM_MAX_MAPPINGS 8192
+
+/*
+ * Whether the saved pages in @bmap can be mapped run by run: each run must
+ * start and end on a host page boundary, and there must not be too many
+ * of them.
+ */
+static bool mapped_ram_can_map_runs(unsigned long *bmap, unsigned long pages)
+{
+    unsigned long run_start, run_end;
+    unsigned int runs = 0;
+
+    run_start = find_next_bit(bmap, pages, 0);
+    while (run_start < pages) {
+        run_end = find_next_zero_bit(bmap, pages, run_start + 1);
+        if (!QEMU_IS_ALIGNED(run_start << TARGET_PAGE_BITS,
+                             qemu_real_host_page_size) ||
+            !QEMU_IS_ALIGNED(run_end << TARGET_PAGE_BITS,
+                             qemu_real_host_page_size) ||
+            ++runs > MAPPED_RAM_MAX_MAPPINGS) {
+            return false;
+        }
+        run_start = find_next_bit(bmap, pages, run_end);
+    }
+    return true;
+}
+
+/* Zero the pages of @block whose bit is clear in @bmap */
+static void mapped_ram_zero_clear_pages(RAMBlock *block, unsigned long *bmap,
+                                        unsigned long pages)
+{
+    unsigned long run_start, run_end;
+
+    run_start = find_next_zero_bit(bmap, pages, 0);
+    while (run_start < pages) {
+        run_end = find_next_bit(bmap, pages, run_start + 1);
+        ram_handle_compressed(block->host + (run_start << TARGET_PAGE_BITS), 0,
+                              (run_end - run_start) << TARGET_PAGE_BITS);
+        run_start = find_next_zero_bit(bmap, pages, run_end);
+    }
+}
+
+/**
+ * mapped_ram_map_ramblock: map the saved pages of @block from the file
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * Only the runs of pages whose bit is set in @bmap are mapped.  The slots
+ * of the other pages are holes in a file created by a file: migration,
+ * but an fd: migration may reuse a file that holds stale data, so these
+ * pages stay anonymous memory and are zeroed.
+ *
+ * @block: block to map, already resized to the source's used_length
+ * @bmap: bitmap of the saved pages
+ * @pages: number of target pages in @block
+ */
+static int mapped_ram_map_ramblock(RAMBlock *block, unsigned long *bmap,
+                                   unsigned long pages)
+{
+    unsigned long run_start, run_end;
+    int ret;
+
+    run_start = find_next_bit(bmap, pages, 0);
+    while (run_start < pages) {
+        run_end = find_next_zero_bit(bmap, pages, run_start + 1);
+        ret = mapped_ram_map(block->host + (run_start << TARGET_PAGE_BITS),
+                             (run_end - run_start) << TARGET_PAGE_BITS,
+                             block->pages_offset +
+                             (run_start << TARGET_PAGE_BITS));
+        if (ret) {
+            error_report("Failed to map the mapped-ram pages of %s: %s",
+                         block->idstr, strerror(-ret));
+            return ret;
+        }
+        run_start = find_next_bit(bmap, pages, run_end);
+    }
+    mapped_ram_zero_clear_pages(block, bmap, pages);
+
+    if (!machine_dump_guest_core(current_machine)) {
+        qemu_madvise(block->host, block->used_length, QEMU_MADV_DONTDUMP);
+    }
+    return 0;
+}
+
+/**
+ * mapped_ram_read_ramblock: read the saved pages of @block from the file
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * The pages whose bit is set in @bmap are read in parallel, the others
+ * are zeroed meanwhile.
+ *
+ * @block: block to read, already resized to the source's used_length
+ * @bmap: bitmap of the saved pages
+ * @pages: number of target pages in @block
+ */
+static int mapped_ram_read_ramblock(RAMBlock *block, unsigned long *bmap,
+                                    unsigned long pages)
+{
+    unsigned long run_start, run_end;
+    int ret = 0;
+
+    run_start = find_next_bit(bmap, pages, 0);
+    while (run_start < pages) {
+        run_end = find_next_zero_bit(bmap, pages, run_start + 1);
+        ret = mapped_ram_queue(block->host + (run_start << TARGET_PAGE_BITS),
+                               (run_end - run_start) << TARGET_PAGE_BITS,
+                               block->pages_offset +
+                               (run_start << TARGET_PAGE_BITS));
+        if (ret) {
+            break;
+        }
+        run_start = find_next_bit(bmap, pages, run_end);
+    }
+
+    /* Zero the rest while the threads read the pages */
+    if (!ret) {
+        mapped_ram_zero_clear_pages(block, bmap, pages);
+    }
+
+    if (!ret) {
+        ret = mapped_ram_flush();
+    }
+    if (ret) {
+        error_report("Failed to read the mapped-ram pages of %s: %s",
+                     block->idstr, strerror(-ret));
+    }
+    return ret;
+}
+
+/**
+ * mapped_ram_load_ramblock: load the pages of @block from the migration file
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * Reads the layout written by mapped_ram_setup_ramblock() and the file
+ * bitmap, then reads the pages whose bit is set.  Pages with a clear bit
+ * are zero.
+ *
+ * With mapped-ram-lazy, the saved pages are mapped instead if possible.
+ *
+ * @f: QEMUFile where to receive the data
+ * @block: block to load, already resized to the source's used_length
+ * @lazy: whether the block may be mapped
+ */
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block, bool lazy)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = mapped_ram_bitmap_size(block);
+    unsigned long *le_bmap, *bmap;
+    int ret;
+
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    le_bmap = g_malloc0(bitmap_size);
+    ret = mapped_ram_queue((uint8_t *)le_bmap, bitmap_size,
+                           block->bitmap_offset);
+    if (!ret) {
+        ret = mapped_ram_flush();
+    }
+    if (ret) {
+        error_report("Failed to read the mapped-ram bitmap of %s: %s",
+                     block->idstr, strerror(-ret));
+        g_free(le_bmap);
+        return ret;
+    }
+    bmap = bitmap_new(pages);
+    bitmap_from_le(bmap, le_bmap, pages);
+    g_free(le_bmap);
+
+    if (lazy && mapped_ram_can_map(block) &&
+        mapped_ram_can_map_runs(bmap, pages)) {
+        ret = mapped_ram_map_ramblock(block, bmap, pages);
+    } else {
+        ret = mapped_ram_read_ramblock(block, bmap, pages);
+    }
+    g_free(bmap);
+    if (ret) {
+        return ret;
+    }
+
+    return qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3889,6 +4582,8 @@ static int ram_load_precopy(QEMUFile *f)
     int flags = 0, ret = 0, invalid_flags = 0, len = 0, i = 0;
     /* ADVISE is earlier, it shows the source has the postcopy capability on */
     bool postcopy_advised = postcopy_is_advised();
+    bool mapped_ram_lazy = false;
+
     if (!migrate_use_compression()) {
         invalid_flags |= RAM_SAVE_FLAG_COMPRESS_PAGE;
     }
@@ -3924,7 +4619,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(mis, f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3966,6 +4662,17 @@ static int ram_load_precopy(QEMUFile *f)
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
+            if (migrate_mapped_ram()) {
+                Error *local_err = NULL;
+
+                if (mapped_ram_setup(f, false, false, &local_err)) {
+                    error_report_err(local_err);
+                    ret = -EINVAL;
+                    break;
+                }
+                mapped_ram_lazy = migrate_mapped_ram_lazy() &&
+                                  mapped_ram_lazy_begin();
+            }
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 char id[256];
@@ -4013,6 +4720,11 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram() &&
+                        !ramblock_is_ignored(block)) {
+                        ret = mapped_ram_load_ramblock(f, block,
+                                                       mapped_ram_lazy);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4023,6 +4735,10 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && mapped_ram_lazy) {
+                mapped_ram_prefetch_start();
+            }
+            mapped_ram_cleanup();
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -4101,7 +4817,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -4111,6 +4827,45 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     return ret;
 }
 
+/**
+ * ram_load_postcopy_preempt: load urgent pages from the preempt channel
+ *
+ * Returns 0 for success or -errno in case of error
+ *
+ * The source sends each batch of urgent pages as a RAM section terminated
+ * by RAM_SAVE_FLAG_EOS, and closes the channel with a lone
+ * RAM_SAVE_FLAG_EOS once postcopy completes.  Called from the postcopy
+ * preempt thread; the RCU read lock is only held while a batch is being
+ * loaded, not while waiting for the next one.
+ *
+ * @f: QEMUFile of the postcopy preempt channel
+ */
+int ram_load_postcopy_preempt(QEMUFile *f)
+{
+    int ret = 0;
+    uint8_t *buf;
+
+    while (!ret) {
+        if (qemu_peek_buffer(f, &buf, sizeof(uint64_t), 0) !=
+            sizeof(uint64_t)) {
+            ret = qemu_file_get_error(f) ?: -EIO;
+            break;
+        }
+
+        if (ldq_be_p(buf) == RAM_SAVE_FLAG_EOS) {
+            /* Terminator: postcopy has completed on the source */
+            qemu_file_skip(f, sizeof(uint64_t));
+            break;
+        }
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+        }
+    }
+
+    return ret;
+}
+
 static bool ram_has_postcopy(void *opaque)
 {
     RAMBlock *rb;
@@ -53,6 +53,7 @@
 #include "trace.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
 #include "io/channel-buffer.h"
@@ -1395,15 +1396,258 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
+/*
+ * A device state section saved or loaded by a device-state-threads thread.
+ * Parallel sections travel in the stream as QEMU_VM_SECTION_BUFFERED: the
+ * length of a buffer holding a whole QEMU_VM_SECTION_FULL section, and the
+ * buffer itself, so that the destination can hand it over to a thread
+ * without parsing it.
+ */
+typedef struct DeviceStateJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    /* Writes the section into @bioc when saving */
+    QEMUFile *file;
+    /* The vmdesc entry of the section, merged into the vmdesc when saving */
+    JSONWriter *vmdesc;
+    /* Time spent saving or loading the section, in microseconds */
+    int64_t time;
+    int ret;
+    QSIMPLEQ_ENTRY(DeviceStateJob) next;
+} DeviceStateJob;
+
+struct DeviceStatePool {
+    QemuThread *threads;
+    int threads_num;
+    int (*fn)(DeviceStateJob *job);
+    QemuMutex mutex;
+    /* Signalled when a job is queued, or the threads should quit */
+    QemuCond cond;
+    /* Signalled when a job is done */
+    QemuCond done_cond;
+    QSIMPLEQ_HEAD(, DeviceStateJob) pending;
+    /* All the jobs, in the order they were queued */
+    GPtrArray *jobs;
+    /* Number of jobs queued or running */
+    int busy;
+    bool quit;
+};
+
+static void *device_state_thread(void *opaque)
+{
+    DeviceStatePool *pool = opaque;
+    DeviceStateJob *job;
+    int64_t start;
+
+    qemu_mutex_lock(&pool->mutex);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&pool->pending);
+        if (!job) {
+            if (pool->quit) {
+                break;
+            }
+            qemu_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&pool->pending, next);
+        qemu_mutex_unlock(&pool->mutex);
+
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        job->ret = pool->fn(job);
+        job->time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+
+        qemu_mutex_lock(&pool->mutex);
+        pool->busy--;
+        qemu_cond_broadcast(&pool->done_cond);
+    }
+    qemu_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+static DeviceStatePool *device_state_pool_new(int threads_num,
+                                              int (*fn)(DeviceStateJob *job))
+{
+    DeviceStatePool *pool = g_new0(DeviceStatePool, 1);
+    int i;
+
+    pool->fn = fn;
+    qemu_mutex_init(&pool->mutex);
+    qemu_cond_init(&pool->cond);
+    qemu_cond_init(&pool->done_cond);
+    QSIMPLEQ_INIT(&pool->pending);
+    pool->jobs = g_ptr_array_new();
+
+    pool->threads = g_new0(QemuThread, threads_num);
+    pool->threads_num = threads_num;
+    for (i = 0; i < threads_num; i++) {
+        qemu_thread_create(&pool->threads[i], "devstate", device_state_thread,
+                           pool, QEMU_THREAD_JOINABLE);
+    }
+
+    return pool;
+}
+
+static void device_state_pool_queue(DeviceStatePool *pool,
+                                    DeviceStateJob *job)
+{
+    g_ptr_array_add(pool->jobs, job);
+
+    qemu_mutex_lock(&pool->mutex);
+    pool->busy++;
+    QSIMPLEQ_INSERT_TAIL(&pool->pending, job, next);
+    qemu_cond_signal(&pool->cond);
+    qemu_mutex_unlock(&pool->mutex);
+}
+
+/* Wait for all the queued jobs to be done */
+static void device_state_pool_wait(DeviceStatePool *pool)
+{
+    qemu_mutex_lock(&pool->mutex);
+    while (pool->busy) {
+        qemu_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    qemu_mutex_unlock(&pool->mutex);
+}
+
+static void device_state_pool_free(DeviceStatePool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->cond);
+    qemu_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->threads_num; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    g_free(pool->threads);
+
+    for (i = 0; i < pool->jobs->len; i++) {
+        DeviceStateJob *job = g_ptr_array_index(pool->jobs, i);
+
+        if (job->file) {
+            qemu_fclose(job->file);
+        }
+        json_writer_free(job->vmdesc);
+        object_unref(OBJECT(job->bioc));
+        g_free(job);
+    }
+    g_ptr_array_free(pool->jobs, true);
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->cond);
+    qemu_mutex_destroy(&pool->mutex);
+    g_free(pool);
+}
+
+/* Insert a timing in @list, which is sorted by decreasing time */
+static void device_state_time_insert(DeviceStateTimeList **list,
+                                     SaveStateEntry *se, bool has_size,
+                                     uint64_t size, int64_t time,
+                                     bool parallel)
+{
+    DeviceStateTime *value = g_new0(DeviceStateTime, 1);
+    DeviceStateTimeList *elem = g_new0(DeviceStateTimeList, 1);
+
+    value->name = g_strdup(se->idstr);
+    value->instance_id = se->instance_id;
+    value->has_size = has_size;
+    value->size = size;
+    value->time = time;
+    value->parallel = parallel;
+    elem->value = value;
+
+    while (*list && (*list)->value->time >= time) {
+        list = &(*list)->next;
+    }
+    elem->next = *list;
+    *list = elem;
+}
+
+static int device_state_save_job(DeviceStateJob *job)
+{
+    SaveStateEntry *se = job->se;
+    int ret;
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+
+    json_writer_start_object(job->vmdesc, NULL);
+    json_writer_str(job->vmdesc, "name", se->idstr);
+    json_writer_int64(job->vmdesc, "instance_id", se->instance_id);
+
+    save_section_header(job->file, se, QEMU_VM_SECTION_FULL);
+    ret = vmstate_save(job->file, se, job->vmdesc);
+    if (ret) {
+        return ret;
+    }
+    save_section_footer(job->file, se);
+    qemu_fflush(job->file);
+
+    json_writer_end_object(job->vmdesc);
+
+    trace_savevm_section_end(se->idstr, se->section_id, 0);
+
+    return qemu_file_get_error(job->file);
+}
+
+/*
+ * Write the sections saved by device-state-threads threads to @f, once they
+ * are all done.
+ */
+static int device_state_save_flush(QEMUFile *f, DeviceStatePool *pool,
+                                   JSONWriter *vmdesc,
+                                   DeviceStateTimeList **times)
+{
+    int i;
+
+    device_state_pool_wait(pool);
+
+    for (i = 0; i < pool->jobs->len; i++) {
+        DeviceStateJob *job = g_ptr_array_index(pool->jobs, i);
+
+        if (job->ret) {
+            error_report("Failed to save the state of %s: %d",
+                         job->se->idstr, job->ret);
+            qemu_file_set_error(f, job->ret);
+            return job->ret;
+        }
+
+        json_writer_raw(vmdesc, NULL, json_writer_get(job->vmdesc));
+
+        qemu_put_byte(f, QEMU_VM_SECTION_BUFFERED);
+        qemu_put_be32(f, job->bioc->usage);
+        qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+
+        device_state_time_insert(times, job->se, true, job->bioc->usage,
+                                 job->time, true);
+    }
+
+    return 0;
+}
+
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
 {
+    MigrationState *ms = migrate_get_current();
     g_autoptr(JSONWriter) vmdesc = NULL;
+    DeviceStatePool *pool = NULL;
+    int64_t start, offset;
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
+    qapi_free_DeviceStateTimeList(ms->device_state_times);
+    ms->device_state_times = NULL;
+
+    /* In postcopy, the device state is loaded from a package, keep it simple */
+    if (!in_postcopy && migrate_device_state_threads()) {
+        pool = device_state_pool_new(migrate_device_state_threads(),
+                                     device_state_save_job);
+    }
+
     vmdesc = json_writer_new(false);
     json_writer_start_object(vmdesc, NULL);
     json_writer_int64(vmdesc, "page_size", qemu_target_page_size());
@@ -1418,24 +1662,51 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             continue;
         }
 
+        if (pool && se->vmsd && se->vmsd->parallel) {
+            DeviceStateJob *job = g_new0(DeviceStateJob, 1);
+
+            job->se = se;
+            job->bioc = qio_channel_buffer_new(4096);
+            qio_channel_set_name(QIO_CHANNEL(job->bioc),
+                                 "migration-devstate-buffer");
+            job->file = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+            job->vmdesc = json_writer_new(false);
+            device_state_pool_queue(pool, job);
+            continue;
+        }
+
         trace_savevm_section_start(se->idstr, se->section_id);
 
         json_writer_start_object(vmdesc, NULL);
         json_writer_str(vmdesc, "name", se->idstr);
         json_writer_int64(vmdesc, "instance_id", se->instance_id);
 
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        offset = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
-            return ret;
+            goto out;
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        device_state_time_insert(&ms->device_state_times, se, true,
+                                 qemu_ftell_fast(f) - offset,
+                                 qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start,
+                                 false);
 
         json_writer_end_object(vmdesc);
     }
 
+    if (pool) {
+        ret = device_state_save_flush(f, pool, vmdesc,
+                                      &ms->device_state_times);
+        if (ret) {
+            goto out;
+        }
+    }
+
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_activate_all() on the other end won't fail. */
@@ -1444,7 +1715,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             error_report("%s: bdrv_inactivate_all() failed (%d)",
                          __func__, ret);
             qemu_file_set_error(f, ret);
-            return ret;
+            goto out;
         }
     }
     if (!in_postcopy) {
@@ -1461,13 +1732,21 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         qemu_put_be32(f, vmdesc_len);
         qemu_put_buffer(f, (uint8_t *)json_writer_get(vmdesc), vmdesc_len);
     }
+    ret = 0;
 
-    return 0;
+out:
+    if (pool) {
+        /* Threads may still be saving if a sequential section failed */
+        device_state_pool_wait(pool);
+        device_state_pool_free(pool);
+    }
+    return ret;
 }
 
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
                                        bool inactivate_disks)
 {
+    int64_t start;
     int ret;
     Error *local_err = NULL;
     bool in_postcopy = migration_in_postcopy();
@@ -1491,11 +1770,14 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         goto flush;
     }
 
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy,
                                                           inactivate_disks);
     if (ret) {
         return ret;
     }
+    migrate_get_current()->downtime_actual.device_state =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
 
 flush:
     qemu_fflush(f);
@@ -2390,8 +2672,12 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
+/*
+ * @sep: set to the entry the section belongs to, once it's known
+ */
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               SaveStateEntry **sep)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2435,6 +2721,7 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     }
     se->load_version_id = version_id;
     se->load_section_id = section_id;
+    *sep = se;
 
     /* Validate if it is a device's state */
     if (xen_enabled() && se->is_ram) {
@@ -2455,6 +2742,108 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     return 0;
 }
 
+static int device_state_load_job(DeviceStateJob *job)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QEMUFile *f = qemu_fopen_channel_input(QIO_CHANNEL(job->bioc));
+    uint8_t section_type;
+    int ret;
+
+    section_type = qemu_get_byte(f);
+    if (section_type != QEMU_VM_SECTION_FULL) {
+        error_report("Unexpected section type %d in buffered section",
+                     section_type);
+        ret = -EINVAL;
+    } else {
+        ret = qemu_loadvm_section_start_full(f, mis, &job->se);
+    }
+    qemu_fclose(f);
+
+    return ret;
+}
+
+/*
+ * Load a QEMU_VM_SECTION_BUFFERED section.  With device-state-threads, it's
+ * only queued; qemu_loadvm_device_state_drain() waits for it to be loaded.
+ */
+static int
+qemu_loadvm_section_buffered(QEMUFile *f, MigrationIncomingState *mis)
+{
+    DeviceStateJob *job;
+    QIOChannelBuffer *bioc;
+    uint32_t length;
+    int64_t start;
+    int ret;
+
+    length = qemu_get_be32(f);
+    trace_qemu_loadvm_state_section_buffered(length);
+
+    bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-devstate-buffer");
+    ret = qemu_get_buffer(f, bioc->data, length);
+    if (ret != length) {
+        object_unref(OBJECT(bioc));
+        error_report("Buffered section: receive fail ret=%d length=%u",
+                     ret, length);
+        return qemu_file_get_error(f) ?: -EIO;
+    }
+    bioc->usage += length;
+
+    job = g_new0(DeviceStateJob, 1);
+    job->bioc = bioc;
+
+    if (migrate_device_state_threads()) {
+        if (!mis->device_state_pool) {
+            mis->device_state_pool =
+                device_state_pool_new(migrate_device_state_threads(),
+                                      device_state_load_job);
+        }
+        device_state_pool_queue(mis->device_state_pool, job);
+        return 0;
+    }
+
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    ret = device_state_load_job(job);
+    if (!ret) {
+        device_state_time_insert(&mis->device_state_times, job->se, false, 0,
+                                 qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                 start, false);
+    }
+    object_unref(OBJECT(bioc));
+    g_free(job);
+
+    return ret;
+}
+
+/* Wait for the sections loaded by device-state-threads threads */
+static int qemu_loadvm_device_state_drain(MigrationIncomingState *mis)
+{
+    DeviceStatePool *pool = mis->device_state_pool;
+    int i, ret = 0;
+
+    if (!pool) {
+        return 0;
+    }
+
+    device_state_pool_wait(pool);
+
+    for (i = 0; i < pool->jobs->len; i++) {
+        DeviceStateJob *job = g_ptr_array_index(pool->jobs, i);
+
+        if (job->ret) {
+            ret = ret ?: job->ret;
+            continue;
+        }
+        device_state_time_insert(&mis->device_state_times, job->se, false, 0,
+                                 job->time, true);
+    }
+
+    device_state_pool_free(pool);
+    mis->device_state_pool = NULL;
+
+    return ret;
+}
+
 static int
 qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 {
@@ -2630,8 +3019,10 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    SaveStateEntry *se;
     uint8_t section_type;
-    int ret = 0;
+    int64_t start;
+    int ret = 0, drain_ret;
 
 retry:
     while (true) {
@@ -2646,7 +3037,20 @@ retry:
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+            start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            ret = qemu_loadvm_section_start_full(f, mis, &se);
+            if (ret < 0) {
+                goto out;
+            }
+            if (section_type == QEMU_VM_SECTION_FULL) {
+                int64_t time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+
+                device_state_time_insert(&mis->device_state_times, se, false,
+                                         0, time, false);
+            }
+            break;
+        case QEMU_VM_SECTION_BUFFERED:
+            ret = qemu_loadvm_section_buffered(f, mis);
             if (ret < 0) {
                 goto out;
             }
@@ -2676,6 +3080,11 @@ retry:
     }
 
 out:
+    drain_ret = qemu_loadvm_device_state_drain(mis);
+    if (drain_ret < 0 && ret >= 0) {
+        ret = drain_ret;
+    }
+
     if (ret < 0) {
         qemu_file_set_error(f, ret);
 
@@ -2723,6 +3132,9 @@ int qemu_loadvm_state(QEMUFile *f)
         return -EINVAL;
     }
 
+    qapi_free_DeviceStateTimeList(mis->device_state_times);
+    mis->device_state_times = NULL;
+
     cpu_synchronize_all_pre_loadvm();
 
     ret = qemu_loadvm_state_main(f, mis);
@@ -2773,6 +3185,7 @@ int qemu_loadvm_state(QEMUFile *f)
             g_free(buf);
         }
     }
+    mis->stream_end_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     qemu_loadvm_state_cleanup();
     cpu_synchronize_all_post_init();
@@ -216,6 +216,16 @@ static char *SocketAddress_to_str(SocketAddress *addr)
     }
 }
 
+static void hmp_info_migrate_downtime(Monitor *mon, const char *name,
+                                      DowntimeStats *d)
+{
+    monitor_printf(mon, "downtime %s: %" PRIu64 " us (stop %" PRIu64
+                   " us, transfer %" PRIu64 " us, dirty sync %" PRIu64
+                   " us, device state %" PRIu64 " us, destination %" PRIu64
+                   " us)\n", name, d->total, d->stop, d->transfer,
+                   d->dirty_sync, d->device_state, d->destination);
+}
+
 void hmp_info_migrate(Monitor *mon, const QDict *qdict)
 {
     MigrationInfo *info;
@@ -278,10 +288,20 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        if (info->ram->dirty_sync_count) {
+            monitor_printf(mon, "dirty sync time: %" PRIu64 " us "
+                           "(max %" PRIu64 " us)\n",
+                           info->ram->dirty_sync_time,
+                           info->ram->dirty_sync_time_max);
+        }
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
                        info->ram->multifd_bytes >> 10);
+        if (info->ram->mapped_ram_bytes) {
+            monitor_printf(mon, "mapped-ram bytes: %" PRIu64 " kbytes\n",
+                           info->ram->mapped_ram_bytes >> 10);
+        }
         monitor_printf(mon, "pages-per-second: %" PRIu64 "\n",
                        info->ram->pages_per_second);
 
@@ -367,6 +387,46 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+    if (info->has_postcopy_latency) {
+        PostcopyLatencyInfo *lat = info->postcopy_latency;
+        uint64List *bound, *bin;
+        uint64_t last_bound = 0;
+
+        monitor_printf(mon, "postcopy request latency: requests=%" PRIu64
+                       " average=%" PRIu64 " us max=%" PRIu64 " us\n",
+                       lat->requests, lat->average, lat->max);
+        for (bound = lat->boundaries, bin = lat->bins; bound && bin;
+             bound = bound->next, bin = bin->next) {
+            if (bin->value) {
+                monitor_printf(mon, "  < %" PRIu64 " us: %" PRIu64 "\n",
+                               bound->value, bin->value);
+            }
+            last_bound = bound->value;
+        }
+        /* The last bin counts the requests above the last boundary */
+        if (bin && bin->value) {
+            monitor_printf(mon, "  >= %" PRIu64 " us: %" PRIu64 "\n",
+                           last_bound, bin->value);
+        }
+    }
+    if (info->has_device_state) {
+        DeviceStateTimeList *dev;
+        int i = 0;
+
+        monitor_printf(mon, "device state (slowest):\n");
+        for (dev = info->device_state; dev && i < 10; dev = dev->next, i++) {
+            monitor_printf(mon, "  %s/%" PRIu32 ": %" PRIu64 " us%s\n",
+                           dev->value->name, dev->value->instance_id,
+                           dev->value->time,
+                           dev->value->parallel ? " (parallel)" : "");
+        }
+    }
+    if (info->has_downtime_predicted) {
+        hmp_info_migrate_downtime(mon, "predicted", info->downtime_predicted);
+    }
+    if (info->has_downtime_actual) {
+        hmp_info_migrate_downtime(mon, "actual", info->downtime_actual);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -496,6 +556,15 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_POSTCOPY_BANDWIDTH),
             params->max_postcopy_bandwidth);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PLACE_THREADS),
+            params->postcopy_place_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DEVICE_STATE_THREADS),
+            params->device_state_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRTY_SYNC_THREADS),
+            params->dirty_sync_threads);
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
@@ -1309,6 +1378,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_POSTCOPY_PLACE_THREADS:
+        p->has_postcopy_place_threads = true;
+        visit_type_uint8(v, param, &p->postcopy_place_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_DEVICE_STATE_THREADS:
+        p->has_device_state_threads = true;
+        visit_type_uint8(v, param, &p->device_state_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_DIRTY_SYNC_THREADS:
+        p->has_dirty_sync_threads = true;
+        visit_type_uint8(v, param, &p->dirty_sync_threads, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         if (!visit_type_size(v, param, &cache_size, &err)) {
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include <getopt.h>
+#include <math.h>
 
 #include "qemu-common.h"
 #include "qemu-version.h"
@@ -45,6 +46,7 @@
 #include "qemu/memalign.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
+#include "block/accounting.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
@@ -84,6 +86,10 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_JOBS = 278,
+    OPTION_OFFSETS = 279,
+    OPTION_ZIPF_THETA = 280,
+    OPTION_WRITE_PERCENT = 281,
 };
 
 typedef enum OutputFormat {
@@ -1266,6 +1272,12 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 
     assert(bytes > 0);
 
+    /* Matching buffers are the common case, so compare them in one go */
+    if (!memcmp(buf1, buf2, bytes)) {
+        *pnum = bytes;
+        return 0;
+    }
+
     res = !!memcmp(buf1, buf2, i);
     while (i < bytes) {
         int64_t len = MIN(bytes - i, BDRV_SECTOR_SIZE);
@@ -1280,44 +1292,274 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
     return res;
 }
 
-#define IO_BUF_SIZE (2 * MiB)
-
 /*
- * Check if passed sectors are empty (not allocated or contain only 0 bytes)
+ * Checks a buffer for zeroes sector by sector. Returns 0 if the first
+ * sector contains only zeroes, non-zero otherwise.
  *
- * Intended for use by 'qemu-img compare': Returns 0 in case sectors are
- * filled with 0, 1 if sectors contain non-zero data (this is a comparison
- * failure), and 4 on error (the exit status for read errors), after emitting
- * an error message.
- *
- * @param blk:  BlockBackend for the image
- * @param offset: Starting offset to check
- * @param bytes: Number of bytes to check
- * @param filename: Name of disk file we are checking (logging purpose)
- * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * pnum is set to the sector-aligned size of the buffer prefix that
+ * has the same status as the first sector.
  */
-static int check_empty_sectors(BlockBackend *blk, int64_t offset,
-                               int64_t bytes, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static int check_zero_buffer(const uint8_t *buf, int64_t bytes, int64_t *pnum)
 {
-    int ret = 0;
-    int64_t idx;
+    bool res;
+    int64_t i = MIN(bytes, BDRV_SECTOR_SIZE);
+
+    assert(bytes > 0);
+
+    if (buffer_is_zero(buf, bytes)) {
+        *pnum = bytes;
+        return 0;
+    }
+
+    res = !buffer_is_zero(buf, i);
+    while (i < bytes) {
+        int64_t len = MIN(bytes - i, BDRV_SECTOR_SIZE);
+
+        if (!buffer_is_zero(buf + i, len) != res) {
+            break;
+        }
+        i += len;
+    }
+
+    *pnum = i;
+    return res;
+}
+
+#define IO_BUF_SIZE (2 * MiB)
+#define MAX_COROUTINES 16
+
+typedef struct ImgCompareState {
+    BlockBackend *blk[2];
+    const char *filename[2];
+    int64_t total_size[2];
+    /* Beyond this offset, only the larger image is checked for zeroes */
+    int64_t common_size;
+    /* Offset at which the comparison ends */
+    int64_t end;
+    int64_t progress_base;
+    bool strict;
+    /* Collect all differing ranges instead of stopping at the first one */
+    bool find_all;
+
+    /* Protects offset and serialises the block status queries */
+    CoMutex lock;
+    int64_t offset;
+    int running_coroutines;
+    /* Exit status of the error at the lowest offset, 0 if none occurred */
+    int ret;
+    /* Offset at which the error in ret occurred */
+    int64_t ret_offset;
+    /* Lowest offset at which the images were found to differ */
+    int64_t first_diff;
+    /* true if first_diff is a block status mismatch in strict mode */
+    bool first_diff_status;
+    /* ImageCompareRange entries, only used with find_all */
+    GArray *diffs;
+} ImgCompareState;
+
+static void img_compare_add_diff(ImgCompareState *s, int64_t offset,
+                                 int64_t bytes, bool status_mismatch)
+{
+    if (offset < s->first_diff) {
+        s->first_diff = offset;
+        s->first_diff_status = status_mismatch;
+    }
+    if (s->find_all) {
+        ImageCompareRange range = {
+            .offset = offset,
+            .length = bytes,
+        };
+        g_array_append_val(s->diffs, range);
+    }
+}
+
+static void img_compare_set_error(ImgCompareState *s, int64_t offset,
+                                  int ret)
+{
+    if (!s->ret || offset < s->ret_offset) {
+        s->ret = ret;
+        s->ret_offset = offset;
+    }
+}
+
+static int coroutine_fn img_compare_co_read(ImgCompareState *s, int i,
+                                            int64_t offset, int64_t bytes,
+                                            uint8_t *buf)
+{
+    int ret = blk_co_pread(s->blk[i], offset, bytes, buf, 0);
 
-    ret = blk_pread(blk, offset, buffer, bytes);
     if (ret < 0) {
         error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     offset, filename, strerror(-ret));
-        return 4;
+                     offset, s->filename[i], strerror(-ret));
+        img_compare_set_error(s, offset, 4);
+        return ret;
     }
-    idx = find_nonzero(buffer, bytes);
-    if (idx >= 0) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                offset + idx);
-        return 1;
+    return 0;
+}
+
+/*
+ * Finds the next chunk to compare, starting at s->offset, and advances
+ * s->offset past it. Returns the length of the chunk, or a negative value
+ * on error. Must be called with s->lock held.
+ */
+static int64_t coroutine_fn img_compare_co_next_chunk(ImgCompareState *s,
+                                                      int *status)
+{
+    int64_t offset = s->offset;
+    int64_t chunk = INT64_MAX;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        int64_t pnum;
+
+        if (offset >= s->total_size[i]) {
+            /* The end of the smaller image reads as zeroes */
+            status[i] = BDRV_BLOCK_ZERO;
+            continue;
+        }
+
+        status[i] = bdrv_block_status_above(blk_bs(s->blk[i]), NULL, offset,
+                                            s->total_size[i] - offset, &pnum,
+                                            NULL, NULL);
+        if (status[i] < 0) {
+            error_report("Sector allocation test failed for %s",
+                         s->filename[i]);
+            return status[i];
+        }
+        assert(pnum);
+        chunk = MIN(chunk, pnum);
     }
+    chunk = MIN(chunk, s->end - offset);
 
-    return 0;
+    if (s->strict && offset < s->common_size && status[0] != status[1]) {
+        /* Reported as a whole, without reading the data */
+    } else if ((status[0] & BDRV_BLOCK_ZERO) &&
+               (status[1] & BDRV_BLOCK_ZERO)) {
+        /* Nothing to read */
+    } else if (!(status[0] & BDRV_BLOCK_ALLOCATED) &&
+               !(status[1] & BDRV_BLOCK_ALLOCATED)) {
+        /* Nothing to read */
+    } else {
+        chunk = MIN(chunk, IO_BUF_SIZE);
+    }
+
+    s->offset += chunk;
+    return chunk;
+}
+
+static void coroutine_fn img_compare_co_chunk(ImgCompareState *s,
+                                              int64_t offset, int64_t chunk,
+                                              int *status,
+                                              uint8_t *buf1, uint8_t *buf2)
+{
+    bool allocated1 = status[0] & BDRV_BLOCK_ALLOCATED;
+    bool allocated2 = status[1] & BDRV_BLOCK_ALLOCATED;
+    int64_t i, pnum;
+    int ret;
+
+    if (s->strict && offset < s->common_size && status[0] != status[1]) {
+        img_compare_add_diff(s, offset, chunk, true);
+    } else if ((status[0] & BDRV_BLOCK_ZERO) && (status[1] & BDRV_BLOCK_ZERO)) {
+        /* nothing to do */
+    } else if (allocated1 == allocated2) {
+        if (!allocated1) {
+            return;
+        }
+        if (img_compare_co_read(s, 0, offset, chunk, buf1) < 0 ||
+            img_compare_co_read(s, 1, offset, chunk, buf2) < 0)
+        {
+            return;
+        }
+        for (i = 0; i < chunk; i += pnum) {
+            ret = compare_buffers(buf1 + i, buf2 + i, chunk - i, &pnum);
+            if (ret) {
+                img_compare_add_diff(s, offset + i, pnum, false);
+                if (!s->find_all) {
+                    break;
+                }
+            }
+        }
+    } else {
+        int n = allocated1 ? 0 : 1;
+
+        if (img_compare_co_read(s, n, offset, chunk, buf1) < 0) {
+            return;
+        }
+        if (!s->find_all) {
+            i = find_nonzero(buf1, chunk);
+            if (i >= 0) {
+                img_compare_add_diff(s, offset + i, chunk - i, false);
+            }
+            return;
+        }
+        for (i = 0; i < chunk; i += pnum) {
+            ret = check_zero_buffer(buf1 + i, chunk - i, &pnum);
+            if (ret) {
+                img_compare_add_diff(s, offset + i, pnum, false);
+            }
+        }
+    }
+}
+
+static void coroutine_fn img_compare_co(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1, *buf2;
+
+    s->running_coroutines++;
+    buf1 = blk_blockalign(s->blk[0], IO_BUF_SIZE);
+    buf2 = blk_blockalign(s->blk[1], IO_BUF_SIZE);
+
+    while (1) {
+        int status[2];
+        int64_t offset, chunk;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret || s->offset >= s->end ||
+            (!s->find_all && s->first_diff != INT64_MAX))
+        {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        offset = s->offset;
+        chunk = img_compare_co_next_chunk(s, status);
+        qemu_co_mutex_unlock(&s->lock);
+        if (chunk < 0) {
+            img_compare_set_error(s, offset, 3);
+            break;
+        }
+
+        img_compare_co_chunk(s, offset, chunk, status, buf1, buf2);
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
+static gint img_compare_range_cmp(gconstpointer a, gconstpointer b)
+{
+    const ImageCompareRange *ra = a;
+    const ImageCompareRange *rb = b;
+
+    return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+static void dump_json_image_compare_result(ImageCompareResult *result)
+{
+    GString *str;
+    QObject *obj;
+    Visitor *v = qobject_output_visitor_new(&obj);
+
+    visit_type_ImageCompareResult(v, NULL, &result, &error_abort);
+    visit_complete(v, &obj);
+    str = qobject_to_json_pretty(obj, true);
+    assert(str != NULL);
+    printf("%s\n", str->str);
+    qobject_unref(obj);
+    visit_free(v);
+    g_string_free(str, true);
 }
 
 /*
@@ -1331,22 +1573,20 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
-    int64_t total_size;
-    int64_t offset = 0;
-    int64_t chunk;
-    int c;
-    uint64_t progress_base;
+    int c, i;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    ImgCompareState s = {};
+    ImageCompareResult *result = NULL;
+    ImageCompareRangeList **tail;
+    ImageCompareRange *last = NULL;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1355,9 +1595,10 @@ static int img_compare(int argc, char **argv)
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:m:T:pqsU",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1378,6 +1619,13 @@ static int img_compare(int argc, char **argv)
         case 'F':
             fmt2 = optarg;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_exit("Invalid number of coroutines. Allowed number of"
+                           " coroutines is between 1 and %d", MAX_COROUTINES);
+            }
+            break;
         case 'T':
             cache = optarg;
             break;
@@ -1411,11 +1659,21 @@ static int img_compare(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_OUTPUT:
+            if (!strcmp(optarg, "json")) {
+                output_format = OFORMAT_JSON;
+            } else if (!strcmp(optarg, "human")) {
+                output_format = OFORMAT_HUMAN;
+            } else {
+                error_exit("--output must be used with human or json "
+                           "as argument.");
+            }
+            break;
         }
     }
 
-    /* Progress is not shown in Quiet mode */
-    if (quiet) {
+    /* Progress is not shown in Quiet mode or with JSON output */
+    if (quiet || output_format == OFORMAT_JSON) {
         progress = false;
     }
 
@@ -1450,11 +1708,7 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
 
-    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1469,142 +1723,101 @@ static int img_compare(int argc, char **argv)
         ret = 4;
         goto out;
     }
-    total_size = MIN(total_size1, total_size2);
-    progress_base = MAX(total_size1, total_size2);
+
+    s = (ImgCompareState) {
+        .blk            = { blk1, blk2 },
+        .filename       = { filename1, filename2 },
+        .total_size     = { total_size1, total_size2 },
+        .common_size    = MIN(total_size1, total_size2),
+        .end            = MAX(total_size1, total_size2),
+        .progress_base  = MAX(total_size1, total_size2),
+        .strict         = strict,
+        .find_all       = output_format == OFORMAT_JSON,
+        .first_diff     = INT64_MAX,
+        .diffs          = g_array_new(false, false,
+                                      sizeof(ImageCompareRange)),
+    };
 
     qemu_progress_print(0, 100);
 
     if (strict && total_size1 != total_size2) {
-        ret = 1;
-        qprintf(quiet, "Strict mode: Image size mismatch!\n");
-        goto out;
+        if (!s.find_all) {
+            ret = 1;
+            qprintf(quiet, "Strict mode: Image size mismatch!\n");
+            goto out;
+        }
+        /* The whole tail of the larger image differs */
+        img_compare_add_diff(&s, s.common_size, s.end - s.common_size, false);
+        s.end = s.common_size;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
+    qemu_co_mutex_init(&s.lock);
+    for (i = 0; i < num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(img_compare_co, &s));
+    }
 
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+    while (s.running_coroutines) {
+        main_loop_wait(false);
+    }
 
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+    /*
+     * Chunks are compared in parallel, so areas past the first difference
+     * may have been read, too.  Unless all differences are listed, errors
+     * there don't matter, like in a sequential comparison.
+     */
+    if (s.ret && (s.find_all || s.ret_offset < s.first_diff)) {
+        ret = s.ret;
+        goto out;
+    }
 
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
+    if (s.find_all) {
+        g_array_sort(s.diffs, img_compare_range_cmp);
 
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
+        result = g_new0(ImageCompareResult, 1);
+        result->identical = s.diffs->len == 0;
+        result->size_mismatch = total_size1 != total_size2;
+        tail = &result->differences;
+        for (i = 0; i < s.diffs->len; i++) {
+            ImageCompareRange *range =
+                &g_array_index(s.diffs, ImageCompareRange, i);
 
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, buf1, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, buf2, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
-        } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
+            if (last && last->offset + last->length == range->offset) {
+                last->length += range->length;
+                continue;
             }
+            last = g_new(ImageCompareRange, 1);
+            *last = *range;
+            QAPI_LIST_APPEND(tail, last);
         }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+        dump_json_image_compare_result(result);
+        ret = result->identical ? 0 : 1;
+        goto out;
     }
 
-    if (total_size1 != total_size2) {
-        BlockBackend *blk_over;
-        const char *filename_over;
-
+    if (total_size1 != total_size2 && s.first_diff >= s.common_size) {
         qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_size1 > total_size2) {
-            blk_over = blk1;
-            filename_over = filename1;
-        } else {
-            blk_over = blk2;
-            filename_over = filename2;
-        }
-
-        while (offset < progress_base) {
-            ret = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
-                                          progress_base - offset, &chunk,
-                                          NULL, NULL);
-            if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
+    }
 
-            }
-            if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = check_empty_sectors(blk_over, offset, chunk,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    goto out;
-                }
-            }
-            offset += chunk;
-            qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+    if (s.first_diff != INT64_MAX) {
+        if (s.first_diff_status) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " block status mismatch!\n", s.first_diff);
+        } else {
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    s.first_diff);
         }
+        ret = 1;
+        goto out;
     }
 
     qprintf(quiet, "Images are identical.\n");
     ret = 0;
 
 out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
+    qapi_free_ImageCompareResult(result);
+    if (s.diffs) {
+        g_array_free(s.diffs, true);
+    }
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1636,9 +1849,32 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+enum ImgConvertStage {
+    CONVERT_STAGE_READ,
+    CONVERT_STAGE_ZERO_DETECT,
+    CONVERT_STAGE_WRITE,
+    CONVERT_STAGE__MAX,
+};
+
+static const char *const convert_stage_names[CONVERT_STAGE__MAX] = {
+    [CONVERT_STAGE_READ]        = "read",
+    [CONVERT_STAGE_ZERO_DETECT] = "zero detection",
+    [CONVERT_STAGE_WRITE]       = "write",
+};
+
+/*
+ * Bytes that went through a stage of the conversion, and the time during
+ * which at least one request was in that stage.
+ */
+typedef struct ImgConvertStageStats {
+    int64_t bytes;
+    int64_t busy_ns;
+    int64_t busy_since_ns;
+    int in_flight;
+} ImgConvertStageStats;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1659,6 +1895,7 @@ typedef struct ImgConvertState {
     int64_t target_backing_sectors; /* negative if unknown */
     bool wr_in_order;
     bool copy_range;
+    bool copy_range_worked; /* at least one range was offloaded */
     bool salvage;
     bool quiet;
     int min_sparse;
@@ -1671,8 +1908,46 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+    ImgConvertStageStats stages[CONVERT_STAGE__MAX];
 } ImgConvertState;
 
+static void convert_stage_begin(ImgConvertState *s, enum ImgConvertStage stage)
+{
+    ImgConvertStageStats *st = &s->stages[stage];
+
+    if (!st->in_flight++) {
+        st->busy_since_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+}
+
+static void convert_stage_end(ImgConvertState *s, enum ImgConvertStage stage,
+                              int64_t bytes)
+{
+    ImgConvertStageStats *st = &s->stages[stage];
+    int64_t now;
+
+    st->bytes += bytes;
+    if (!--st->in_flight) {
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        st->busy_ns += now - st->busy_since_ns;
+    }
+}
+
+static void convert_print_stage_stats(ImgConvertState *s)
+{
+    int i;
+
+    printf("Throughput:");
+    for (i = 0; i < CONVERT_STAGE__MAX; i++) {
+        ImgConvertStageStats *st = &s->stages[i];
+        double secs = (double)st->busy_ns / NANOSECONDS_PER_SECOND;
+
+        printf("%s %s %.1f MiB/s", i ? "," : "", convert_stage_names[i],
+               secs > 0 ? st->bytes / secs / MiB : 0.0);
+    }
+    printf("\n");
+}
+
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
 {
@@ -1845,68 +2120,224 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
-static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
-                                         int nb_sectors, uint8_t *buf,
-                                         enum ImgConvertBlockStatus status)
+/*
+ * Returns how the first sectors of @buf are written: BLK_DATA for a write,
+ * BLK_ZERO for a write zeroes request, or BLK_BACKING_FILE if nothing needs to
+ * be written.  *@pnum is set to the number of sectors this covers.
+ */
+static enum ImgConvertBlockStatus
+convert_write_segment(ImgConvertState *s, int64_t sector_num, int *pnum,
+                      const uint8_t *buf, enum ImgConvertBlockStatus status)
+{
+    int n = *pnum;
+    bool has_data = true;
+
+    switch (status) {
+    case BLK_BACKING_FILE:
+        /*
+         * If we have a backing file, leave clusters unallocated that are
+         * unallocated in the source image, so that the backing file is
+         * visible at the respective offset.
+         */
+        assert(s->target_has_backing);
+        return BLK_BACKING_FILE;
+
+    case BLK_DATA:
+        /*
+         * If we're told to keep the target fully allocated (-S 0) or there
+         * is real non-zero data, we must write it. Otherwise we can treat
+         * it as zero sectors.
+         * Compressed clusters need to be written as a whole, so in that
+         * case we can only save the write if the buffer is completely
+         * zeroed.
+         */
+        if (s->min_sparse) {
+            convert_stage_begin(s, CONVERT_STAGE_ZERO_DETECT);
+            if (s->compressed) {
+                has_data = !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE);
+            } else {
+                has_data = is_allocated_sectors_min(buf, n, &n,
+                                                    s->min_sparse,
+                                                    sector_num,
+                                                    s->alignment);
+            }
+            convert_stage_end(s, CONVERT_STAGE_ZERO_DETECT,
+                              n * BDRV_SECTOR_SIZE);
+            *pnum = n;
+        }
+        if (has_data) {
+            return BLK_DATA;
+        }
+        /* fall-through */
+
+    case BLK_ZERO:
+        if (s->has_zero_init) {
+            assert(!s->target_has_backing);
+            return BLK_BACKING_FILE;
+        }
+        return BLK_ZERO;
+    }
+
+    g_assert_not_reached();
+}
+
+/* Issues the request for a segment returned by convert_write_segment() */
+static int coroutine_fn
+convert_co_write_segment(ImgConvertState *s, int64_t sector_num,
+                         int nb_sectors, uint8_t *buf,
+                         enum ImgConvertBlockStatus status)
+{
+    BdrvRequestFlags flags = s->compressed ? BDRV_REQ_WRITE_COMPRESSED : 0;
+    int ret;
+
+    convert_stage_begin(s, CONVERT_STAGE_WRITE);
+    if (status == BLK_DATA) {
+        ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
+                            nb_sectors << BDRV_SECTOR_BITS, buf, flags);
+    } else {
+        assert(status == BLK_ZERO);
+        ret = blk_co_pwrite_zeroes(s->target, sector_num << BDRV_SECTOR_BITS,
+                                   nb_sectors << BDRV_SECTOR_BITS,
+                                   BDRV_REQ_MAY_UNMAP);
+    }
+    convert_stage_end(s, CONVERT_STAGE_WRITE, nb_sectors * BDRV_SECTOR_SIZE);
+
+    return ret;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    int ret;
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+        enum ImgConvertBlockStatus seg_status;
+
+        seg_status = convert_write_segment(s, sector_num, &n, buf, status);
+        if (seg_status != BLK_BACKING_FILE) {
+            ret = convert_co_write_segment(s, sector_num, n, buf, seg_status);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/* The segments of one in-order write, see convert_co_write_in_order() */
+typedef struct ConvertWriteBatch {
+    int in_flight;
+    int ret;
+    Coroutine *waiter;
+} ConvertWriteBatch;
+
+typedef struct ConvertWriteCo {
+    ConvertWriteBatch *batch;
+    ImgConvertState *s;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    enum ImgConvertBlockStatus status;
+} ConvertWriteCo;
+
+static void coroutine_fn convert_co_write_entry(void *opaque)
 {
+    ConvertWriteCo *w = opaque;
+    ConvertWriteBatch *batch = w->batch;
     int ret;
 
-    while (nb_sectors > 0) {
-        int n = nb_sectors;
-        BdrvRequestFlags flags = s->compressed ? BDRV_REQ_WRITE_COMPRESSED : 0;
-
-        switch (status) {
-        case BLK_BACKING_FILE:
-            /* If we have a backing file, leave clusters unallocated that are
-             * unallocated in the source image, so that the backing file is
-             * visible at the respective offset. */
-            assert(s->target_has_backing);
-            break;
-
-        case BLK_DATA:
-            /* If we're told to keep the target fully allocated (-S 0) or there
-             * is real non-zero data, we must write it. Otherwise we can treat
-             * it as zero sectors.
-             * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
-            if (!s->min_sparse ||
-                (!s->compressed &&
-                 is_allocated_sectors_min(buf, n, &n, s->min_sparse,
-                                          sector_num, s->alignment)) ||
-                (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
-            {
-                ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, buf, flags);
-                if (ret < 0) {
-                    return ret;
-                }
-                break;
-            }
-            /* fall-through */
+    ret = convert_co_write_segment(w->s, w->sector_num, w->nb_sectors, w->buf,
+                                   w->status);
+    g_free(w);
 
-        case BLK_ZERO:
-            if (s->has_zero_init) {
-                assert(!s->target_has_backing);
-                break;
-            }
-            ret = blk_co_pwrite_zeroes(s->target,
-                                       sector_num << BDRV_SECTOR_BITS,
-                                       n << BDRV_SECTOR_BITS,
-                                       BDRV_REQ_MAY_UNMAP);
-            if (ret < 0) {
-                return ret;
-            }
+    if (ret < 0 && !batch->ret) {
+        batch->ret = ret;
+    }
+    if (!--batch->in_flight && batch->waiter) {
+        aio_co_wake(batch->waiter);
+    }
+}
+
+/* Let the coroutine waiting to write at @wr_offs go ahead */
+static void coroutine_fn convert_co_wake_next(ImgConvertState *s,
+                                              int64_t wr_offs)
+{
+    int i;
+
+    s->wr_offs = wr_offs;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            /*
+             * A -> B -> A cannot occur because A has
+             * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+             * B will never enter A during this time window.
+             */
+            qemu_coroutine_enter(s->co[i]);
             break;
         }
+    }
+}
+
+/*
+ * Write in order, but only wait for the previous write to be submitted to the
+ * target, not for it to complete.  Drivers allocate space in the order they
+ * are called, so the target is laid out as if the writes were serialised,
+ * while the compression and encryption of consecutive writes can run in
+ * parallel in the target's worker threads.
+ *
+ * Zero detection may split the buffer into several requests.  Each of them
+ * runs in its own coroutine, which returns here once the request yields, i.e.
+ * it has been submitted.  The next write may only go ahead after the last
+ * one has been submitted.
+ */
+static int coroutine_fn
+convert_co_write_in_order(ImgConvertState *s, int64_t sector_num,
+                          int nb_sectors, uint8_t *buf,
+                          enum ImgConvertBlockStatus status)
+{
+    int64_t end = sector_num + nb_sectors;
+    ConvertWriteBatch batch = {};
+
+    while (nb_sectors > 0 && !batch.ret) {
+        int n = nb_sectors;
+        enum ImgConvertBlockStatus seg_status;
+
+        seg_status = convert_write_segment(s, sector_num, &n, buf, status);
+        if (seg_status != BLK_BACKING_FILE) {
+            ConvertWriteCo *w = g_new(ConvertWriteCo, 1);
+
+            *w = (ConvertWriteCo) {
+                .batch      = &batch,
+                .s          = s,
+                .sector_num = sector_num,
+                .nb_sectors = n,
+                .buf        = buf,
+                .status     = seg_status,
+            };
+            batch.in_flight++;
+            qemu_coroutine_enter(qemu_coroutine_create(convert_co_write_entry,
+                                                       w));
+        }
 
         sector_num += n;
         nb_sectors -= n;
         buf += n * BDRV_SECTOR_SIZE;
     }
 
-    return 0;
+    convert_co_wake_next(s, end);
+
+    while (batch.in_flight) {
+        batch.waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    return batch.ret;
 }
 
 static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector_num,
@@ -1927,9 +2358,11 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
 
         n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
 
+        convert_stage_begin(s, CONVERT_STAGE_WRITE);
         ret = blk_co_copy_range(blk, offset, s->target,
                                 sector_num << BDRV_SECTOR_BITS,
                                 n << BDRV_SECTOR_BITS, 0, 0);
+        convert_stage_end(s, CONVERT_STAGE_WRITE, n * BDRV_SECTOR_SIZE);
         if (ret < 0) {
             return ret;
         }
@@ -1963,6 +2396,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        bool copy_range_failed = false;
+        bool woke_next = false;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1993,9 +2428,11 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = s->copy_range && !copy_range_failed && status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
+            convert_stage_begin(s, CONVERT_STAGE_READ);
             ret = convert_co_read(s, sector_num, n, buf);
+            convert_stage_end(s, CONVERT_STAGE_READ, n * BDRV_SECTOR_SIZE);
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
@@ -2019,9 +2456,22 @@ retry:
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
                 if (ret) {
-                    s->copy_range = false;
+                    /*
+                     * Copy this range through the buffer.  Unless offloading
+                     * worked for other ranges (and only this one cannot be
+                     * offloaded, e.g. compressed qcow2 clusters), it is not
+                     * supported between these images at all.
+                     */
+                    if (!s->copy_range_worked) {
+                        s->copy_range = false;
+                    }
+                    copy_range_failed = true;
                     goto retry;
                 }
+                s->copy_range_worked = true;
+            } else if (s->wr_in_order) {
+                ret = convert_co_write_in_order(s, sector_num, n, buf, status);
+                woke_next = true;
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
             }
@@ -2032,21 +2482,10 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !woke_next) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_co_wake_next(s, sector_num + n);
         }
     }
 
@@ -2756,6 +3195,9 @@ out:
         qemu_progress_print(100, 0);
     }
     qemu_progress_end();
+    if (progress && !ret) {
+        convert_print_stage_stats(&s);
+    }
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qobject_unref(open_opts);
@@ -4249,10 +4691,55 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+enum BenchOffsets {
+    BENCH_OFFSETS_SEQUENTIAL,
+    BENCH_OFFSETS_RANDOM,
+    BENCH_OFFSETS_ZIPF,
+};
+
+/* Terms of the zeta function that are summed up, the rest is integrated */
+#define BENCH_ZIPF_EXACT_TERMS (1 << 20)
+
+/* Latency histogram from 1 us to 10 s */
+#define BENCH_LATENCY_MIN_NS 1000
+#define BENCH_LATENCY_DECADES 7
+#define BENCH_LATENCY_BINS_PER_DECADE 20
+
+/*
+ * Zipfian distribution over [0, n), see Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases"
+ */
+typedef struct BenchZipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} BenchZipf;
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    QEMUIOVector read_qiov;
+    BlockAcctCookie acct;
+    QSLIST_ENTRY(BenchRequest) next;
+} BenchRequest;
+
+typedef struct BenchFlush {
+    BenchData *b;
+    BlockAcctCookie acct;
+} BenchFlush;
+
+struct BenchData {
     BlockBackend *blk;
+    BlockAcctStats *stats;
     uint64_t image_size;
-    bool write;
+    int write_percent;
+    enum BenchOffsets offsets;
+    const BenchZipf *zipf;
+    GRand *rand;
     int bufsize;
     int step;
     int nrreq;
@@ -4260,95 +4747,331 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    uint8_t *read_buf;
+    BenchRequest *reqs;
+    QSLIST_HEAD(, BenchRequest) free_reqs;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+};
+
+static void bench_zipf_init(BenchZipf *z, uint64_t n, double theta)
+{
+    uint64_t exact = MIN(n, BENCH_ZIPF_EXACT_TERMS);
+    double zeta2 = 1.0 + pow(0.5, theta);
+    uint64_t i;
+
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->zetan = 0;
+    for (i = 1; i <= exact; i++) {
+        z->zetan += pow(i, -theta);
+    }
+    if (n > exact) {
+        z->zetan += (pow(n + 0.5, 1.0 - theta) -
+                     pow(exact + 0.5, 1.0 - theta)) / (1.0 - theta);
+    }
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t bench_zipf_next(const BenchZipf *z, GRand *rand)
+{
+    double u = g_rand_double(rand);
+    double uz = u * z->zetan;
+
+    if (uz < 1.0) {
+        return 0;
+    } else if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    return MIN(z->n - 1,
+               (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha)));
+}
+
+static int64_t bench_next_offset(BenchData *b)
+{
+    uint64_t blocks = b->image_size / b->bufsize;
+    int64_t offset;
+
+    switch (b->offsets) {
+    case BENCH_OFFSETS_RANDOM:
+        return (uint64_t)(g_rand_double(b->rand) * blocks) * b->bufsize;
+    case BENCH_OFFSETS_ZIPF:
+        return bench_zipf_next(b->zipf, b->rand) * b->bufsize;
+    default:
+        offset = b->offset;
+        b->offset += b->step;
+        b->offset %= b->image_size;
+        return offset;
+    }
+}
+
+static bool bench_next_is_write(BenchData *b)
+{
+    if (b->write_percent == 0 || b->write_percent == 100) {
+        return b->write_percent == 100;
+    }
+    return g_rand_int_range(b->rand, 0, 100) < b->write_percent;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchData *b)
+{
+    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
+        BenchRequest *req = QSLIST_FIRST(&b->free_reqs);
+        int64_t offset = bench_next_offset(b);
+        BlockAIOCB *acb;
+
+        /*
+         * blk_aio_* might look for completed I/Os and kick bench_cb
+         * again, so make sure this operation is counted by in_flight
+         * and its request is taken off the free list.
+         */
+        QSLIST_REMOVE_HEAD(&b->free_reqs, next);
+        b->in_flight++;
+        if (bench_next_is_write(b)) {
+            block_acct_start(b->stats, &req->acct, b->bufsize,
+                             BLOCK_ACCT_WRITE);
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0, bench_cb,
+                                  req);
+        } else {
+            block_acct_start(b->stats, &req->acct, b->bufsize,
+                             BLOCK_ACCT_READ);
+            acb = blk_aio_preadv(b->blk, offset, &req->read_qiov, 0, bench_cb,
+                                 req);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
+    BenchFlush *f = opaque;
+
     if (ret < 0) {
         error_report("Failed flush request: %s", strerror(-ret));
         exit(EXIT_FAILURE);
     }
+    block_acct_done(f->b->stats, &f->acct);
+    g_free(f);
+}
+
+static void bench_drained_flush_cb(void *opaque, int ret)
+{
+    BenchFlush *f = opaque;
+    BenchData *b = f->b;
+
+    bench_undrained_flush_cb(f, ret);
+
+    /* Just finished a flush with drained queue: Start next requests */
+    assert(b->in_flight == 0);
+    b->in_flush = false;
+    bench_submit(b);
 }
 
 static void bench_cb(void *opaque, int ret)
 {
-    BenchData *b = opaque;
-    BlockAIOCB *acb;
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    int remaining;
 
     if (ret < 0) {
         error_report("Failed request: %s", strerror(-ret));
         exit(EXIT_FAILURE);
     }
 
-    if (b->in_flush) {
-        /* Just finished a flush with drained queue: Start next requests */
-        assert(b->in_flight == 0);
-        b->in_flush = false;
-    } else if (b->in_flight > 0) {
-        int remaining = b->n - b->in_flight;
+    block_acct_done(b->stats, &req->acct);
+    QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
 
-        b->n--;
-        b->in_flight--;
+    remaining = b->n - b->in_flight;
+    b->n--;
+    b->in_flight--;
 
-        /* Time for flush? Drain queue if requested, then flush */
-        if (b->flush_interval && remaining % b->flush_interval == 0) {
-            if (!b->in_flight || !b->drain_on_flush) {
-                BlockCompletionFunc *cb;
+    /* Time for flush? Drain queue if requested, then flush */
+    if (b->flush_interval && remaining % b->flush_interval == 0) {
+        if (!b->in_flight || !b->drain_on_flush) {
+            BenchFlush *f = g_new(BenchFlush, 1);
+            BlockCompletionFunc *cb;
+            BlockAIOCB *acb;
 
-                if (b->drain_on_flush) {
-                    b->in_flush = true;
-                    cb = bench_cb;
-                } else {
-                    cb = bench_undrained_flush_cb;
-                }
-
-                acb = blk_aio_flush(b->blk, cb, b);
-                if (!acb) {
-                    error_report("Failed to issue flush request");
-                    exit(EXIT_FAILURE);
-                }
-            }
             if (b->drain_on_flush) {
-                return;
+                b->in_flush = true;
+                cb = bench_drained_flush_cb;
+            } else {
+                cb = bench_undrained_flush_cb;
+            }
+
+            f->b = b;
+            block_acct_start(b->stats, &f->acct, 0, BLOCK_ACCT_FLUSH);
+            acb = blk_aio_flush(b->blk, cb, f);
+            if (!acb) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
             }
         }
+        if (b->drain_on_flush) {
+            return;
+        }
     }
 
-    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
-        /* blk_aio_* might look for completed I/Os and kick bench_cb
-         * again, so make sure this operation is counted by in_flight
-         * and b->offset is ready for the next submission.
-         */
-        b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
-        } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
-        }
-        if (!acb) {
-            error_report("Failed to issue request");
-            exit(EXIT_FAILURE);
+    bench_submit(b);
+}
+
+static void bench_init_requests(BenchData *b, int pattern)
+{
+    size_t buf_size = b->nrreq * b->bufsize;
+    uint8_t *read_buf;
+    int i;
+
+    b->buf = blk_blockalign(b->blk, buf_size);
+    memset(b->buf, pattern, buf_size);
+    blk_register_buf(b->blk, b->buf, buf_size);
+
+    /* Reads must not overwrite the pattern written by the other requests */
+    if (b->write_percent > 0 && b->write_percent < 100) {
+        b->read_buf = blk_blockalign(b->blk, buf_size);
+        blk_register_buf(b->blk, b->read_buf, buf_size);
+    }
+    read_buf = b->read_buf ?: b->buf;
+
+    b->reqs = g_new0(BenchRequest, b->nrreq);
+    for (i = 0; i < b->nrreq; i++) {
+        BenchRequest *req = &b->reqs[i];
+
+        req->b = b;
+        qemu_iovec_init_buf(&req->qiov, b->buf + i * b->bufsize, b->bufsize);
+        qemu_iovec_init_buf(&req->read_qiov, read_buf + i * b->bufsize,
+                            b->bufsize);
+        QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
+    }
+}
+
+static void bench_cleanup(BenchData *b)
+{
+    if (b->buf) {
+        blk_unregister_buf(b->blk, b->buf);
+    }
+    if (b->read_buf) {
+        blk_unregister_buf(b->blk, b->read_buf);
+    }
+    qemu_vfree(b->buf);
+    qemu_vfree(b->read_buf);
+    g_free(b->reqs);
+    if (b->rand) {
+        g_rand_free(b->rand);
+    }
+}
+
+static uint64List *bench_latency_boundaries(void)
+{
+    uint64List *list = NULL;
+    int i;
+
+    for (i = BENCH_LATENCY_DECADES * BENCH_LATENCY_BINS_PER_DECADE; i >= 0;
+         i--)
+    {
+        uint64_t ns = BENCH_LATENCY_MIN_NS *
+                      pow(10, (double)i / BENCH_LATENCY_BINS_PER_DECADE);
+        QAPI_LIST_PREPEND(list, ns);
+    }
+    return list;
+}
+
+/* Upper bound of the histogram bin holding @percentile of @ops requests */
+static uint64_t bench_latency_percentile(BlockLatencyHistogram *hist,
+                                         uint64_t ops, double percentile)
+{
+    uint64_t target = MAX(1, ceil(ops * percentile / 100));
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < hist->nbins - 1; i++) {
+        sum += hist->bins[i];
+        if (sum >= target) {
+            return hist->boundaries[i];
         }
     }
+    return hist->boundaries[hist->nbins - 2];
+}
+
+static ImageBenchOps *bench_ops_result(BlockAcctStats *stats,
+                                       enum BlockAcctType type, double secs)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    uint64_t ops = stats->nr_ops[type];
+    ImageBenchOps *r;
+
+    if (!ops) {
+        return NULL;
+    }
+
+    r = g_new(ImageBenchOps, 1);
+    *r = (ImageBenchOps) {
+        .ops        = ops,
+        .bytes      = stats->nr_bytes[type],
+        .iops       = ops / secs,
+        .bandwidth  = stats->nr_bytes[type] / secs,
+        .latency    = g_new(ImageBenchLatency, 1),
+    };
+    *r->latency = (ImageBenchLatency) {
+        .mean   = stats->total_time_ns[type] / ops,
+        .p50    = bench_latency_percentile(hist, ops, 50),
+        .p99    = bench_latency_percentile(hist, ops, 99),
+        .p999   = bench_latency_percentile(hist, ops, 99.9),
+    };
+    return r;
+}
+
+static void bench_print_ops(const char *name, ImageBenchOps *r)
+{
+    if (!r) {
+        return;
+    }
+    printf("%s: %" PRId64 " requests, %.1f IOPS, %.1f MiB/s, latency (us): "
+           "mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f\n",
+           name, r->ops, r->iops, r->bandwidth / MiB,
+           r->latency->mean / 1000.0, r->latency->p50 / 1000.0,
+           r->latency->p99 / 1000.0, r->latency->p999 / 1000.0);
+}
+
+static void dump_json_bench_result(ImageBenchResult *result)
+{
+    GString *str;
+    QObject *obj;
+    Visitor *v = qobject_output_visitor_new(&obj);
+
+    visit_type_ImageBenchResult(v, NULL, &result, &error_abort);
+    visit_complete(v, &obj);
+    str = qobject_to_json_pretty(obj, true);
+    assert(str != NULL);
+    printf("%s\n", str->str);
+    qobject_unref(obj);
+    visit_free(v);
+    g_string_free(str, true);
 }
 
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
     const char *fmt = NULL, *filename;
+    const char *output = NULL;
+    OutputFormat output_format = OFORMAT_HUMAN;
     bool quiet = false;
     bool image_opts = false;
     bool is_write = false;
+    int write_percent = -1;
     int count = 75000;
     int depth = 64;
+    int njobs = 1;
+    enum BenchOffsets offsets = BENCH_OFFSETS_SEQUENTIAL;
+    double zipf_theta = 0;
+    BenchZipf zipf = {};
     int64_t offset = 0;
     size_t bufsize = 4096;
     int pattern = 0;
@@ -4357,13 +5080,16 @@ static int img_bench(int argc, char **argv)
     bool drain_on_flush = true;
     int64_t image_size;
     BlockBackend *blk = NULL;
-    BenchData data = {};
+    BlockAcctStats *stats;
+    BenchData *jobs = NULL;
+    uint64List *boundaries;
+    ImageBenchResult *result;
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
+    double secs;
     int i;
     bool force_share = false;
-    size_t buf_size;
 
     for (;;) {
         static const struct option long_options[] = {
@@ -4373,6 +5099,11 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"jobs", required_argument, 0, OPTION_JOBS},
+            {"offsets", required_argument, 0, OPTION_OFFSETS},
+            {"zipf-theta", required_argument, 0, OPTION_ZIPF_THETA},
+            {"write-percent", required_argument, 0, OPTION_WRITE_PERCENT},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
@@ -4506,6 +5237,51 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_JOBS:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res < 1 ||
+                res > INT_MAX) {
+                error_report("Invalid number of jobs specified");
+                return 1;
+            }
+            njobs = res;
+            break;
+        }
+        case OPTION_OFFSETS:
+            if (!strcmp(optarg, "sequential")) {
+                offsets = BENCH_OFFSETS_SEQUENTIAL;
+            } else if (!strcmp(optarg, "random")) {
+                offsets = BENCH_OFFSETS_RANDOM;
+            } else if (!strcmp(optarg, "zipf")) {
+                offsets = BENCH_OFFSETS_ZIPF;
+            } else {
+                error_report("--offsets must be sequential, random or zipf");
+                return 1;
+            }
+            break;
+        case OPTION_ZIPF_THETA:
+            if (qemu_strtod(optarg, NULL, &zipf_theta) < 0 ||
+                zipf_theta <= 0 || zipf_theta >= 1) {
+                error_report("Invalid zipf theta specified");
+                return 1;
+            }
+            break;
+        case OPTION_WRITE_PERCENT:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            write_percent = res;
+            break;
+        }
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
         }
     }
 
@@ -4514,7 +5290,31 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    if (write_percent < 0) {
+        write_percent = is_write ? 100 : 0;
+    } else if (write_percent > 0) {
+        flags |= BDRV_O_RDWR;
+    }
+
+    if (zipf_theta && offsets != BENCH_OFFSETS_ZIPF) {
+        error_report("--zipf-theta requires --offsets=zipf");
+        ret = -1;
+        goto out;
+    }
+    if (!zipf_theta) {
+        zipf_theta = 0.99;
+    }
+
+    if (!write_percent && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
@@ -4538,56 +5338,121 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    if (offsets != BENCH_OFFSETS_SEQUENTIAL && (uint64_t)image_size < bufsize) {
+        error_report("Image is smaller than the buffer size");
+        ret = -1;
+        goto out;
+    }
+    if (offsets == BENCH_OFFSETS_ZIPF) {
+        bench_zipf_init(&zipf, image_size / bufsize, zipf_theta);
+    }
+
+    stats = blk_get_stats(blk);
+    boundaries = bench_latency_boundaries();
+    block_latency_histogram_set(stats, BLOCK_ACCT_READ, boundaries);
+    block_latency_histogram_set(stats, BLOCK_ACCT_WRITE, boundaries);
+    block_latency_histogram_set(stats, BLOCK_ACCT_FLUSH, boundaries);
+    qapi_free_uint64List(boundaries);
+
+    jobs = g_new0(BenchData, njobs);
+    for (i = 0; i < njobs; i++) {
+        /* Sequential jobs start at evenly spread offsets, wrapping around */
+        uint64_t job_offset = QEMU_ALIGN_DOWN(i * (image_size / njobs),
+                                              bufsize);
+
+        jobs[i] = (BenchData) {
+            .blk            = blk,
+            .stats          = stats,
+            .image_size     = image_size,
+            .write_percent  = write_percent,
+            .offsets        = offsets,
+            .zipf           = &zipf,
+            .rand           = g_rand_new_with_seed(i),
+            .bufsize        = bufsize,
+            .step           = step ?: bufsize,
+            .nrreq          = depth,
+            .n              = count,
+            .offset         = (offset + job_offset) % image_size,
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+        };
+        bench_init_requests(&jobs[i], pattern);
     }
 
-    buf_size = data.nrreq * data.bufsize;
-    data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
-
-    blk_register_buf(blk, data.buf, buf_size);
+    if (output_format == OFORMAT_HUMAN) {
+        const char *type = write_percent == 100 ? "write" :
+                           write_percent ? "mixed" : "read";
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+        if (njobs > 1) {
+            printf("Running %d jobs in parallel, each:\n", njobs);
+        }
+        if (offsets == BENCH_OFFSETS_SEQUENTIAL) {
+            printf("Sending %d %s requests, %d bytes each, %d in parallel "
+                   "(starting at offset %" PRId64 ", step size %d)\n",
+                   count, type, jobs[0].bufsize, depth, jobs[0].offset,
+                   jobs[0].step);
+        } else {
+            printf("Sending %d %s requests, %d bytes each, %d in parallel "
+                   "(%s offsets)\n", count, type, jobs[0].bufsize, depth,
+                   offsets == BENCH_OFFSETS_RANDOM ? "random" : "zipf");
+        }
+        if (write_percent && write_percent < 100) {
+            printf("%d%% of the requests are writes\n", write_percent);
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
     }
 
     gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    for (i = 0; i < njobs; i++) {
+        bench_submit(&jobs[i]);
+    }
 
-    while (data.n > 0) {
-        main_loop_wait(false);
+    for (i = 0; i < njobs; i++) {
+        while (jobs[i].n > 0) {
+            main_loop_wait(false);
+        }
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    /* Wait for flushes that were not drained */
+    blk_drain(blk);
+
+    secs = (t2.tv_sec - t1.tv_sec)
+           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+
+    result = g_new0(ImageBenchResult, 1);
+    result->seconds = secs;
+    /* Avoid dividing by zero for runs shorter than the clock resolution */
+    secs = MAX(secs, 1.0 / 1000000);
+    result->read = bench_ops_result(stats, BLOCK_ACCT_READ, secs);
+    result->has_read = !!result->read;
+    result->write = bench_ops_result(stats, BLOCK_ACCT_WRITE, secs);
+    result->has_write = !!result->write;
+    result->flush = bench_ops_result(stats, BLOCK_ACCT_FLUSH, secs);
+    result->has_flush = !!result->flush;
+
+    if (output_format == OFORMAT_JSON) {
+        dump_json_bench_result(result);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", result->seconds);
+        bench_print_ops("Read", result->read);
+        bench_print_ops("Write", result->write);
+        bench_print_ops("Flush", result->flush);
+    }
+    qapi_free_ImageBenchResult(result);
 
 out:
-    if (data.buf) {
-        blk_unregister_buf(blk, data.buf);
+    if (jobs) {
+        for (i = 0; i < njobs; i++) {
+            bench_cleanup(&jobs[i]);
+        }
+        g_free(jobs);
+    }
+    if (blk) {
+        block_latency_histograms_clear(blk_get_stats(blk));
     }
-    qemu_vfree(data.buf);
     blk_unref(blk);
 
     if (ret) {
@@ -1217,6 +1217,13 @@ SRST
             Specifies the AIO backend (threads/native/io_uring,
             default: threads)
 
+        ``io-uring-poll``
+            With ``aio=io_uring``, lets a kernel thread poll for
+            submissions (sq), poll the device for completions instead of
+            waiting for interrupts (io, requires ``cache.direct=on``), or
+            both (sq-io). Polling for completions keeps a host CPU busy
+            while requests are in flight. (off/sq/io/sq-io, default: off)
+
         ``locking``
             Specifies whether the image file is protected with Linux OFD
             / POSIX locks. The default is to use the Linux Open File
@@ -1294,6 +1301,30 @@ SRST
             supporting platforms, and 0 on other platforms. Setting it
             to 0 disables this feature.
 
+        ``alloc-extent-size``
+            Allocate data clusters from extents of this size in bytes
+            that are reserved in advance. Reserved clusters that are
+            still unused when QEMU crashes are leaked. The default
+            value is 0, which disables this feature.
+
+        ``metadata-journal-size``
+            Write updated L2 tables and refcount blocks to a metadata
+            journal of this size in bytes instead of in place. The
+            journal is created in the image if it is opened read-write
+            with this option, and removed if it is opened read-write
+            without it (default: 0, no journal)
+
+        ``compressed-cache-size``
+            The maximum size in bytes of this node's cache of
+            decompressed clusters. Compressed clusters stored after a
+            cluster that is read are decompressed with it (default: 0,
+            disabled)
+
+        ``worker-threads``
+            The maximum number of threads compressing, decompressing,
+            encrypting or decrypting clusters in parallel, between 1 and
+            64 (default: 4)
+
         ``pass-discard-request``
             Whether discard requests to the qcow2 device should be
             forwarded to the data source (on/off; default: on if
@@ -4440,6 +4471,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -4459,6 +4492,10 @@ SRST
     Accept incoming migration as an output from specified external
     command.
 
+``-incoming file:filename``
+    Accept incoming migration from a file previously written by
+    ``migrate file:filename``.
+
 ``-incoming defer``
     Wait for the URI to be specified via migrate\_incoming. The monitor
     can be used to change settings (such as migration parameters) prior
@@ -5478,6 +5515,14 @@ SRST
         ::
 
             (qemu) qom-set /objects/iothread1 poll-max-ns 100000
+
+    ``-object qcow2-cache-budget,id=id,size=size``
+        Limits the total memory used by the L2 table and refcount block
+        caches of all qcow2 images in the process to ``size`` bytes. The
+        caches grow with their working set up to their own maximum size
+        (``l2-cache-size``, ``refcount-cache-size``) while the budget
+        allows it. Only one such object can exist. ``size`` can be
+        changed at run-time with ``qom-set``.
 ERST
 
 
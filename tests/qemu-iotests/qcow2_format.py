@@ -282,7 +282,8 @@ class Magic(Enum):
             0x6803f857: 'Feature table',
             0x0537be77: 'Crypto header',
             QCOW2_EXT_MAGIC_BITMAPS: 'Bitmaps',
-            0x44415441: 'Data file'
+            0x44415441: 'Data file',
+            0x4a524e4c: 'Metadata journal'
         }
 
         def to_json(self):
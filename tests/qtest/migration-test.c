@@ -15,10 +15,12 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
+#include "qemu/units.h"
 #include "chardev/char.h"
 #include "qapi/qapi-visit-sockets.h"
 #include "qapi/qobject-input-visitor.h"
@@ -474,6 +476,10 @@ typedef struct {
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
     bool use_dirty_ring;
+    /* Send urgent postcopy pages on a separate channel */
+    bool postcopy_preempt;
+    /* Number of postcopy page placement threads on the destination */
+    int postcopy_place_threads;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -657,6 +663,7 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
 
     cleanup("bootsect");
     cleanup("migsocket");
+    cleanup("migfile");
     cleanup("src_serial");
     cleanup("dest_serial");
 }
@@ -666,6 +673,8 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
+    int postcopy_place_threads = args->postcopy_place_threads;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, &args)) {
@@ -676,6 +685,16 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
+    if (postcopy_place_threads) {
+        migrate_set_parameter_int(to, "postcopy-place-threads",
+                                  postcopy_place_threads);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -722,6 +741,40 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp_return;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+
+    rsp_return = migrate_query(to);
+    g_assert(qdict_haskey(rsp_return, "postcopy-latency"));
+    qobject_unref(rsp_return);
+
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_place_threads(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_place_threads = 4;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -841,6 +894,161 @@ static void test_precopy_unix_common(bool dirty_ring)
     test_migrate_end(from, to, true);
 }
 
+/* Number of devices whose state was saved or loaded by a separate thread */
+static int count_parallel_device_state(QTestState *who)
+{
+    QDict *rsp_return = migrate_query(who);
+    QListEntry *entry;
+    QList *devices;
+    int count = 0;
+
+    devices = qdict_get_qlist(rsp_return, "device-state");
+    g_assert(devices);
+    QLIST_FOREACH_ENTRY(devices, entry) {
+        QDict *dev = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (qdict_get_bool(dev, "parallel")) {
+            count++;
+        }
+    }
+    qobject_unref(rsp_return);
+
+    return count;
+}
+
+static void test_precopy_device_state_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "device-state-threads", 2);
+    migrate_set_parameter_int(to, "device-state-threads", 2);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* At least the global state supports it */
+    g_assert_cmpint(count_parallel_device_state(from), >, 0);
+    g_assert_cmpint(count_parallel_device_state(to), >, 0);
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_precopy_dirty_sync_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "dirty-sync-threads", 4);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    g_assert_cmpint(read_ram_property_int(from, "dirty-sync-time-max"), >=,
+                    read_ram_property_int(from, "dirty-sync-time"));
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_precopy_switchover_predict(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp_return, *actual;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_capability(from, "return-path", true);
+    migrate_set_capability(to, "return-path", true);
+    migrate_set_capability(from, "switchover-predict", true);
+    migrate_set_capability(to, "switchover-predict", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    rsp_return = migrate_query(from);
+    g_assert(qdict_haskey(rsp_return, "downtime-predicted"));
+    actual = qdict_get_qdict(rsp_return, "downtime-actual");
+    g_assert(actual);
+    g_assert_cmpint(qdict_get_int(actual, "total"), >=,
+                    qdict_get_int(actual, "device-state"));
+    /* Reported by the destination through the return path */
+    g_assert_cmpint(qdict_get_int(actual, "destination"), >, 0);
+    qobject_unref(rsp_return);
+
+    test_migrate_end(from, to, true);
+}
+
 static void test_precopy_unix(void)
 {
     /* Using default dirty logging */
@@ -1069,6 +1277,126 @@ static void test_migrate_fd_proto(void)
     test_migrate_end(from, to, true);
 }
 
+/*
+ * Fill the part of the migration file that holds the slots of guest RAM
+ * from end_address + 4 MiB to end_address + 20 MiB, which the guest never
+ * writes, and return an fd for it that is opened with @flags.  The pages
+ * region of the first block starts within the first 16 MiB of the file.
+ */
+static int mapped_ram_open_stale_file(const char *path, int flags)
+{
+    g_autofree uint8_t *buf = g_malloc(MiB);
+    int fd, i;
+
+    fd = open(path, O_CREAT | O_RDWR, 0660);
+    g_assert_cmpint(fd, >=, 0);
+    memset(buf, 0xff, MiB);
+    for (i = 96; i < 136; i++) {
+        g_assert_cmpint(pwrite(fd, buf, MiB, i * MiB), ==, MiB);
+    }
+    close(fd);
+
+    fd = open(path, flags);
+    g_assert_cmpint(fd, >=, 0);
+    return fd;
+}
+
+static void test_mapped_ram_common(bool lazy, bool stale)
+{
+    g_autofree char *path = g_strdup_printf("%s/migfile", tmpfs);
+    g_autofree char *uri = g_strdup_printf("file:%s", path);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    uint64_t addr;
+    int fd;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    if (stale) {
+        /* A reused file that migration does not truncate */
+        fd = mapped_ram_open_stale_file(path, O_RDWR);
+        rsp = wait_command_fd(from, fd, "{ 'execute': 'getfd',"
+                                        "  'arguments': { 'fdname': 'fd-mig' }}");
+        qobject_unref(rsp);
+        close(fd);
+        g_free(uri);
+        uri = g_strdup("fd:fd-mig");
+    }
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    if (lazy) {
+        migrate_set_capability(to, "mapped-ram-lazy", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+    /* Make sure pages dirtied during the first pass get overwritten */
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    if (stale) {
+        fd = open(path, O_RDONLY);
+        g_assert_cmpint(fd, >=, 0);
+        rsp = wait_command_fd(to, fd, "{ 'execute': 'getfd',"
+                                      "  'arguments': { 'fdname': 'fd-mig' }}");
+        qobject_unref(rsp);
+        close(fd);
+    }
+
+    /* The file is complete, load it */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    if (stale) {
+        /* Pages that were not saved must not show the old file content */
+        for (addr = end_address + 4 * MiB; addr < end_address + 20 * MiB;
+             addr += TEST_MEM_PAGE_SIZE) {
+            g_assert_cmphex(qtest_readq(to, addr), ==, 0);
+        }
+    }
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+}
+
+static void test_mapped_ram_file(void)
+{
+    test_mapped_ram_common(false, false);
+}
+
+static void test_mapped_ram_lazy(void)
+{
+    test_mapped_ram_common(true, false);
+}
+
+static void test_mapped_ram_lazy_stale(void)
+{
+    test_mapped_ram_common(true, true);
+}
+
 static void do_test_validate_uuid(MigrateStart *args, bool should_fail)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1462,12 +1790,25 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt/unix", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/place-threads",
+                   test_postcopy_place_threads);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/precopy/device-state-threads",
+                   test_precopy_device_state_threads);
+    qtest_add_func("/migration/precopy/dirty-sync-threads",
+                   test_precopy_dirty_sync_threads);
+    qtest_add_func("/migration/precopy/switchover-predict",
+                   test_precopy_switchover_predict);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/mapped-ram/file", test_mapped_ram_file);
+    qtest_add_func("/migration/mapped-ram/lazy", test_mapped_ram_lazy);
+    qtest_add_func("/migration/mapped-ram/lazy-stale",
+                   test_mapped_ram_lazy_stale);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
     qtest_add_func("/migration/validate_uuid_src_not_set",
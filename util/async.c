@@ -331,10 +331,12 @@ aio_ctx_finalize(GSource     *source)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (ctx->linux_io_uring) {
-        luring_detach_aio_context(ctx->linux_io_uring, ctx);
-        luring_cleanup(ctx->linux_io_uring);
-        ctx->linux_io_uring = NULL;
+    for (int i = 0; i < AIO_LURING_MAX; i++) {
+        if (ctx->linux_io_uring[i]) {
+            luring_detach_aio_context(ctx->linux_io_uring[i], ctx);
+            luring_cleanup(ctx->linux_io_uring[i]);
+            ctx->linux_io_uring[i] = NULL;
+        }
     }
 #endif
 
@@ -413,25 +415,27 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, unsigned int flags,
+                                      Error **errp)
 {
-    if (ctx->linux_io_uring) {
-        return ctx->linux_io_uring;
+    assert(flags < AIO_LURING_MAX);
+    if (ctx->linux_io_uring[flags]) {
+        return ctx->linux_io_uring[flags];
     }
 
-    ctx->linux_io_uring = luring_init(errp);
-    if (!ctx->linux_io_uring) {
+    ctx->linux_io_uring[flags] = luring_init(flags, errp);
+    if (!ctx->linux_io_uring[flags]) {
         return NULL;
     }
 
-    luring_attach_aio_context(ctx->linux_io_uring, ctx);
-    return ctx->linux_io_uring;
+    luring_attach_aio_context(ctx->linux_io_uring[flags], ctx);
+    return ctx->linux_io_uring[flags];
 }
 
-LuringState *aio_get_linux_io_uring(AioContext *ctx)
+LuringState *aio_get_linux_io_uring(AioContext *ctx, unsigned int flags)
 {
-    assert(ctx->linux_io_uring);
-    return ctx->linux_io_uring;
+    assert(flags < AIO_LURING_MAX && ctx->linux_io_uring[flags]);
+    return ctx->linux_io_uring[flags];
 }
 #endif
 
@@ -549,7 +553,7 @@ AioContext *aio_context_new(Error **errp)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-    ctx->linux_io_uring = NULL;
+    memset(ctx->linux_io_uring, 0, sizeof(ctx->linux_io_uring));
 #endif
 
     ctx->thread_pool = NULL;